@@ -6,17 +6,25 @@ using AOT;
 
 public class DiscordRpc
 {
-    [MonoPInvokeCallback(typeof(OnReadyInfo))]
-    public static void ReadyCallback(ref DiscordUser connectedUser) { Callbacks.readyCallback(ref connectedUser); }
+    [MonoPInvokeCallback(typeof(OnNativeReadyInfo))]
+    public static void ReadyCallback(string ipcPath, ref DiscordUser connectedUser) { Callbacks.readyCallback(ref connectedUser); }
     public delegate void OnReadyInfo(ref DiscordUser connectedUser);
+    delegate void OnNativeReadyInfo(string ipcPath, ref DiscordUser connectedUser);
 
-    [MonoPInvokeCallback(typeof(OnDisconnectedInfo))]
-    public static void DisconnectedCallback(ref DiscordUser disconnectedUser, int errorCode, string message) { Callbacks.disconnectedCallback(ref disconnectedUser, errorCode, message); }
+    [MonoPInvokeCallback(typeof(OnNativeDisconnectedInfo))]
+    public static void DisconnectedCallback(string ipcPath, IntPtr disconnectedUser, int errorCode, string message)
+    {
+        // null if the client went away before the handshake was done
+        var user = disconnectedUser == IntPtr.Zero ? new DiscordUser() : (DiscordUser)Marshal.PtrToStructure(disconnectedUser, typeof(DiscordUser));
+        Callbacks.disconnectedCallback(ref user, errorCode, message);
+    }
     public delegate void OnDisconnectedInfo(ref DiscordUser disconnectedUser, int errorCode, string message);
+    delegate void OnNativeDisconnectedInfo(string ipcPath, IntPtr disconnectedUser, int errorCode, string message);
 
-    [MonoPInvokeCallback(typeof(OnErrorInfo))]
-    public static void ErrorCallback(int errorCode, string message) { Callbacks.errorCallback(errorCode, message); }
+    [MonoPInvokeCallback(typeof(OnNativeErrorInfo))]
+    public static void ErrorCallback(string ipcPath, int errorCode, string message) { Callbacks.errorCallback(errorCode, message); }
     public delegate void OnErrorInfo(int errorCode, string message);
+    delegate void OnNativeErrorInfo(string ipcPath, int errorCode, string message);
 
     [MonoPInvokeCallback(typeof(OnJoinInfo))]
     public static void JoinCallback(string secret) { Callbacks.joinCallback(secret); }
@@ -32,6 +40,9 @@ public class DiscordRpc
 
     static EventHandlers Callbacks { get; set; }
 
+    // what the library calls, kept here so the delegates aren't collected while it may
+    static NativeEventHandlers nativeHandlers;
+
     public struct EventHandlers
     {
         public OnReadyInfo readyCallback;
@@ -42,25 +53,125 @@ public class DiscordRpc
         public OnRequestInfo requestCallback;
     }
 
+    // DiscordEventHandlers
+    [StructLayout(LayoutKind.Sequential)]
+    struct NativeEventHandlers
+    {
+        public OnNativeReadyInfo readyCallback;
+        public OnNativeDisconnectedInfo disconnectedCallback;
+        public OnNativeErrorInfo errorCallback;
+        public OnJoinInfo joinCallback;
+        public OnSpectateInfo spectateCallback;
+        public OnRequestInfo requestCallback;
+    }
+
+    // DiscordRichPresence, see discord_rpc.h for the limits
     [Serializable, StructLayout(LayoutKind.Sequential)]
     public struct RichPresenceStruct
     {
-        public IntPtr state; /* max 128 bytes */
-        public IntPtr details; /* max 128 bytes */
+        public int type;
+        public int statusDisplayType;
+        public IntPtr state; /* text */
+        public IntPtr stateUrl; /* url */
+        public IntPtr details; /* text */
+        public IntPtr detailsUrl; /* url */
         public long startTimestamp;
         public long endTimestamp;
-        public IntPtr largeImageKey; /* max 32 bytes */
-        public IntPtr largeImageText; /* max 128 bytes */
-        public IntPtr smallImageKey; /* max 32 bytes */
-        public IntPtr smallImageText; /* max 128 bytes */
-        public IntPtr partyId; /* max 128 bytes */
+        public IntPtr largeImageKey; /* key */
+        public IntPtr largeImageText; /* text */
+        public IntPtr largeImageUrl; /* url */
+        public IntPtr smallImageKey; /* key */
+        public IntPtr smallImageText; /* text */
+        public IntPtr smallImageUrl; /* url */
+        public IntPtr partyId; /* secret */
         public int partySize;
         public int partyMax;
         public int partyPrivacy;
-        public IntPtr matchSecret; /* max 128 bytes */
-        public IntPtr joinSecret; /* max 128 bytes */
-        public IntPtr spectateSecret; /* max 128 bytes */
+        public IntPtr matchSecret; /* secret */
+        public IntPtr joinSecret; /* secret */
+        public IntPtr spectateSecret; /* secret */
+        [MarshalAs(UnmanagedType.I1)]
         public bool instance;
+        public IntPtr button0Label; /* label */
+        public IntPtr button0Url; /* url */
+        public IntPtr button1Label; /* label */
+        public IntPtr button1Url; /* url */
+    }
+
+    // DiscordInitOptions; zero fields get their default
+    [StructLayout(LayoutKind.Sequential)]
+    public struct InitOptions
+    {
+        public const uint CurrentVersion = 5;
+
+        public uint version;
+        public uint maxMessageSize;
+        public uint maxFrameSize;
+        public uint joinQueueSize;
+        public uint ackQueueSize;
+        public uint pathScanIntervalMs;
+        public uint ioWaitMs;
+        public uint reconnectMinMs;
+        public uint reconnectMaxMs;
+        public uint presenceUpdates;
+        public uint presencePeriodMs;
+        public uint presenceAckTimeoutMs;
+        public uint readBudget;
+        [MarshalAs(UnmanagedType.LPStr)]
+        public string ioThreadName;
+        public uint ioThreadStackSize;
+        public int ioThreadPriority;
+        public ulong ioThreadAffinity;
+        public IntPtr ioSubmit;
+        public IntPtr ioSubmitData;
+    }
+
+    // DiscordIoStats
+    [StructLayout(LayoutKind.Sequential)]
+    public struct IoStats
+    {
+        public ulong ticks;
+        public ulong totalTickUs;
+        public ulong maxTickUs;
+        public ulong lastTickUs;
+        public ulong readBudgetHits;
+    }
+
+    public enum EventType
+    {
+        None = 0,
+        Ready = 1,
+        Disconnected = 2,
+        Errored = 3,
+        JoinGame = 4,
+        SpectateGame = 5,
+        JoinRequest = 6,
+        CommandAck = 7
+    }
+
+    // DiscordEvent, with its union left as bytes for PollEvent to pick apart
+    [StructLayout(LayoutKind.Sequential)]
+    struct EventStruct
+    {
+        public EventType type;
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = 256)]
+        public byte[] ipcPath;
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = 776)]
+        public byte[] data;
+    }
+
+    // What PollEvent hands out, only the fields of its type are set.
+    public class Event
+    {
+        public EventType type;
+        public string ipcPath;
+        public bool hasUser; /* Ready, JoinRequest, and Disconnected after the handshake */
+        public DiscordUser user;
+        public int errorCode; /* Disconnected, Errored */
+        public string message; /* Disconnected, Errored */
+        public string secret; /* JoinGame, SpectateGame */
+        public int nonce; /* CommandAck */
+        public string command; /* CommandAck */
     }
 
     [Serializable]
@@ -85,41 +196,142 @@ public class DiscordRpc
         Public = 1
     }
 
-    public static void Initialize(string applicationId, ref EventHandlers handlers, bool autoRegister, string optionalSteamId)
+    public enum ActivityType
+    {
+        Playing = 0,
+        Listening = 2,
+        Watching = 3,
+        Competing = 5
+    }
+
+    public enum StatusDisplayType
+    {
+        Name = 0,
+        State = 1,
+        Details = 2
+    }
+
+    // what ValidatePresence returns
+    public enum PresenceValidity
+    {
+        Valid = 0,
+        InvalidUtf8 = 1,
+        TooLong = 2,
+        TooShort = 3,
+        MissingUrl = 4
+    }
+
+    // errorCode of the error callback for a presence that isn't sent
+    public const int ErrorPresenceTooLarge = 3;
+    public const int ErrorPresenceInvalid = 4;
+
+    // flags of ShutdownEx
+    public const uint ShutdownFlush = 1;
+    public const uint ShutdownClearPresence = 2;
+
+    static NativeEventHandlers GetNativeHandlers(ref EventHandlers handlers)
     {
         Callbacks = handlers;
 
-        EventHandlers staticEventHandlers = new EventHandlers();
-        staticEventHandlers.readyCallback += DiscordRpc.ReadyCallback;
-        staticEventHandlers.disconnectedCallback += DiscordRpc.DisconnectedCallback;
-        staticEventHandlers.errorCallback += DiscordRpc.ErrorCallback;
-        staticEventHandlers.joinCallback += DiscordRpc.JoinCallback;
-        staticEventHandlers.spectateCallback += DiscordRpc.SpectateCallback;
-        staticEventHandlers.requestCallback += DiscordRpc.RequestCallback;
+        if (nativeHandlers.readyCallback == null)
+        {
+            nativeHandlers.readyCallback += DiscordRpc.ReadyCallback;
+            nativeHandlers.disconnectedCallback += DiscordRpc.DisconnectedCallback;
+            nativeHandlers.errorCallback += DiscordRpc.ErrorCallback;
+            nativeHandlers.joinCallback += DiscordRpc.JoinCallback;
+            nativeHandlers.spectateCallback += DiscordRpc.SpectateCallback;
+            nativeHandlers.requestCallback += DiscordRpc.RequestCallback;
+        }
+        return nativeHandlers;
+    }
 
+    public static void Initialize(string applicationId, ref EventHandlers handlers, bool autoRegister, string optionalSteamId)
+    {
+        var staticEventHandlers = GetNativeHandlers(ref handlers);
         InitializeInternal(applicationId, ref staticEventHandlers, autoRegister, optionalSteamId);
     }
 
+    /// <summary>
+    /// Initialize with options, false if already initialized or the options make no sense
+    /// </summary>
+    public static bool InitializeEx(string applicationId, ref EventHandlers handlers, bool autoRegister, string optionalSteamId, ref InitOptions options)
+    {
+        var staticEventHandlers = GetNativeHandlers(ref handlers);
+        if (options.version == 0)
+        {
+            options.version = InitOptions.CurrentVersion;
+        }
+        return InitializeExInternal(applicationId, ref staticEventHandlers, autoRegister ? 1 : 0, optionalSteamId, ref options) != 0;
+    }
+
+    public static void UpdateHandlers(ref EventHandlers handlers)
+    {
+        var staticEventHandlers = GetNativeHandlers(ref handlers);
+        UpdateHandlersInternal(ref staticEventHandlers);
+    }
+
     [DllImport("discord-rpc", EntryPoint = "Discord_Initialize", CallingConvention = CallingConvention.Cdecl)]
-    static extern void InitializeInternal(string applicationId, ref EventHandlers handlers, bool autoRegister, string optionalSteamId);
+    static extern void InitializeInternal(string applicationId, ref NativeEventHandlers handlers, bool autoRegister, string optionalSteamId);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_InitializeEx", CallingConvention = CallingConvention.Cdecl)]
+    static extern int InitializeExInternal(string applicationId, ref NativeEventHandlers handlers, int autoRegister, string optionalSteamId, ref InitOptions options);
 
     [DllImport("discord-rpc", EntryPoint = "Discord_Shutdown", CallingConvention = CallingConvention.Cdecl)]
     public static extern void Shutdown();
 
+    /// <summary>
+    /// Shutdown that first writes what flags ask for and waits up to timeoutMs for the client to answer
+    /// </summary>
+    [DllImport("discord-rpc", EntryPoint = "Discord_ShutdownEx", CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ShutdownEx(int timeoutMs, uint flags);
+
     [DllImport("discord-rpc", EntryPoint = "Discord_RunCallbacks", CallingConvention = CallingConvention.Cdecl)]
     public static extern void RunCallbacks();
 
+    /// <summary>
+    /// Blocks until there are events or timeoutMs passes, -1 waits indefinitely
+    /// </summary>
+    [DllImport("discord-rpc", EntryPoint = "Discord_WaitForEvents", CallingConvention = CallingConvention.Cdecl)]
+    public static extern int WaitForEvents(int timeoutMs);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_PollEvent", CallingConvention = CallingConvention.Cdecl)]
+    static extern int PollEventNative(ref EventStruct evt);
+
     [DllImport("discord-rpc", EntryPoint = "Discord_UpdatePresence", CallingConvention = CallingConvention.Cdecl)]
     private static extern void UpdatePresenceNative(ref RichPresenceStruct presence);
 
+    [DllImport("discord-rpc", EntryPoint = "Discord_SubmitPresence", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int SubmitPresenceNative(ref RichPresenceStruct presence);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_UpdatePresenceForPid", CallingConvention = CallingConvention.Cdecl)]
+    private static extern void UpdatePresenceForPidNative(int pid, ref RichPresenceStruct presence);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_SwitchApplication", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int SwitchApplicationNative(string applicationId, ref RichPresenceStruct presence);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_ValidatePresence", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int ValidatePresenceNative(ref RichPresenceStruct presence, out IntPtr field);
+
     [DllImport("discord-rpc", EntryPoint = "Discord_ClearPresence", CallingConvention = CallingConvention.Cdecl)]
     public static extern void ClearPresence();
 
+    [DllImport("discord-rpc", EntryPoint = "Discord_ClearPresenceForPid", CallingConvention = CallingConvention.Cdecl)]
+    public static extern void ClearPresenceForPid(int pid);
+
     [DllImport("discord-rpc", EntryPoint = "Discord_Respond", CallingConvention = CallingConvention.Cdecl)]
     public static extern void Respond(string userId, Reply reply);
 
     [DllImport("discord-rpc", EntryPoint = "Discord_UpdateHandlers", CallingConvention = CallingConvention.Cdecl)]
-    public static extern void UpdateHandlers(ref EventHandlers handlers);
+    static extern void UpdateHandlersInternal(ref NativeEventHandlers handlers);
+
+    [DllImport("discord-rpc", EntryPoint = "Discord_GetIoStats", CallingConvention = CallingConvention.Cdecl)]
+    public static extern void GetIoStats(out IoStats stats);
+
+    /// <summary>
+    /// Writes what recently happened to the connections to the file at path, as JSON
+    /// </summary>
+    [DllImport("discord-rpc", EntryPoint = "Discord_DumpFlightRecorder", CallingConvention = CallingConvention.Cdecl)]
+    public static extern int DumpFlightRecorder(string path);
 
     public static void UpdatePresence(RichPresence presence)
     {
@@ -128,19 +340,132 @@ public class DiscordRpc
         presence.FreeMem();
     }
 
+    /// <summary>
+    /// UpdatePresence that leaves serializing it to the IO thread. The strings are still converted here.
+    /// </summary>
+    public static bool SubmitPresence(RichPresence presence)
+    {
+        var presencestruct = presence.GetStruct();
+        var submitted = SubmitPresenceNative(ref presencestruct) != 0;
+        presence.FreeMem();
+        return submitted;
+    }
+
+    /// <summary>
+    /// Shows presence under another process's pid, e.g. a game a launcher started
+    /// </summary>
+    public static void UpdatePresenceForPid(int pid, RichPresence presence)
+    {
+        var presencestruct = presence.GetStruct();
+        UpdatePresenceForPidNative(pid, ref presencestruct);
+        presence.FreeMem();
+    }
+
+    public static bool SwitchApplication(string applicationId, RichPresence presence)
+    {
+        var presencestruct = presence.GetStruct();
+        var switched = SwitchApplicationNative(applicationId, ref presencestruct) != 0;
+        presence.FreeMem();
+        return switched;
+    }
+
+    /// <summary>
+    /// Checks presence the way Discord would, field is the name of the one with the problem
+    /// </summary>
+    public static PresenceValidity ValidatePresence(RichPresence presence, out string field)
+    {
+        var presencestruct = presence.GetStruct();
+        IntPtr fieldPtr;
+        var result = (PresenceValidity)ValidatePresenceNative(ref presencestruct, out fieldPtr);
+        presence.FreeMem();
+        field = result == PresenceValidity.Valid ? null : Marshal.PtrToStringAnsi(fieldPtr);
+        return result;
+    }
+
+    /// <summary>
+    /// Alternative to the callbacks: the next pending event, or null if there is none
+    /// </summary>
+    public static Event PollEvent()
+    {
+        var native = new EventStruct();
+        native.ipcPath = new byte[256];
+        native.data = new byte[776];
+        if (PollEventNative(ref native) == 0)
+        {
+            return null;
+        }
+        var evt = new Event();
+        evt.type = native.type;
+        evt.ipcPath = Utf8ToStr(native.ipcPath, 0, 256);
+        var data = native.data;
+        switch (native.type)
+        {
+            case EventType.Ready:
+            case EventType.JoinRequest:
+                evt.hasUser = true;
+                evt.user = EventUser(data, 0);
+                break;
+            case EventType.Disconnected:
+                evt.hasUser = BitConverter.ToInt32(data, 0) != 0;
+                if (evt.hasUser)
+                {
+                    evt.user = EventUser(data, 4);
+                }
+                evt.errorCode = BitConverter.ToInt32(data, 516);
+                evt.message = Utf8ToStr(data, 520, 256);
+                break;
+            case EventType.Errored:
+                evt.errorCode = BitConverter.ToInt32(data, 0);
+                evt.message = Utf8ToStr(data, 4, 256);
+                break;
+            case EventType.JoinGame:
+            case EventType.SpectateGame:
+                evt.secret = Utf8ToStr(data, 0, 256);
+                break;
+            case EventType.CommandAck:
+                evt.nonce = BitConverter.ToInt32(data, 0);
+                evt.command = Utf8ToStr(data, 4, 64);
+                break;
+        }
+        return evt;
+    }
+
+    // DiscordEventUser: userId[32], username[344], discriminator[8], avatar[128]
+    static DiscordUser EventUser(byte[] data, int offset)
+    {
+        var user = new DiscordUser();
+        user.userId = Utf8ToStr(data, offset, 32);
+        user.username = Utf8ToStr(data, offset + 32, 344);
+        user.discriminator = Utf8ToStr(data, offset + 376, 8);
+        user.avatar = Utf8ToStr(data, offset + 384, 128);
+        return user;
+    }
+
+    static string Utf8ToStr(byte[] data, int offset, int size)
+    {
+        var length = Array.IndexOf(data, (byte)0, offset, size);
+        return Encoding.UTF8.GetString(data, offset, (length < 0 ? offset + size : length) - offset);
+    }
+
     public class RichPresence
     {
         private RichPresenceStruct _presence;
         private readonly List<IntPtr> _buffers = new List<IntPtr>(10);
 
-        public string state; /* max 128 bytes */
-        public string details; /* max 128 bytes */
+        public ActivityType type;
+        public StatusDisplayType statusDisplayType;
+        public string state; /* max 128 code points */
+        public string stateUrl; /* max 256 bytes */
+        public string details; /* max 128 code points */
+        public string detailsUrl; /* max 256 bytes */
         public long startTimestamp;
         public long endTimestamp;
-        public string largeImageKey; /* max 32 bytes */
-        public string largeImageText; /* max 128 bytes */
-        public string smallImageKey; /* max 32 bytes */
-        public string smallImageText; /* max 128 bytes */
+        public string largeImageKey; /* max 256 bytes */
+        public string largeImageText; /* max 128 code points */
+        public string largeImageUrl; /* max 256 bytes */
+        public string smallImageKey; /* max 256 bytes */
+        public string smallImageText; /* max 128 code points */
+        public string smallImageUrl; /* max 256 bytes */
         public string partyId; /* max 128 bytes */
         public int partySize;
         public int partyMax;
@@ -149,6 +474,10 @@ public class DiscordRpc
         public string joinSecret; /* max 128 bytes */
         public string spectateSecret; /* max 128 bytes */
         public bool instance;
+        public string button0Label; /* max 32 code points */
+        public string button0Url; /* max 256 bytes */
+        public string button1Label; /* max 32 code points */
+        public string button1Url; /* max 256 bytes */
 
         /// <summary>
         /// Get the <see cref="RichPresenceStruct"/> reprensentation of this instance
@@ -161,14 +490,20 @@ public class DiscordRpc
                 FreeMem();
             }
 
+            _presence.type = (int)type;
+            _presence.statusDisplayType = (int)statusDisplayType;
             _presence.state = StrToPtr(state);
+            _presence.stateUrl = StrToPtr(stateUrl);
             _presence.details = StrToPtr(details);
+            _presence.detailsUrl = StrToPtr(detailsUrl);
             _presence.startTimestamp = startTimestamp;
             _presence.endTimestamp = endTimestamp;
             _presence.largeImageKey = StrToPtr(largeImageKey);
             _presence.largeImageText = StrToPtr(largeImageText);
+            _presence.largeImageUrl = StrToPtr(largeImageUrl);
             _presence.smallImageKey = StrToPtr(smallImageKey);
             _presence.smallImageText = StrToPtr(smallImageText);
+            _presence.smallImageUrl = StrToPtr(smallImageUrl);
             _presence.partyId = StrToPtr(partyId);
             _presence.partySize = partySize;
             _presence.partyMax = partyMax;
@@ -177,6 +512,10 @@ public class DiscordRpc
             _presence.joinSecret = StrToPtr(joinSecret);
             _presence.spectateSecret = StrToPtr(spectateSecret);
             _presence.instance = instance;
+            _presence.button0Label = StrToPtr(button0Label);
+            _presence.button0Url = StrToPtr(button0Url);
+            _presence.button1Label = StrToPtr(button1Label);
+            _presence.button1Url = StrToPtr(button1Url);
 
             return _presence;
         }
@@ -0,0 +1,214 @@
+/*
+    Measures what updating presence costs the calling thread.
+
+    presence-bench patch
+        Discord_UpdatePresenceFields on a compiled presence against Discord_UpdatePresence with the
+        whole presence, changing the state each time.
+
+    presence-bench submit
+        Discord_SubmitPresence against Discord_UpdatePresence from 1, 2 and 4 threads at once,
+        each updating about every 20 us for 1.5 s while the IO thread writes what it gets.
+
+    presence-bench validate
+        Discord_ValidatePresence against the calls that check the same presence and then write it
+        as JSON: Discord_CompilePresence (with Discord_FreePresence), which does little else but
+        allocate the handle, and Discord_UpdatePresence, which also hands it to the IO thread.
+
+    Runs against whatever Discord clients are up; with none, only the library's own work is
+    measured.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "discord_rpc.h"
+
+static const char* APPLICATION_ID = "345229890980937739";
+
+using Clock = std::chrono::steady_clock;
+
+struct Latencies {
+    std::vector<double> ns;
+
+    void Add(const Latencies& other) { ns.insert(ns.end(), other.ns.begin(), other.ns.end()); }
+
+    void Print(const char* name)
+    {
+        std::sort(ns.begin(), ns.end());
+        double total = 0;
+        for (double n : ns) {
+            total += n;
+        }
+        printf("%-24s n=%zu mean=%.0f p50=%.0f p99=%.0f p99.9=%.0f max=%.0f ns\n",
+               name,
+               ns.size(),
+               total / ns.size(),
+               ns[ns.size() / 2],
+               ns[ns.size() * 99 / 100],
+               ns[ns.size() * 999 / 1000],
+               ns.back());
+    }
+};
+
+// A presence with a bit of everything, as a game would send it.
+static void FillPresence(DiscordRichPresence& presence, const char* state)
+{
+    memset(&presence, 0, sizeof(presence));
+    presence.state = state;
+    presence.details = "Competitive - Dust II";
+    presence.startTimestamp = 1700000000;
+    presence.largeImageKey = "map_dust2";
+    presence.largeImageText = "Dust II";
+    presence.smallImageKey = "rank_12";
+    presence.smallImageText = "Supreme Master First Class";
+    presence.partyId = "party-1234567890";
+    presence.partySize = 3;
+    presence.partyMax = 5;
+    presence.buttons[0].label = "Watch";
+    presence.buttons[0].url = "https://example.com/watch/1234567890";
+}
+
+template <typename Update>
+static Latencies Measure(int count, Update&& update)
+{
+    Latencies latencies;
+    latencies.ns.reserve(count);
+    char state[64];
+    for (int i = 0; i < count; ++i) {
+        snprintf(state, sizeof(state), "Round %d of 30", i % 30 + 1);
+        auto start = Clock::now();
+        update(state);
+        auto elapsed = Clock::now() - start;
+        latencies.ns.push_back(std::chrono::duration<double, std::nano>(elapsed).count());
+    }
+    return latencies;
+}
+
+static void BenchPatch(int count)
+{
+    DiscordRichPresence presence;
+    Measure(count, [&](const char* state) {
+        FillPresence(presence, state);
+        Discord_UpdatePresence(&presence);
+    }).Print("UpdatePresence");
+
+    FillPresence(presence, "Round 1 of 30");
+    DiscordPresenceHandle* handle = Discord_CompilePresence(&presence);
+    Discord_UpdatePresenceHandle(handle);
+    DiscordRichPresence fields;
+    memset(&fields, 0, sizeof(fields));
+    Measure(count, [&](const char* state) {
+        fields.state = state;
+        Discord_UpdatePresenceFields(handle, DISCORD_PRESENCE_FIELD_STATE, &fields);
+    }).Print("UpdatePresenceFields");
+    Discord_FreePresence(handle);
+}
+
+static void BenchValidate(int count)
+{
+    DiscordRichPresence presence;
+    int invalid = 0;
+    Measure(count, [&](const char* state) {
+        FillPresence(presence, state);
+        invalid += Discord_ValidatePresence(&presence, nullptr) != DISCORD_PRESENCE_VALID;
+    }).Print("ValidatePresence");
+    Measure(count, [&](const char* state) {
+        FillPresence(presence, state);
+        Discord_FreePresence(Discord_CompilePresence(&presence));
+    }).Print("CompilePresence");
+    Measure(count, [&](const char* state) {
+        FillPresence(presence, state);
+        Discord_UpdatePresence(&presence);
+    }).Print("UpdatePresence");
+    if (invalid) {
+        printf("%-24s %d turned down\n", "", invalid);
+    }
+}
+
+// Each of threadCount threads calls update(presence) about every 20 us until time is up; update
+// returns false for a presence that wasn't taken.
+template <typename Update>
+static void MeasureThreads(const char* name, int threadCount, Update&& update)
+{
+    std::atomic<bool> stop{false};
+    std::atomic<int> refused{0};
+    std::vector<Latencies> latencies(threadCount);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t] {
+            DiscordRichPresence presence;
+            char state[64];
+            for (int i = 0; !stop.load(); ++i) {
+                snprintf(state, sizeof(state), "Round %d of 30 (thread %d)", i % 30 + 1, t);
+                FillPresence(presence, state);
+                auto start = Clock::now();
+                bool taken = update(presence);
+                auto elapsed = Clock::now() - start;
+                auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+                latencies[t].ns.push_back(ns);
+                if (!taken) {
+                    ++refused;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    stop = true;
+    Latencies all;
+    for (int t = 0; t < threadCount; ++t) {
+        threads[t].join();
+        all.Add(latencies[t]);
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "%s x%d", name, threadCount);
+    all.Print(label);
+    if (refused.load()) {
+        printf("%-24s %d not taken\n", "", refused.load());
+    }
+}
+
+static void BenchSubmit()
+{
+    for (int threadCount = 1; threadCount <= 4; threadCount *= 2) {
+        MeasureThreads("UpdatePresence", threadCount, [](const DiscordRichPresence& presence) {
+            Discord_UpdatePresence(&presence);
+            return true;
+        });
+        MeasureThreads("SubmitPresence", threadCount, [](const DiscordRichPresence& presence) {
+            return Discord_SubmitPresence(&presence) != 0;
+        });
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* mode = argc > 1 ? argv[1] : "patch";
+    DiscordEventHandlers handlers;
+    memset(&handlers, 0, sizeof(handlers));
+    Discord_Initialize(APPLICATION_ID, &handlers, 0, NULL);
+    // give clients that are up a moment to connect
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    printf("connected: %s\n", Discord_Connected() ? "yes" : "no");
+
+    if (strcmp(mode, "patch") == 0) {
+        BenchPatch(100000);
+    }
+    else if (strcmp(mode, "submit") == 0) {
+        BenchSubmit();
+    }
+    else if (strcmp(mode, "validate") == 0) {
+        BenchValidate(100000);
+    }
+    else {
+        fprintf(stderr, "usage: presence-bench [patch|submit|validate]\n");
+    }
+
+    Discord_Shutdown();
+    return 0;
+}
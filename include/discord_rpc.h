@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 // clang-format off
@@ -30,10 +31,18 @@ extern "C" {
 #define DISCORD_PRESENCE_MAX_BUTTON_LABEL_LENGTH 32
 #define DISCORD_PRESENCE_MAX_BUTTON_COUNT 2
 #define DISCORD_PRESENCE_MAX_URL_LENGTH 256
+#define DISCORD_PRESENCE_MAX_SECRET_LENGTH 128
+
+/* what Discord_ValidatePresence returns */
+#define DISCORD_PRESENCE_VALID 0
+#define DISCORD_PRESENCE_INVALID_UTF8 1
+#define DISCORD_PRESENCE_TOO_LONG 2
+#define DISCORD_PRESENCE_TOO_SHORT 3
+#define DISCORD_PRESENCE_MISSING_URL 4 /* a button with a label needs a url */
 
 typedef struct DiscordButton {
-    const char* label; /* FIXME limit? */
-    const char* url;   /* max 256 bytes */
+    const char* label; /* label */
+    const char* url;   /* url */
 } DiscordButton;
 
 typedef enum DiscordActivityType {
@@ -66,17 +75,39 @@ typedef struct DiscordRichPresence {
     const char* smallImageKey;  // key
     const char* smallImageText; // text
     const char* smallImageUrl;  // url
-    const char* partyId;        // max 128 bytes
+    const char* partyId;        // secret
     int partySize;
     int partyMax;
     int partyPrivacy;
-    const char* matchSecret;    // max 128 bytes
-    const char* joinSecret;     // max 128 bytes
-    const char* spectateSecret; // max 128 bytes
+    const char* matchSecret;    // secret
+    const char* joinSecret;     // secret
+    const char* spectateSecret; // secret
     int8_t instance;
     DiscordButton buttons[DISCORD_PRESENCE_MAX_BUTTON_COUNT];
 } DiscordRichPresence;
 
+/* Fields of a compiled presence that can be changed with Discord_UpdatePresenceFields */
+#define DISCORD_PRESENCE_FIELD_STATE 0x1
+#define DISCORD_PRESENCE_FIELD_DETAILS 0x2
+#define DISCORD_PRESENCE_FIELD_START_TIMESTAMP 0x4
+#define DISCORD_PRESENCE_FIELD_END_TIMESTAMP 0x8
+
+typedef struct DiscordPresenceHandle DiscordPresenceHandle;
+
+/* see Discord_CreateContext */
+typedef struct DiscordContext DiscordContext;
+
+/* see Discord_SetAllocator */
+typedef void* (*DiscordAllocFn)(size_t size, void* userData);
+typedef void (*DiscordFreeFn)(void* ptr, void* userData);
+
+/* see DiscordInitOptions::ioSubmit */
+typedef void (*DiscordIoTaskFn)(void* taskData);
+typedef void (*DiscordIoSubmitFn)(DiscordIoTaskFn task,
+                                  void* taskData,
+                                  uint32_t delayMs,
+                                  void* userData);
+
 typedef struct DiscordUser {
     const char* userId;
     const char* username;
@@ -98,39 +129,363 @@ typedef struct DiscordEventHandlers {
     void (*joinRequest)(const DiscordUser* request);
 } DiscordEventHandlers;
 
+typedef enum DiscordEventType {
+    DiscordEventType_None = 0,
+    DiscordEventType_Ready = 1,
+    DiscordEventType_Disconnected = 2,
+    DiscordEventType_Errored = 3,
+    DiscordEventType_JoinGame = 4,
+    DiscordEventType_SpectateGame = 5,
+    DiscordEventType_JoinRequest = 6,
+    DiscordEventType_CommandAck = 7
+} DiscordEventType;
+
+/* like DiscordUser, but the strings are stored inline */
+typedef struct DiscordEventUser {
+    char userId[32];
+    char username[344];
+    char discriminator[8];
+    char avatar[128];
+} DiscordEventUser;
+
+typedef struct DiscordEvent {
+    DiscordEventType type;
+    char ipcPath[256]; /* connection the event came from, empty if unknown */
+    union {
+        struct {
+            DiscordEventUser user;
+        } ready;
+        struct {
+            int hasUser; /* 0 if the client disconnected before completing the handshake */
+            DiscordEventUser user;
+            int errorCode;
+            char message[256];
+        } disconnected;
+        struct {
+            int errorCode;
+            char message[256];
+        } errored;
+        struct {
+            char secret[256];
+        } joinGame;
+        struct {
+            char secret[256];
+        } spectateGame;
+        struct {
+            DiscordEventUser user;
+        } joinRequest;
+        struct {
+            int nonce;
+            char command[64]; /* e.g. "SET_ACTIVITY" */
+        } commandAck;
+    } data;
+} DiscordEvent;
+
+/* Outbound traffic of one connection, by lane. Each time a connection is serviced its lanes are
+   written in priority order: control (subscriptions), join replies, then presence. */
+typedef struct DiscordLaneStats {
+    uint32_t sent;
+    uint32_t dropped;  /* didn't fit the lane (join replies) */
+    uint32_t replaced; /* superseded before it was sent (presence, latest wins) */
+    uint32_t pending;  /* waiting to be sent right now */
+    uint64_t totalQueueTimeUs;
+    uint64_t maxQueueTimeUs;
+} DiscordLaneStats;
+
+/* time from writing a presence to its response, for the latest write only */
+typedef struct DiscordAckStats {
+    uint32_t acked;
+    uint32_t timedOut; /* gave up waiting, see presenceAckTimeoutMs */
+    uint64_t totalAckTimeUs;
+    uint64_t maxAckTimeUs;
+    uint64_t lastAckTimeUs;
+} DiscordAckStats;
+
+/* Set version to DISCORD_CONNECTION_STATS_VERSION before asking for them; the fields of later
+   versions than that are left alone, so the struct can grow. */
+#define DISCORD_CONNECTION_STATS_VERSION 2
+typedef struct DiscordConnectionStats {
+    uint32_t version;
+    DiscordLaneStats control;
+    DiscordLaneStats joinReply;
+    DiscordLaneStats presence;
+    /* version 2 */
+    DiscordAckStats presenceAcks;
+} DiscordConnectionStats;
+
+/* connection updates, one per IO thread tick or Discord_UpdateConnection, across all contexts */
+typedef struct DiscordIoStats {
+    uint64_t ticks;
+    uint64_t totalTickUs;
+    uint64_t maxTickUs;
+    uint64_t lastTickUs;
+    uint64_t readBudgetHits; /* a connection had more to read than readBudget */
+} DiscordIoStats;
+
+/* Tuning for Discord_InitializeEx. Zero any fields you don't care about, they get the default
+   noted next to them; set version to DISCORD_INIT_OPTIONS_VERSION. */
+#define DISCORD_INIT_OPTIONS_VERSION 5
+typedef struct DiscordInitOptions {
+    uint32_t version;
+    uint32_t maxMessageSize;     /* 16K, largest presence; has to fit a frame. Larger ones aren't
+                                    sent, see DISCORD_ERROR_PRESENCE_TOO_LARGE */
+    uint32_t maxFrameSize;       /* 64K, largest IPC frame sent or received, at least 4K */
+    uint32_t joinQueueSize;      /* 8, join requests and replies pending per connection */
+    uint32_t ackQueueSize;       /* 8, command acks pending for Discord_PollEvent */
+    uint32_t pathScanIntervalMs; /* 10000, how often to look for new Discord clients */
+    uint32_t ioWaitMs;           /* 500, longest the IO thread sleeps without activity */
+    uint32_t reconnectMinMs;     /* 500, reconnect backoff bounds */
+    uint32_t reconnectMaxMs;     /* 10000 */
+    /* version 2 */
+    uint32_t presenceUpdates;    /* 5 presence writes per connection every presencePeriodMs, */
+    uint32_t presencePeriodMs;   /* 20000, Discord's rate limit. An update past it waits for its
+                                    turn, replaced by any that comes along meanwhile */
+    /* version 3 */
+    uint32_t presenceAckTimeoutMs; /* 0 for off. Otherwise at most one presence is in flight per
+                                      connection: the next waits for the response to the last one,
+                                      or this long, so updates go as fast as the client keeps up */
+    /* version 4 */
+    uint32_t readBudget; /* 16, messages read per connection per tick, so a chatty client doesn't
+                            hold up the others; the rest is read right after */
+    /* version 5: the IO thread, which goes by the options of the context that starts it. All of
+       these are ignored with DISCORD_DISABLE_IO_THREAD. */
+    const char* ioThreadName;   /* "discord-rpc-io", copied; at most 15 bytes show on Linux */
+    uint32_t ioThreadStackSize; /* the platform's default; 32K is plenty */
+    int32_t ioThreadPriority;   /* 0 leaves it alone, -2 (lowest) to 2 (highest). Linux and
+                                   Windows only, raising it on Linux takes CAP_SYS_NICE */
+    uint64_t ioThreadAffinity;  /* 0 for any CPU, otherwise bit n for CPU n; not on macOS */
+    /* Executor mode: with ioSubmit set there is no IO thread, the library has ioSubmit run
+       task(taskData) on the caller's scheduler delayMs from now (or later) for each tick of IO
+       work, with ioSubmitData as userData. ioSubmit must not run the task before returning; tasks
+       may run on any thread, in any order, and ones that became redundant or that run after
+       Discord_Shutdown return right away. ioSubmit is called with none of the library's locks
+       held, and not anymore once Discord_Shutdown returns. */
+    DiscordIoSubmitFn ioSubmit;
+    void* ioSubmitData;
+} DiscordInitOptions;
+
 #define DISCORD_REPLY_NO 0
 #define DISCORD_REPLY_YES 1
 #define DISCORD_REPLY_IGNORE 2
 #define DISCORD_PARTY_PRIVATE 0
 #define DISCORD_PARTY_PUBLIC 1
 
+/* errorCode of the errored event for a presence that serialized to more than maxMessageSize. It
+   isn't sent, the presence it was to replace stays. */
+#define DISCORD_ERROR_PRESENCE_TOO_LARGE 3
+/* errorCode of the errored event for a presence Discord_ValidatePresence turns down, which isn't
+   sent either. The message names the field. */
+#define DISCORD_ERROR_PRESENCE_INVALID 4
+
+/* Routes everything the library allocates to alloc and free, which get userData along. Applies to
+   allocations from then on, memory always goes back to the hooks it came from, so this can be
+   called at any time. NULL hooks go back to malloc and free. Returns 0 once 16 different hooks
+   were set. After initializing, updating connections, running callbacks and updating presence
+   allocate nothing unless connections come or go, or a presence is larger than any before. The
+   threads the library starts are the exception, the C++ runtime allocates their state. */
+DISCORD_EXPORT int Discord_SetAllocator(DiscordAllocFn alloc, DiscordFreeFn free, void* userData);
+
+/* With autoRegister, Discord_Register (or Discord_RegisterSteamGame with optionalSteamId) runs on
+   a thread of its own, so it doesn't hold up startup; Discord_Shutdown waits for it. */
 DISCORD_EXPORT void Discord_Initialize(const char* applicationId,
                                        DiscordEventHandlers* handlers,
                                        int autoRegister,
                                        const char* optionalSteamId);
+/* Discord_Initialize with options, which may be null for the defaults. Returns 1 on success, 0
+   if already initialized or the options are invalid. */
+DISCORD_EXPORT int Discord_InitializeEx(const char* applicationId,
+                                        DiscordEventHandlers* handlers,
+                                        int autoRegister,
+                                        const char* optionalSteamId,
+                                        const DiscordInitOptions* options);
 DISCORD_EXPORT bool Discord_Connected(void);
+
+/* Moves to another application id without a gap in presence: while the connections under the
+   current id stay up, new ones are made under applicationId and sent presence (which may be
+   null). Each old connection is closed once the new one to the same Discord client has sent it,
+   or after 10 seconds at the latest. Only the new connections report ready/disconnected. Doesn't
+   register applicationId, call Discord_Register for that. Returns 0 if not initialized or
+   presence doesn't pass Discord_ValidatePresence. */
+DISCORD_EXPORT int Discord_SwitchApplication(const char* applicationId,
+                                             const DiscordRichPresence* presence);
 DISCORD_EXPORT void Discord_Shutdown(void);
 
+/* What Discord_ShutdownEx writes to every open connection before closing it */
+#define DISCORD_SHUTDOWN_FLUSH 1          /* presence and join replies still queued */
+#define DISCORD_SHUTDOWN_CLEAR_PRESENCE 2 /* a cleared presence, so none is left behind */
+/* Discord_Shutdown that first writes what flags ask for, then waits for the client to answer the
+   presence, for at most timeoutMs (0 writes, after an IO tick that's under way, without waiting
+   for answers). The IO thread stops right away, without finishing its wait or starting another
+   tick. With timeoutMs above 0 the whole call returns by then: an IO tick or an autoRegister
+   registration still running at that point is left to finish on its own, nothing is written if
+   that tick was still going, and the poll fd and cached paths stay for the next
+   Discord_Initialize. Returns 1 if every open connection got everything and answered in time, 0
+   if not or if not initialized. */
+DISCORD_EXPORT int Discord_ShutdownEx(int timeoutMs, uint32_t flags);
+
 /* checks for incoming messages, dispatches callbacks */
 DISCORD_EXPORT void Discord_RunCallbacks(void);
 
+/* Blocks until there are events for Discord_RunCallbacks/Discord_PollEvent or timeoutMs passes
+   (-1 waits indefinitely). Returns 1 if there are events, 0 on timeout or if not initialized.
+   Discord_Shutdown wakes up any waiting thread, which then returns 0. With
+   DISCORD_DISABLE_IO_THREAD this calls Discord_UpdateConnection as needed while waiting. */
+DISCORD_EXPORT int Discord_WaitForEvents(int timeoutMs);
+
+/* Alternative to the handlers: copies the next pending event into *event and returns 1, or
+   returns 0 if there is none. Events come in the same order Discord_RunCallbacks would fire them,
+   which consumes the same events, so use one or the other. Command acks are only reported here,
+   the ones that come in after the first call; apps that never call it don't get woken by them. */
+DISCORD_EXPORT int Discord_PollEvent(DiscordEvent* event);
+
 /* If you disable the lib starting its own io thread, you'll need to call this from your own */
 #ifdef DISCORD_DISABLE_IO_THREAD
 DISCORD_EXPORT void Discord_UpdateConnection(void);
 #endif
 
+/* For hosts with their own event loop (Linux only, -1 elsewhere): a file descriptor that becomes
+   readable when the library has something to do. With DISCORD_DISABLE_IO_THREAD that's IPC
+   traffic or queued work, so call Discord_UpdateConnection and then Discord_RunCallbacks; with
+   the IO thread it means events are ready for Discord_RunCallbacks/Discord_PollEvent.
+   Valid from Discord_Initialize until Discord_Shutdown. */
+DISCORD_EXPORT int Discord_GetPollFd(void);
+/* Milliseconds until Discord_UpdateConnection has to be called even if the poll fd stays quiet
+   (reconnects, path scans), 0 for right away and -1 if there is no such deadline. */
+DISCORD_EXPORT int Discord_GetNextTimeoutMs(void);
+
 DISCORD_EXPORT void Discord_UpdatePresence(const DiscordRichPresence* presence);
 DISCORD_EXPORT void Discord_ClearPresence(void);
+/* Like Discord_UpdatePresence (null clears it), for threads that can't wait on a lock, such as an
+   audio or render thread: it takes none and doesn't allocate, it only copies the strings as far
+   as they can be sent and wakes the IO thread, which checks and serializes the presence on its
+   next tick and reports problems through the errored event as usual. The last submission wins,
+   one that's followed by Discord_UpdatePresence, Discord_UpdatePresenceHandle or
+   Discord_SwitchApplication before the IO thread got to it is dropped.
+   Returns 0 if it couldn't be submitted without waiting, which only happens when two other
+   threads are submitting to the same context at that moment. With DiscordInitOptions::ioSubmit
+   the wakeup is a call to it, made after a short lock of the library's. */
+DISCORD_EXPORT int Discord_SubmitPresence(const DiscordRichPresence* presence);
+
+/* Checks presence against the limits at the top of this file, the way Discord would, without
+   sending anything. Every string has to be valid UTF-8. Text fields (see the comments in
+   DiscordRichPresence) and button labels have a minimum length in code points; past the maximum
+   they are cut off at a code point boundary when sent rather than turned down. Keys, urls and
+   secrets have to fit their maximum in bytes. Returns DISCORD_PRESENCE_VALID, or the first
+   problem found and, if field isn't null, the name of the field it is in (e.g. "state" or
+   "buttons[1].url"). The presence functions check this first and report a problem through the
+   errored event with DISCORD_ERROR_PRESENCE_INVALID instead of sending the presence. */
+DISCORD_EXPORT int Discord_ValidatePresence(const DiscordRichPresence* presence,
+                                            const char** field);
+
+/* Precompiled presences: everything but the DISCORD_PRESENCE_FIELD_* fields is serialized once,
+   so updating those fields or switching between handles (e.g. playing/paused) is cheap.
+   Discord_CompilePresence copies what it needs from presence and returns null on failure,
+   which includes a presence Discord_ValidatePresence turns down. A handle can be patched and
+   sent from several threads at once, and freed while that's under way, in which case it goes
+   away once those calls are done with it; it must not be passed to anything after it was freed. */
+DISCORD_EXPORT DiscordPresenceHandle* Discord_CompilePresence(const DiscordRichPresence* presence);
+/* Takes the fields in mask from fields (everything else in it is ignored); if handle is the
+   current presence of any context, the change is sent right away. Fields that don't pass
+   Discord_ValidatePresence leave the handle as it was. */
+DISCORD_EXPORT void Discord_UpdatePresenceFields(DiscordPresenceHandle* handle,
+                                                 uint32_t mask,
+                                                 const DiscordRichPresence* fields);
+/* Makes handle the current presence, like Discord_UpdatePresence does for a presence */
+DISCORD_EXPORT void Discord_UpdatePresenceHandle(DiscordPresenceHandle* handle);
+DISCORD_EXPORT void Discord_FreePresence(DiscordPresenceHandle* handle);
 
 /* Per-user variants: target a specific connected client by its userId */
 DISCORD_EXPORT void Discord_UpdatePresenceForUser(const char* userId,
                                                   const DiscordRichPresence* presence);
 DISCORD_EXPORT void Discord_ClearPresenceForUser(const char* userId);
 
+/* Per-pid variants: show a presence under another pid over this process's connections, e.g. one
+   for each game a launcher runs. Each pid is paced on its own by presenceUpdates, and clients that
+   connect later get it too. DISCORD_SHUTDOWN_CLEAR_PRESENCE clears them along with our own. A pid
+   of 0 or less, or this process's own, is ignored. */
+DISCORD_EXPORT void Discord_UpdatePresenceForPid(int pid, const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ClearPresenceForPid(int pid);
+
 DISCORD_EXPORT void Discord_Respond(const char* userid, /* DISCORD_REPLY_ */ int reply);
 
 DISCORD_EXPORT void Discord_UpdateHandlers(DiscordEventHandlers* handlers);
 
+/* Fills *stats for the connection on ipcPath (as reported in events and callbacks) and returns 1,
+   or returns 0 if there is no such connection or stats->version isn't one this library knows.
+   Counters accumulate across reconnects. */
+DISCORD_EXPORT int Discord_GetConnectionStats(const char* ipcPath, DiscordConnectionStats* stats);
+/* Fills *stats for the connection updates so far, whether or not initialized */
+DISCORD_EXPORT void Discord_GetIoStats(DiscordIoStats* stats);
+/* Writes the last 512 things that happened to the connections of all contexts to the file at path,
+   as JSON, for when something needs explaining after the fact: frames written and read with the
+   start of their payload (as payloadHex where that isn't valid UTF-8), connection state changes,
+   reconnect delays and IPC paths showing up or going away. They are always recorded, at the cost
+   of a copy each. Returns 0 if the file couldn't be written. */
+DISCORD_EXPORT int Discord_DumpFlightRecorder(const char* path);
+
+/* Contexts run several application ids (or instances of one) side by side, each with its own
+   handlers, presence, events and connections, all served by the same IO thread. The functions
+   above work on a default context that Discord_Initialize creates and Discord_Shutdown destroys.
+   Handlers aren't told which context they fire for; use Discord_ContextPollEvent where that
+   matters. Discord_UpdateConnection, Discord_GetPollFd and Discord_GetNextTimeoutMs cover all
+   contexts, so run callbacks for each of them when the poll fd fires. */
+DISCORD_EXPORT DiscordContext* Discord_CreateContext(const char* applicationId,
+                                                     DiscordEventHandlers* handlers,
+                                                     int autoRegister,
+                                                     const char* optionalSteamId,
+                                                     const DiscordInitOptions* options);
+DISCORD_EXPORT void Discord_DestroyContext(DiscordContext* context);
+DISCORD_EXPORT int Discord_DestroyContextEx(DiscordContext* context,
+                                            int timeoutMs,
+                                            uint32_t flags);
+DISCORD_EXPORT bool Discord_ContextConnected(DiscordContext* context);
+DISCORD_EXPORT int Discord_ContextSwitchApplication(DiscordContext* context,
+                                                    const char* applicationId,
+                                                    const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ContextRunCallbacks(DiscordContext* context);
+DISCORD_EXPORT int Discord_ContextWaitForEvents(DiscordContext* context, int timeoutMs);
+DISCORD_EXPORT int Discord_ContextPollEvent(DiscordContext* context, DiscordEvent* event);
+DISCORD_EXPORT void Discord_ContextUpdatePresence(DiscordContext* context,
+                                                  const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ContextClearPresence(DiscordContext* context);
+DISCORD_EXPORT int Discord_ContextSubmitPresence(DiscordContext* context,
+                                                 const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ContextUpdatePresenceHandle(DiscordContext* context,
+                                                        DiscordPresenceHandle* handle);
+DISCORD_EXPORT void Discord_ContextUpdatePresenceForUser(DiscordContext* context,
+                                                         const char* userId,
+                                                         const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ContextClearPresenceForUser(DiscordContext* context,
+                                                        const char* userId);
+DISCORD_EXPORT void Discord_ContextUpdatePresenceForPid(DiscordContext* context,
+                                                        int pid,
+                                                        const DiscordRichPresence* presence);
+DISCORD_EXPORT void Discord_ContextClearPresenceForPid(DiscordContext* context, int pid);
+DISCORD_EXPORT void Discord_ContextRespond(DiscordContext* context,
+                                           const char* userid,
+                                           /* DISCORD_REPLY_ */ int reply);
+DISCORD_EXPORT void Discord_ContextUpdateHandlers(DiscordContext* context,
+                                                  DiscordEventHandlers* handlers);
+DISCORD_EXPORT int Discord_ContextGetConnectionStats(DiscordContext* context,
+                                                     const char* ipcPath,
+                                                     DiscordConnectionStats* stats);
+
+/* Broker mode, Linux only: one process owns the connections to Discord and shows the presence of
+   producer processes next to its own, each under the producer's pid, so they need no connections,
+   buffers or IO thread of their own. The broker starts it on an initialized context; it runs on a
+   thread of its own, also without the IO thread. Producers don't initialize, they connect to the
+   broker by the same name (NULL for a default one) and publish through it. A producer's presence
+   is cleared when it disconnects or exits. Each returns 0 on failure, e.g. when there is no
+   broker by that name, another one is already running under it, or the activity is larger
+   than 8KB. */
+DISCORD_EXPORT int Discord_StartBroker(const char* name);
+DISCORD_EXPORT int Discord_ContextStartBroker(DiscordContext* context, const char* name);
+DISCORD_EXPORT void Discord_StopBroker(void);
+DISCORD_EXPORT int Discord_BrokerConnect(const char* name);
+DISCORD_EXPORT int Discord_BrokerUpdatePresence(const DiscordRichPresence* presence);
+DISCORD_EXPORT int Discord_BrokerClearPresence(void);
+DISCORD_EXPORT void Discord_BrokerDisconnect(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,89 @@
+#include "allocator.h"
+#include "discord_rpc.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+namespace {
+
+struct Hooks {
+    DiscordAllocFn alloc;
+    DiscordFreeFn free;
+    void* userData;
+};
+
+void* MallocHook(size_t size, void*)
+{
+    return malloc(size);
+}
+
+void FreeHook(void* ptr, void*)
+{
+    free(ptr);
+}
+
+// Blocks may point at any of these long after the hooks were changed, so they stay put; setting
+// the same hooks again reuses their entry.
+constexpr size_t MaxHooks{16};
+Hooks KnownHooks[MaxHooks]{{MallocHook, FreeHook, nullptr}};
+size_t KnownHooksCount{1};
+std::mutex KnownHooksMutex;
+
+std::atomic<const Hooks*> CurrentHooks{&KnownHooks[0]};
+
+// Put in front of every block, padded so what follows is aligned for anything.
+union BlockHeader {
+    const Hooks* hooks;
+    std::max_align_t align;
+};
+
+} // namespace
+
+void* DiscordAlloc(size_t size)
+{
+    const Hooks* hooks = CurrentHooks.load();
+    auto header =
+      static_cast<BlockHeader*>(hooks->alloc(sizeof(BlockHeader) + size, hooks->userData));
+    if (!header) {
+        return nullptr;
+    }
+    header->hooks = hooks;
+    return header + 1;
+}
+
+void DiscordFree(void* ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    auto header = static_cast<BlockHeader*>(ptr) - 1;
+    header->hooks->free(header, header->hooks->userData);
+}
+
+extern "C" DISCORD_EXPORT int Discord_SetAllocator(DiscordAllocFn alloc,
+                                                   DiscordFreeFn free,
+                                                   void* userData)
+{
+    if (!alloc || !free) {
+        CurrentHooks.store(&KnownHooks[0]);
+        return 1;
+    }
+    std::lock_guard<std::mutex> lock(KnownHooksMutex);
+    for (size_t i = 0; i < KnownHooksCount; ++i) {
+        auto& hooks = KnownHooks[i];
+        if (hooks.alloc == alloc && hooks.free == free && hooks.userData == userData) {
+            CurrentHooks.store(&hooks);
+            return 1;
+        }
+    }
+    if (KnownHooksCount == MaxHooks) {
+        return 0;
+    }
+    auto& hooks = KnownHooks[KnownHooksCount++];
+    hooks = Hooks{alloc, free, userData};
+    CurrentHooks.store(&hooks);
+    return 1;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// Everything the library allocates goes through the hooks set with Discord_SetAllocator, malloc
+// and free unless told otherwise. Each block remembers the hooks it came from, so the hooks can be
+// swapped at any time without handing a block to the wrong free.
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+void* DiscordAlloc(size_t size);
+void DiscordFree(void* ptr);
+
+// For the standard containers. Throws like std::allocator does when the hook comes up empty.
+template <typename T>
+struct HookAllocator {
+    using value_type = T;
+
+    HookAllocator() = default;
+    template <typename U>
+    HookAllocator(const HookAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        void* ptr = DiscordAlloc(count * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) { DiscordFree(ptr); }
+};
+
+template <typename T, typename U>
+bool operator==(const HookAllocator<T>&, const HookAllocator<U>&)
+{
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(const HookAllocator<T>&, const HookAllocator<U>&)
+{
+    return false;
+}
+
+template <typename T>
+using HookVector = std::vector<T, HookAllocator<T>>;
+using HookString = std::basic_string<char, std::char_traits<char>, HookAllocator<char>>;
+template <typename Key, typename Value>
+using HookMap = std::map<Key, Value, std::less<Key>, HookAllocator<std::pair<const Key, Value>>>;
+
+// For raw buffers of trivial types.
+struct HookFree {
+    void operator()(void* ptr) const { DiscordFree(ptr); }
+};
+template <typename T>
+using HookArray = std::unique_ptr<T[], HookFree>;
+
+// Base of the library's own classes, so new and delete on them go through the hooks as well.
+struct HookAllocated {
+    static void* operator new(size_t size)
+    {
+        void* ptr = DiscordAlloc(size);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    static void* operator new(size_t size, const std::nothrow_t&) noexcept
+    {
+        return DiscordAlloc(size);
+    }
+    static void* operator new[](size_t size) { return operator new(size); }
+    static void operator delete(void* ptr) noexcept { DiscordFree(ptr); }
+    static void operator delete(void* ptr, const std::nothrow_t&) noexcept { DiscordFree(ptr); }
+    static void operator delete[](void* ptr) noexcept { DiscordFree(ptr); }
+};
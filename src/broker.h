@@ -0,0 +1,41 @@
+#pragma once
+
+// Shared memory between a broker process, which owns the connections to Discord, and the producer
+// processes that publish their presence through it instead of connecting themselves. Producers push
+// the activity they want shown, already rendered to JSON, onto a ring; the broker pops it off and
+// sends it along with the producer's pid. Producers wake the broker with a futex on the shared
+// mapping. Only implemented on Linux, elsewhere Create and Attach fail.
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest activity object a producer can publish.
+constexpr size_t BrokerActivitySize{8 * 1024};
+
+struct BrokerRing : public HookAllocated {
+    // Broker side: makes the ring under name (per user), replacing one left behind by a broker
+    // that went away. Fails while another broker is running under name. Destroying it removes the
+    // name again.
+    static BrokerRing* Create(const char* name);
+    // Producer side: opens the ring of the running broker under name.
+    static BrokerRing* Attach(const char* name);
+    static void Destroy(BrokerRing*&);
+    // Whether the process pid is still around.
+    static bool ProcessAlive(int pid);
+
+    // Producer side. Fails if the broker is gone or has fallen behind, in which case nothing was
+    // queued. length 0 clears the producer's presence.
+    bool Push(int pid, const char* activity, size_t length);
+
+    // Broker side. activity has to have room for BrokerActivitySize bytes. Slots with a length
+    // that doesn't fit are skipped; what's in the others is up to the producer and needs checking.
+    bool Pop(int& pid, char* activity, size_t& length);
+    // Changes with every push and every Wake(). Read it before popping and pass it to Wait(), so a
+    // push in between doesn't go unnoticed.
+    uint32_t WakeCount() const;
+    // Block until WakeCount() differs from wakeCount or timeoutMs passes.
+    void Wait(uint32_t wakeCount, int timeoutMs);
+    void Wake();
+};
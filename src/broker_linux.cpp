@@ -0,0 +1,290 @@
+#include "broker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+constexpr uint32_t BrokerMagic{0x44525042}; // "BPRD", bumped along with the layout below
+constexpr uint32_t BrokerSlotCount{32};     // power of two, so positions can wrap
+
+struct BrokerSlot {
+    int32_t pid;
+    uint32_t length;
+    char activity[BrokerActivitySize];
+};
+
+// The shared mapping. Producers take pushMutex among themselves, which is robust so one that dies
+// while holding it doesn't lock out the rest; the broker only ever reads, so it doesn't need it.
+// A slot belongs to the producers while its position is at or past tail, and to the broker from
+// tail up to head.
+struct BrokerShared {
+    uint32_t magic;
+    int32_t brokerPid;
+    pthread_mutex_t pushMutex;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> wakeCount; // futex word
+    BrokerSlot slots[BrokerSlotCount];
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && ATOMIC_INT_LOCK_FREE == 2,
+              "futex words have to be plain 32 bit integers");
+
+struct BrokerRingLinux : public BrokerRing {
+    BrokerShared* shared{nullptr};
+    bool owner{false};
+    char shmName[128]{};
+};
+
+static void GetShmName(char (&dest)[128], const char* name)
+{
+    // /dev/shm is shared between users, each of them gets their own broker
+    snprintf(dest, sizeof(dest), "/discord-rpc-%u-%s", (unsigned)getuid(), name);
+}
+
+// Whether the ring under shmName still belongs to a broker, so it mustn't be replaced. When in
+// doubt it does.
+static bool BrokerRunning(const char* shmName)
+{
+    int fd = shm_open(shmName, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return errno != ENOENT;
+    }
+    struct stat st {};
+    bool running = true;
+    if (fstat(fd, &st) == 0) {
+        // one that is still being set up has no magic yet, but was only just made
+        running = st.st_mtime + 1 >= time(nullptr);
+        void* mapping = (size_t)st.st_size < sizeof(BrokerShared)
+          ? MAP_FAILED
+          : mmap(nullptr, sizeof(BrokerShared), PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            auto shared = static_cast<const BrokerShared*>(mapping);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (shared->magic == BrokerMagic) {
+                running = BrokerRing::ProcessAlive(shared->brokerPid);
+            }
+            munmap(mapping, sizeof(BrokerShared));
+        }
+    }
+    close(fd);
+    return running;
+}
+
+static BrokerRingLinux* MapShared(const char* name, bool create)
+{
+    auto ring = new (std::nothrow) BrokerRingLinux;
+    if (!ring) {
+        return nullptr;
+    }
+    GetShmName(ring->shmName, name);
+    ring->owner = create;
+
+    int fd = -1;
+    if (create) {
+        fd = shm_open(ring->shmName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd == -1 && errno == EEXIST && !BrokerRunning(ring->shmName)) {
+            // left behind by a broker that is gone by now
+            shm_unlink(ring->shmName);
+            fd = shm_open(ring->shmName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        }
+        if (fd != -1 && ftruncate(fd, sizeof(BrokerShared)) == -1) {
+            close(fd);
+            shm_unlink(ring->shmName);
+            fd = -1;
+        }
+    }
+    else {
+        fd = shm_open(ring->shmName, O_RDWR | O_CLOEXEC, 0);
+        struct stat st {};
+        if (fd != -1 && (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(BrokerShared))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        delete ring;
+        return nullptr;
+    }
+
+    void* mapping =
+      mmap(nullptr, sizeof(BrokerShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        if (create) {
+            shm_unlink(ring->shmName);
+        }
+        delete ring;
+        return nullptr;
+    }
+    ring->shared = static_cast<BrokerShared*>(mapping);
+    return ring;
+}
+
+/*static*/ BrokerRing* BrokerRing::Create(const char* name)
+{
+    auto ring = MapShared(name, true);
+    if (!ring) {
+        return nullptr;
+    }
+    // ftruncate zero filled it, which is a valid state for the atomics
+    auto shared = ring->shared;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->pushMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shared->brokerPid = ::getpid();
+    // producers check the magic last, so they never see a half set up ring
+    std::atomic_thread_fence(std::memory_order_release);
+    shared->magic = BrokerMagic;
+    return ring;
+}
+
+/*static*/ BrokerRing* BrokerRing::Attach(const char* name)
+{
+    auto ring = MapShared(name, false);
+    if (!ring) {
+        return nullptr;
+    }
+    auto shared = ring->shared;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (shared->magic != BrokerMagic || !ProcessAlive(shared->brokerPid)) {
+        BrokerRing* self = ring;
+        Destroy(self);
+        return nullptr;
+    }
+    return ring;
+}
+
+/*static*/ void BrokerRing::Destroy(BrokerRing*& r)
+{
+    auto ring = static_cast<BrokerRingLinux*>(r);
+    if (ring) {
+        if (ring->owner) {
+            // producers still attached notice the broker is gone on their next push
+            ring->shared->brokerPid = 0;
+            shm_unlink(ring->shmName);
+        }
+        munmap(ring->shared, sizeof(BrokerShared));
+        delete ring;
+    }
+    r = nullptr;
+}
+
+/*static*/ bool BrokerRing::ProcessAlive(int pid)
+{
+    if (pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+        return false;
+    }
+    // a zombie still answers to kill, until whoever started it gets around to reaping it
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return true;
+    }
+    char stat[256];
+    ssize_t length = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (length <= 0) {
+        return true;
+    }
+    stat[length] = 0;
+    // "pid (comm) state ...", where comm may have parens of its own
+    const char* state = strrchr(stat, ')');
+    return !state || (state[1] != ' ' || (state[2] != 'Z' && state[2] != 'X'));
+}
+
+bool BrokerRing::Push(int pid, const char* activity, size_t length)
+{
+    auto shared = static_cast<BrokerRingLinux*>(this)->shared;
+    if (length > BrokerActivitySize || !ProcessAlive(shared->brokerPid)) {
+        return false;
+    }
+
+    int locked = pthread_mutex_lock(&shared->pushMutex);
+    if (locked == EOWNERDEAD) {
+        // the producer that held it died before publishing, so there is nothing to undo: tail
+        // only moves once a slot is complete
+        pthread_mutex_consistent(&shared->pushMutex);
+    }
+    else if (locked != 0) {
+        return false;
+    }
+
+    uint32_t tail = shared->tail.load(std::memory_order_relaxed);
+    bool pushed = tail - shared->head.load(std::memory_order_acquire) < BrokerSlotCount;
+    if (pushed) {
+        auto& slot = shared->slots[tail % BrokerSlotCount];
+        slot.pid = pid;
+        slot.length = (uint32_t)length;
+        if (length) {
+            memcpy(slot.activity, activity, length);
+        }
+        shared->tail.store(tail + 1, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&shared->pushMutex);
+
+    if (pushed) {
+        Wake();
+    }
+    return pushed;
+}
+
+bool BrokerRing::Pop(int& pid, char* activity, size_t& length)
+{
+    auto shared = static_cast<BrokerRingLinux*>(this)->shared;
+    for (;;) {
+        uint32_t head = shared->head.load(std::memory_order_relaxed);
+        if (head == shared->tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        // any process of the user's can write to the mapping, so a slot claiming more than it
+        // holds is dropped rather than cut short
+        const auto& slot = shared->slots[head % BrokerSlotCount];
+        bool fits = slot.length <= BrokerActivitySize;
+        if (fits) {
+            pid = slot.pid;
+            length = slot.length;
+            memcpy(activity, slot.activity, length);
+        }
+        shared->head.store(head + 1, std::memory_order_release);
+        if (fits) {
+            return true;
+        }
+    }
+}
+
+uint32_t BrokerRing::WakeCount() const
+{
+    return static_cast<const BrokerRingLinux*>(this)->shared->wakeCount.load();
+}
+
+void BrokerRing::Wait(uint32_t wakeCount, int timeoutMs)
+{
+    auto shared = static_cast<BrokerRingLinux*>(this)->shared;
+    timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    // not FUTEX_PRIVATE_FLAG, the word is shared with other processes
+    syscall(SYS_futex, &shared->wakeCount, FUTEX_WAIT, wakeCount, &timeout, nullptr, 0);
+}
+
+void BrokerRing::Wake()
+{
+    auto shared = static_cast<BrokerRingLinux*>(this)->shared;
+    ++shared->wakeCount;
+    syscall(SYS_futex, &shared->wakeCount, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
@@ -2,23 +2,30 @@
 
 // This is to wrap the platform specific kinds of connect/read/write.
 
+#include "allocator.h"
+
 #include <stdint.h>
 #include <stdlib.h>
-#include <string>
-#include <vector>
 
 // not really connectiony, but need per-platform
 int GetProcessId();
 
-struct BaseConnection {
+using PathList = HookVector<HookString>;
+
+struct BaseConnection : public HookAllocated {
     static BaseConnection* Create(const char* path);
     static void Destroy(BaseConnection*&);
-    // Return all currently available Discord IPC socket/pipe paths.
-    static std::vector<std::string> ScanAvailablePaths();
+    // Replace paths with all currently available Discord IPC socket/pipe paths, reusing the
+    // strings already in there.
+    static void ScanAvailablePaths(PathList& paths);
+    // Drop what the scans keep in between, once nothing is going to scan for a while.
+    static void ForgetScannedPaths();
     bool isOpen{false};
     bool Open();
     bool Close();
     bool Write(const void* data, size_t length);
     bool Read(void* data, size_t length);
+    // Whether a Read would find something, or find the connection closed, without reading it.
+    bool Readable();
     const char* Path() const;
 };
@@ -1,19 +1,26 @@
 #include "connection.h"
+#include "poller.h"
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
-#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
-#include <queue>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <utility>
-#include <functional>
+#include <time.h>
 #include <vector>
 
 int GetProcessId()
@@ -23,7 +30,7 @@ int GetProcessId()
 
 struct BaseConnectionUnix : public BaseConnection {
     int sock{-1};
-    std::string path;
+    HookString path;
 
     bool CreateSocket();
     bool ConnectUnixSocket(const char* targetPath);
@@ -35,8 +42,18 @@ static int MsgFlags = MSG_NOSIGNAL;
 static int MsgFlags = 0;
 #endif
 
-static std::string IpcFilenamePrefix = "discord-ipc-";
-static std::string IpcExtraRootDirPrefixes[] = {"snap.", ".flatpak"};
+static const char IpcFilenamePrefix[] = "discord-ipc-";
+static const char* const IpcExtraRootDirPrefixes[] = {"snap.", ".flatpak"};
+
+// Sockets are either directly in the temp path or somewhere below one of the extra root
+// directories (e.g. .flatpak/<instance>/xdg-run/discord-ipc-0), but never much deeper than that.
+constexpr int MaxScanDepth = 4;
+// Directories below the root stop keeping their fd open between scans past this many open ones,
+// so a big runtime directory doesn't use up fds.
+constexpr size_t MaxOpenDirectories = 32;
+// Timestamps of some filesystems are this coarse. A directory modified more recently than that
+// might change again without its modification time doing so.
+constexpr time_t ModificationTimeGranularitySec = 1;
 
 static const char* GetTempPath()
 {
@@ -48,144 +65,227 @@ static const char* GetTempPath()
     return temp;
 }
 
-class directory_iterator {
-public:
-    directory_iterator(std::string const& path)
-      : m_path{path}
-    {
-    }
-    directory_iterator(std::string&& path)
-      : m_path{std::move(path)}
-    {
-    }
-    directory_iterator(const directory_iterator& o)
-      : m_path{o.m_path}
-    {
-    }
-    directory_iterator(directory_iterator&& o) noexcept
-      : m_path(std::move(o.m_path))
-      , m_stream(std::exchange(o.m_stream, nullptr))
-    {
-    }
-    directory_iterator& operator=(const directory_iterator& o)
-    {
-        if (this == &o)
-            return *this;
-        close();
-        this->m_path = o.m_path;
-        return *this;
-    }
-    directory_iterator& operator=(directory_iterator&& o) noexcept
+static size_t OpenDirectories{0};
+
+// A directory that was searched for IPC sockets during a previous scan. It's kept open, as long as
+// there aren't MaxOpenDirectories of them, so its subdirectories can be stat'ed relative to it,
+// and its entries are only read again once its modification time changes, i.e. when something was
+// added to or removed from it.
+struct ScannedDirectory : public HookAllocated {
+    ~ScannedDirectory() { Close(); }
+
+    void Close()
     {
-        if (this == &o)
-            return *this;
-        close();
-        m_path = std::move(o.m_path);
-        m_stream = std::exchange(o.m_stream, nullptr);
-        return *this;
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+            --OpenDirectories;
+        }
     }
-    ~directory_iterator() { close(); }
-    std::string const& path() const { return m_path; }
-    DIR* stream() const { return m_stream; }
-    explicit operator bool() const noexcept { return m_stream != nullptr; }
-    bool open()
-    {
-        close();
-        m_stream = opendir(m_path.c_str());
-        return m_stream != nullptr;
+
+    int fd{-1};
+    bool scanned{false};
+    // modified too recently for mtime to tell whether it changed since, so it's read again
+    bool recent{false};
+    dev_t dev{};
+    ino_t ino{};
+    timespec mtime{};
+    HookString name; // relative to the parent, absolute for the root
+    HookString path;
+    HookVector<HookString> sockets;
+    HookVector<std::unique_ptr<ScannedDirectory>> children;
+};
+
+// Guards ScanRoot, OpenDirectories and the directories below it.
+static std::mutex ScanMutex;
+static std::unique_ptr<ScannedDirectory> ScanRoot;
+
+static struct timespec GetModificationTime(const struct stat& st)
+{
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+#ifdef __linux__
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+// Calls callback(name, type) for every entry of the open directory, reading the entries in bulk.
+template <typename Callback>
+static bool ForEachDirectoryEntry(int fd, Callback&& callback)
+{
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return false;
     }
-    struct dirent* next()
-    {
-        if (!m_stream) {
-            return nullptr;
+    alignas(8) char buffer[4096];
+    for (;;) {
+        long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR) {
+            continue;
         }
-        auto result = readdir(m_stream);
-        if (!result) {
-            close();
+        if (size <= 0) {
+            return size == 0;
         }
-        return result;
-    }
-    void close()
-    {
-        if (m_stream) {
-            closedir(m_stream);
-            m_stream = nullptr;
+        for (long offset = 0; offset < size;) {
+            auto entry = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+            callback(entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
         }
     }
+}
+#else
+template <typename Callback>
+static bool ForEachDirectoryEntry(int fd, Callback&& callback)
+{
+    int streamFd = dup(fd);
+    if (streamFd == -1) {
+        return false;
+    }
+    DIR* stream = fdopendir(streamFd);
+    if (!stream) {
+        close(streamFd);
+        return false;
+    }
+    rewinddir(stream);
+    while (auto entry = readdir(stream)) {
+        callback(entry->d_name, entry->d_type);
+    }
+    closedir(stream);
+    return true;
+}
+#endif
 
-private:
-    std::string m_path;
-    DIR* m_stream{nullptr};
-};
+static bool IsIpcSocketName(const char* name)
+{
+    constexpr size_t prefixLength = sizeof(IpcFilenamePrefix) - 1;
+    return strncmp(name, IpcFilenamePrefix, prefixLength) == 0 &&
+      isdigit((unsigned char)name[prefixLength]);
+}
 
-static bool discord_ipc_directory_predicate(std::string const& root_parent,
-                                            std::string const& parent,
-                                            const char* directory)
+// Whether the subdirectory `name` of a directory at the given depth should be searched.
+static bool IsSearchedDirectory(int depth, const char* name)
 {
-    if (parent != root_parent)
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+        return false;
+    }
+    if (depth >= MaxScanDepth) {
+        return false;
+    }
+    if (depth > 0) {
         return true;
-    for (std::string const& prefix : IpcExtraRootDirPrefixes)
-        if (prefix.compare(0, std::string::npos, directory, prefix.size()) == 0)
+    }
+    for (const char* prefix : IpcExtraRootDirPrefixes) {
+        if (strncmp(name, prefix, strlen(prefix)) == 0) {
             return true;
+        }
+    }
     return false;
 }
 
-static bool discord_ipc_file_predicate(struct dirent* entry)
+// Re-reads the entries of `dir`, keeping the state of subdirectories that are still there.
+static void ReadDirectory(ScannedDirectory& dir, int depth)
 {
-    return entry->d_type == DT_SOCK &&
-      strncmp(IpcFilenamePrefix.c_str(), entry->d_name, IpcFilenamePrefix.size()) == 0 &&
-      isdigit(entry->d_name[IpcFilenamePrefix.size()]);
+    HookVector<std::unique_ptr<ScannedDirectory>> children;
+    dir.sockets.clear();
+    ForEachDirectoryEntry(dir.fd, [&](const char* name, unsigned char type) {
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dir.fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                return;
+            }
+            type = S_ISSOCK(st.st_mode) ? DT_SOCK : S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (type == DT_SOCK && IsIpcSocketName(name)) {
+            dir.sockets.push_back(dir.path + "/" + name);
+        }
+        else if (type == DT_DIR && IsSearchedDirectory(depth, name)) {
+            for (auto& child : dir.children) {
+                if (child && child->name == name) {
+                    children.push_back(std::move(child));
+                    return;
+                }
+            }
+            std::unique_ptr<ScannedDirectory> child(new ScannedDirectory());
+            child->name = name;
+            child->path = dir.path + "/" + name;
+            children.push_back(std::move(child));
+        }
+    });
+    dir.children = std::move(children);
 }
 
-static std::string resolve_path(std::string const& dir, struct dirent* entry)
+// Brings `dir` up to date with what's on disk. An unchanged directory costs one fstatat, plus
+// whatever its subdirectories cost. Returns false if the directory no longer exists.
+static bool RefreshDirectory(ScannedDirectory& dir, int parentFd, int depth)
 {
-    std::string file;
-    file.reserve(dir.size() + 1 + sizeof(entry->d_name) + 1);
-    file.append(dir);
-    file.append("/");
-    file.append(entry->d_name);
-    return file;
+    struct stat st;
+    if (fstatat(parentFd, dir.name.c_str(), &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    if (dir.scanned && (st.st_dev != dir.dev || st.st_ino != dir.ino)) {
+        // replaced by another directory with the same name, start over
+        dir.Close();
+        dir.scanned = false;
+        dir.sockets.clear();
+        dir.children.clear();
+    }
+    auto mtime = GetModificationTime(st);
+    bool changed = !dir.scanned || dir.recent || mtime.tv_sec != dir.mtime.tv_sec ||
+      mtime.tv_nsec != dir.mtime.tv_nsec;
+    if (dir.fd == -1) {
+        dir.fd = openat(parentFd, dir.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir.fd == -1) {
+            return false;
+        }
+        ++OpenDirectories;
+        dir.dev = st.st_dev;
+        dir.ino = st.st_ino;
+    }
+    if (changed) {
+        // remember the time before reading, so anything added meanwhile is picked up next time
+        dir.mtime = mtime;
+        dir.scanned = true;
+        // something added later within the same timestamp leaves mtime as it is
+        timespec now{};
+        clock_gettime(CLOCK_REALTIME, &now);
+        dir.recent = mtime.tv_sec + ModificationTimeGranularitySec >= now.tv_sec;
+        ReadDirectory(dir, depth);
+    }
+    dir.children.erase(std::remove_if(dir.children.begin(),
+                                      dir.children.end(),
+                                      [&](const std::unique_ptr<ScannedDirectory>& child) {
+                                          return !RefreshDirectory(*child, dir.fd, depth + 1);
+                                      }),
+                       dir.children.end());
+    if (depth > 0 && OpenDirectories > MaxOpenDirectories) {
+        // opened again by name next time, which doesn't make it read again
+        dir.Close();
+    }
+    return true;
 }
 
-// Reads the next iterator entry and sees if it satisfies the predicate.
-// If there is no next entry, this function returns an empty string. If all
-// remaining files read by this iterator are not a matching file, the next
-// directory is popped from the queue, the iterator is set to that directory,
-// it is opened and the function proceeds with the search using this iterator.
-// This is done until either a matching file is found or the queue is empty.
-// Once an entry satisfies the predicate, the full file path is returned.
-// Otherwise an empty string is returned.
-static std::string directory_find_next_recursive(
-  directory_iterator& directory,
-  std::function<bool(std::string const& parent, const char* directory)> directory_predicate,
-  std::function<bool(struct dirent* entry)> filename_predicate,
-  std::queue<std::string>& directory_queue)
+static void CollectSockets(const ScannedDirectory& dir, PathList& paths, size_t& count)
 {
-    while (directory) {
-        while (auto entry = directory.next()) {
-            if (entry->d_type == DT_DIR) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
-                if (!directory_predicate(directory.path(), entry->d_name)) {
-                    continue;
-                }
-                directory_queue.push(resolve_path(directory.path(), entry));
-                continue;
-            }
-            if (filename_predicate(entry)) {
-                auto res = resolve_path(directory.path(), entry);
-                return res;
-            }
+    for (const auto& socket : dir.sockets) {
+        if (count < paths.size()) {
+            paths[count] = socket;
         }
-        directory.close();
-        while (!directory && !directory_queue.empty()) {
-            directory = directory_iterator(std::move(directory_queue.front()));
-            directory.open();
-            directory_queue.pop();
+        else {
+            paths.push_back(socket);
         }
+        ++count;
+    }
+    for (const auto& child : dir.children) {
+        CollectSockets(*child, paths, count);
     }
-    return "";
 }
 
 bool BaseConnectionUnix::ConnectUnixSocket(const char* targetPath)
@@ -230,24 +330,29 @@ bool BaseConnectionUnix::CreateSocket()
     c = nullptr;
 }
 
-/*static*/ std::vector<std::string> BaseConnection::ScanAvailablePaths()
+/*static*/ void BaseConnection::ScanAvailablePaths(PathList& paths)
 {
-    std::vector<std::string> paths;
+    std::lock_guard<std::mutex> lock(ScanMutex);
     const char* tempPath = GetTempPath();
-    directory_iterator directory(tempPath);
-    directory.open();
-    std::queue<std::string> queue;
-    auto directory_predicate = std::bind(
-      discord_ipc_directory_predicate, tempPath, std::placeholders::_1, std::placeholders::_2);
-    while (true) {
-        std::string path = directory_find_next_recursive(
-          directory, directory_predicate, discord_ipc_file_predicate, queue);
-        if (path.empty()) {
-            break;
-        }
-        paths.push_back(std::move(path));
+    if (!ScanRoot || ScanRoot->name != tempPath) {
+        ScanRoot.reset(new ScannedDirectory());
+        ScanRoot->name = tempPath;
+        ScanRoot->path = tempPath;
+    }
+    size_t count = 0;
+    if (RefreshDirectory(*ScanRoot, AT_FDCWD, 0)) {
+        CollectSockets(*ScanRoot, paths, count);
     }
-    return paths;
+    else {
+        ScanRoot.reset();
+    }
+    paths.resize(count);
+}
+
+/*static*/ void BaseConnection::ForgetScannedPaths()
+{
+    std::lock_guard<std::mutex> lock(ScanMutex);
+    ScanRoot.reset();
 }
 
 bool BaseConnection::Open()
@@ -257,6 +362,10 @@ bool BaseConnection::Open()
         return false;
     }
     if (self->ConnectUnixSocket(self->path.c_str())) {
+#ifdef DISCORD_DISABLE_IO_THREAD
+        // nobody else is reading from it, so let the host know when there's something to read
+        Poller::Watch(self->sock);
+#endif
         return true;
     }
     self->Close();
@@ -269,6 +378,9 @@ bool BaseConnection::Close()
     if (self->sock == -1) {
         return false;
     }
+#ifdef DISCORD_DISABLE_IO_THREAD
+    Poller::Unwatch(self->sock);
+#endif
     close(self->sock);
     self->sock = -1;
     self->isOpen = false;
@@ -311,6 +423,16 @@ bool BaseConnection::Read(void* data, size_t length)
     return res == (int)length;
 }
 
+bool BaseConnection::Readable()
+{
+    auto self = reinterpret_cast<BaseConnectionUnix*>(this);
+    if (self->sock == -1) {
+        return false;
+    }
+    char byte;
+    return recv(self->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 || errno != EAGAIN;
+}
+
 const char* BaseConnection::Path() const
 {
     auto self = reinterpret_cast<const BaseConnectionUnix*>(this);
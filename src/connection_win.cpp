@@ -14,7 +14,7 @@ int GetProcessId()
 
 struct BaseConnectionWin : public BaseConnection {
     HANDLE pipe{INVALID_HANDLE_VALUE};
-    std::string path;
+    HookString path;
 };
 
 /*static*/ BaseConnection* BaseConnection::Create(const char* path)
@@ -32,17 +32,18 @@ struct BaseConnectionWin : public BaseConnection {
     c = nullptr;
 }
 
-// Returns paths as std::string. Windows IPC pipe paths are always pure ASCII
+// Windows IPC pipe paths are always pure ASCII
 // (\\.\pipe\discord-ipc-N where N is 0-9), so no encoding concerns. A future
 // refactor could use std::filesystem::path for stronger typing, but it would
 // require bumping the project's C++ standard from 14 to 17.
-/*static*/ std::vector<std::string> BaseConnection::ScanAvailablePaths()
+/*static*/ void BaseConnection::ScanAvailablePaths(PathList& paths)
 {
-    std::vector<std::string> paths;
+    size_t count = 0;
     WIN32_FIND_DATAW findData;
     HANDLE hFind = ::FindFirstFileW(L"\\\\.\\pipe\\discord-ipc-*", &findData);
     if (hFind == INVALID_HANDLE_VALUE) {
-        return paths;
+        paths.clear();
+        return;
     }
     do {
         // Accept only "discord-ipc-" + single digit (0-9)
@@ -52,12 +53,26 @@ struct BaseConnectionWin : public BaseConnection {
         if (wcsncmp(name, prefix, prefixLen) == 0 && name[prefixLen] >= L'0' &&
             name[prefixLen] <= L'9' && name[prefixLen + 1] == L'\0') {
             char narrowPath[64];
-            snprintf(narrowPath, sizeof(narrowPath), "\\\\.\\pipe\\discord-ipc-%c", (char)name[prefixLen]);
-            paths.emplace_back(narrowPath);
+            snprintf(narrowPath,
+                     sizeof(narrowPath),
+                     "\\\\.\\pipe\\discord-ipc-%c",
+                     (char)name[prefixLen]);
+            if (count < paths.size()) {
+                paths[count] = narrowPath;
+            }
+            else {
+                paths.emplace_back(narrowPath);
+            }
+            ++count;
         }
     } while (::FindNextFileW(hFind, &findData));
     ::FindClose(hFind);
-    return paths;
+    paths.resize(count);
+}
+
+/*static*/ void BaseConnection::ForgetScannedPaths()
+{
+    // nothing is kept between scans
 }
 
 bool BaseConnection::Open()
@@ -149,6 +164,17 @@ bool BaseConnection::Read(void* data, size_t length)
     return false;
 }
 
+bool BaseConnection::Readable()
+{
+    auto self = reinterpret_cast<BaseConnectionWin*>(this);
+    if (self->pipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD bytesAvailable = 0;
+    return !::PeekNamedPipe(self->pipe, nullptr, 0, nullptr, &bytesAvailable, nullptr) ||
+      bytesAvailable > 0;
+}
+
 const char* BaseConnection::Path() const
 {
     auto self = reinterpret_cast<const BaseConnectionWin*>(this);
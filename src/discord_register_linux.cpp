@@ -1,8 +1,10 @@
 #include "discord_rpc.h"
+#include "allocator.h"
 #include "discord_register.h"
 #include <stdio.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -21,6 +23,110 @@ static bool Mkdir(const char* path)
     return false;
 }
 
+// Leaves contents empty if there is no such file.
+static bool ReadFile(const char* path, HookString& contents)
+{
+    contents.clear();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, (size_t)length);
+    }
+    close(fd);
+    return length == 0;
+}
+
+// Replaces the file in one go, so nobody reading it meanwhile sees half of it.
+static bool WriteFile(const char* path, const char* contents, size_t length)
+{
+    char tempPath[1100];
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", path, (int)getpid());
+    FILE* fp = fopen(tempPath, "w");
+    if (!fp) {
+        return false;
+    }
+    bool written = fwrite(contents, 1, length, fp) == length;
+    written = fclose(fp) == 0 && written;
+    if (!written || rename(tempPath, path) != 0) {
+        unlink(tempPath);
+        return false;
+    }
+    return true;
+}
+
+// What `xdg-mime default <handler> <mimeType>` does, without starting a shell for it: sets the
+// default in the [Default Applications] section of $XDG_CONFIG_HOME/mimeapps.list. Leaves the
+// file as it is if it says that already.
+static bool SetDefaultHandler(const char* home, const char* mimeType, const char* handler)
+{
+    char configPath[1024];
+    const char* configHome = getenv("XDG_CONFIG_HOME");
+    if (configHome && configHome[0]) {
+        snprintf(configPath, sizeof(configPath), "%s", configHome);
+    }
+    else {
+        snprintf(configPath, sizeof(configPath), "%s/.config", home);
+    }
+    if (!Mkdir(configPath)) {
+        return false;
+    }
+    char listPath[1100];
+    snprintf(listPath, sizeof(listPath), "%s/mimeapps.list", configPath);
+
+    HookString contents;
+    if (!ReadFile(listPath, contents)) {
+        return false;
+    }
+
+    static const char Section[] = "[Default Applications]";
+    HookString key(mimeType);
+    key += '=';
+    HookString entry(key);
+    entry += handler;
+
+    size_t sectionEnd = HookString::npos;
+    bool inSection = false;
+    for (size_t start = 0; start < contents.size();) {
+        size_t end = contents.find('\n', start);
+        if (end == HookString::npos) {
+            end = contents.size();
+        }
+        size_t length = end - start;
+        if (contents[start] == '[') {
+            inSection = contents.compare(start, length, Section) == 0;
+            if (inSection) {
+                sectionEnd = end;
+            }
+        }
+        else if (inSection && contents.compare(start, key.size(), key) == 0) {
+            if (contents.compare(start, length, entry) == 0) {
+                return true;
+            }
+            contents.replace(start, length, entry);
+            return WriteFile(listPath, contents.data(), contents.size());
+        }
+        start = end + 1;
+    }
+
+    if (sectionEnd != HookString::npos) {
+        contents.insert(sectionEnd, "\n" + entry);
+    }
+    else {
+        if (!contents.empty() && contents.back() != '\n') {
+            contents += '\n';
+        }
+        contents += Section;
+        contents += '\n';
+        contents += entry;
+        contents += '\n';
+    }
+    return WriteFile(listPath, contents.data(), contents.size());
+}
+
 // we want to register games so we can run them from Discord client as discord-<appid>://
 extern "C" DISCORD_EXPORT void Discord_Register(const char* applicationId, const char* command)
 {
@@ -51,7 +157,7 @@ extern "C" DISCORD_EXPORT void Discord_Register(const char* applicationId, const
     char desktopFile[2048];
     int fileLen = snprintf(
       desktopFile, sizeof(desktopFile), desktopFileFormat, applicationId, command, applicationId);
-    if (fileLen <= 0) {
+    if (fileLen <= 0 || fileLen >= (int)sizeof(desktopFile)) {
         return;
     }
 
@@ -73,22 +179,18 @@ extern "C" DISCORD_EXPORT void Discord_Register(const char* applicationId, const
     }
     strcat(desktopFilePath, desktopFilename);
 
-    FILE* fp = fopen(desktopFilePath, "w");
-    if (fp) {
-        fwrite(desktopFile, 1, fileLen, fp);
-        fclose(fp);
-    }
-    else {
-        return;
+    // this runs on every start, which mostly finds everything as it was left the last time
+    HookString existing;
+    if (!ReadFile(desktopFilePath, existing) ||
+        existing.compare(0, HookString::npos, desktopFile, (size_t)fileLen) != 0) {
+        if (!WriteFile(desktopFilePath, desktopFile, (size_t)fileLen)) {
+            return;
+        }
     }
 
-    char xdgMimeCommand[1024];
-    snprintf(xdgMimeCommand,
-             sizeof(xdgMimeCommand),
-             "xdg-mime default discord-%s.desktop x-scheme-handler/discord-%s",
-             applicationId,
-             applicationId);
-    if (system(xdgMimeCommand) < 0) {
+    char mimeType[128];
+    snprintf(mimeType, sizeof(mimeType), "x-scheme-handler/discord-%s", applicationId);
+    if (!SetDefaultHandler(home, mimeType, desktopFilename + 1)) {
         fprintf(stderr, "Failed to register mime handler\n");
     }
 }
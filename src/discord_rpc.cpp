@@ -1,43 +1,129 @@
 #include "discord_rpc.h"
 
+#include "allocator.h"
 #include "backoff.h"
+#include "broker.h"
 #include "discord_register.h"
+#include "flight_recorder.h"
 #include "msg_queue.h"
+#include "poller.h"
+#include "presence_submission.h"
 #include "rpc_connection.h"
 #include "serialization.h"
+#include "thread.h"
+#include "token_bucket.h"
 
 #include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <stdio.h>
 #include <string>
-#include <unordered_set>
-#include <vector>
-
-#ifndef DISCORD_DISABLE_IO_THREAD
-#include <condition_variable>
 #include <thread>
-#endif
 
-constexpr size_t MaxMessageSize{16 * 1024};
-constexpr size_t MessageQueueSize{8};
-constexpr size_t JoinQueueSize{8};
+// Everything but SET_ACTIVITY is tiny, a join reply with a 20 digit user id is about 120 bytes.
+constexpr size_t MaxCommandSize{1024};
+// Frames have to hold READY and the other messages we get, which are a few hundred bytes.
+constexpr size_t MinFrameSize{4 * 1024};
+// While a handshake is waiting for its READY, the IO thread checks back this often, for at most
+// HandshakePollUs after sending it, so new connections don't sit around until the next tick.
+constexpr unsigned HandshakePollMs{5};
+constexpr int64_t HandshakePollUs{1000 * 1000};
+// Connections under a previous application id are closed after this at the latest, even if the
+// client they're on never came up under the new one.
+constexpr auto SwitchApplicationTimeout = std::chrono::seconds(10);
+// How often the broker looks for producers that went away without clearing their presence.
+constexpr int ProducerCheckIntervalMs{1000};
+static const char DefaultBrokerName[] = "default";
+
+// What Discord_Initialize uses, and what any option left 0 falls back to.
+static const DiscordInitOptions DefaultInitOptions = {
+  DISCORD_INIT_OPTIONS_VERSION,
+  16 * 1024,                     // maxMessageSize
+  (uint32_t)DefaultRpcFrameSize, // maxFrameSize
+  8,                             // joinQueueSize
+  8,                             // ackQueueSize
+  10 * 1000,                     // pathScanIntervalMs
+  500,                           // ioWaitMs
+  500,                           // reconnectMinMs
+  10 * 1000,                     // reconnectMaxMs
+  5,                             // presenceUpdates
+  20 * 1000,                     // presencePeriodMs
+  0,                             // presenceAckTimeoutMs
+  16,                            // readBudget
+  "discord-rpc-io",              // ioThreadName
+  0,                             // ioThreadStackSize
+  0,                             // ioThreadPriority
+  0,                             // ioThreadAffinity
+  nullptr,                       // ioSubmit
+  nullptr,                       // ioSubmitData
+};
+
+static int64_t NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::atomic_int Nonce{1};
+// What a nonce can get longer by, which it does each time it gets to another power of ten.
+constexpr size_t NonceGrowth = 10;
 
+// A presence, in a buffer that grows to fit the largest one so far. It never shrinks, so once
+// presences stop getting larger nothing is allocated for them anymore.
 struct QueuedMessage {
-    size_t length;
-    char buffer[MaxMessageSize];
+    size_t length{0};
+    // NowUs() when this was queued, for the time-in-queue stats
+    int64_t queuedAtUs{0};
+    // what the response to it will have
+    int nonce{0};
+    HookVector<char> buffer;
+
+    // Serializes with write(buffer, maxLen, nonce), which returns the length it needs, growing the
+    // buffer to that and room for a longer nonce if it's short. Returns the length needed; if
+    // that's more than maxLength it wasn't written and length is 0.
+    template <typename Write>
+    size_t Serialize(size_t maxLength, Write&& write)
+    {
+        nonce = Nonce++;
+        for (;;) {
+            size_t needed = write(buffer.data(), buffer.size(), nonce);
+            if (needed <= buffer.size()) {
+                length = needed;
+                return needed;
+            }
+            if (needed > maxLength) {
+                length = 0;
+                return needed;
+            }
+            buffer.resize(needed + NonceGrowth);
+        }
+    }
 
     void Copy(const QueuedMessage& other)
     {
         length = other.length;
+        queuedAtUs = other.queuedAtUs;
+        nonce = other.nonce;
+        if (buffer.size() < other.buffer.size()) {
+            buffer.resize(other.buffer.size());
+        }
         if (length) {
-            memcpy(buffer, other.buffer, length);
+            memcpy(buffer.data(), other.buffer.data(), length);
         }
     }
 };
 
+struct QueuedCommand {
+    size_t length;
+    int64_t queuedAtUs;
+    char buffer[MaxCommandSize];
+};
+
 struct User {
     // snowflake (64bit int), turned into a ascii decimal string, at most 20 chars +1 null
     // terminator = 21
@@ -52,7 +138,192 @@ struct User {
     // Rounded way up because I'm paranoid about games breaking from future changes in these sizes
 };
 
+#ifndef DISCORD_PRESENCE_ONLY
+struct JoinRequest {
+    User user;
+    char ipcPath[256];
+};
+#endif
+
+struct CommandAck {
+    int nonce;
+    char command[64];
+    char ipcPath[256];
+};
+
+#ifndef DISCORD_PRESENCE_ONLY
+// User ids of the join requests that came in on a connection and weren't responded to yet, so the
+// response goes back to that connection only. Once full, the oldest requests are forgotten.
+struct PendingJoinRequests {
+    struct UserId {
+        char id[32];
+    };
+
+    std::mutex mutex;
+    HookVector<UserId> userIds;
+    size_t next{0};
+
+    explicit PendingJoinRequests(size_t capacity)
+      : userIds(capacity)
+    {
+    }
+
+    void Add(const char* userId)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        StringCopy(userIds[next++ % userIds.size()].id, userId);
+    }
+
+    bool Remove(const char* userId)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& pendingId : userIds) {
+            if (pendingId.id[0] && strcmp(pendingId.id, userId) == 0) {
+                pendingId.id[0] = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+#endif
+
+// Counters for one outbound lane of a connection. Lanes are written in priority order whenever the
+// connection is serviced: control (subscriptions), join replies, then presence.
+struct LaneStats {
+    std::atomic_uint sent{0};
+    std::atomic_uint dropped{0};
+    std::atomic_uint replaced{0};
+    std::atomic<uint64_t> totalQueueTimeUs{0};
+    std::atomic<uint64_t> maxQueueTimeUs{0};
+
+    // IO thread only
+    void RecordSend(int64_t queuedAtUs)
+    {
+        uint64_t waited = (uint64_t)std::max<int64_t>(NowUs() - queuedAtUs, 0);
+        ++sent;
+        totalQueueTimeUs += waited;
+        if (waited > maxQueueTimeUs.load()) {
+            maxQueueTimeUs.store(waited);
+        }
+    }
+
+    void CopyTo(DiscordLaneStats& dest) const
+    {
+        dest.sent = sent.load();
+        dest.dropped = dropped.load();
+        dest.replaced = replaced.load();
+        dest.totalQueueTimeUs = totalQueueTimeUs.load();
+        dest.maxQueueTimeUs = maxQueueTimeUs.load();
+    }
+};
+
+// How long SET_ACTIVITY takes to come back from the client. Only the latest write is waited for,
+// one that's replaced before its response came is left out.
+struct AckStats {
+    std::atomic_uint acked{0};
+    std::atomic_uint timedOut{0};
+    std::atomic<uint64_t> totalAckTimeUs{0};
+    std::atomic<uint64_t> maxAckTimeUs{0};
+    std::atomic<uint64_t> lastAckTimeUs{0};
+    // nonce of the write waiting for its response, 0 for none
+    std::atomic_int awaitedNonce{0};
+    std::atomic<int64_t> writtenAtUs{0};
+
+    // IO thread only
+    void RecordWrite(int nonce)
+    {
+        writtenAtUs.store(NowUs());
+        awaitedNonce.store(nonce);
+    }
+
+    void RecordResponse(int nonce)
+    {
+        if (!nonce || nonce != awaitedNonce.load()) {
+            return;
+        }
+        awaitedNonce.store(0);
+        uint64_t took = (uint64_t)std::max<int64_t>(NowUs() - writtenAtUs.load(), 0);
+        ++acked;
+        totalAckTimeUs += took;
+        lastAckTimeUs.store(took);
+        if (took > maxAckTimeUs.load()) {
+            maxAckTimeUs.store(took);
+        }
+    }
+
+    void RecordTimeout()
+    {
+        awaitedNonce.store(0);
+        ++timedOut;
+    }
+
+    void CopyTo(DiscordAckStats& dest) const
+    {
+        dest.acked = acked.load();
+        dest.timedOut = timedOut.load();
+        dest.totalAckTimeUs = totalAckTimeUs.load();
+        dest.maxAckTimeUs = maxAckTimeUs.load();
+        dest.lastAckTimeUs = lastAckTimeUs.load();
+    }
+};
+
+// How long connection updates take, across all contexts.
+struct TickStats {
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> totalTickUs{0};
+    std::atomic<uint64_t> maxTickUs{0};
+    std::atomic<uint64_t> lastTickUs{0};
+    std::atomic<uint64_t> readBudgetHits{0};
+
+    // whoever drives the updates only
+    void RecordTick(int64_t startedAtUs)
+    {
+        uint64_t took = (uint64_t)std::max<int64_t>(NowUs() - startedAtUs, 0);
+        ++ticks;
+        totalTickUs += took;
+        lastTickUs.store(took);
+        if (took > maxTickUs.load()) {
+            maxTickUs.store(took);
+        }
+    }
+
+    void CopyTo(DiscordIoStats& dest) const
+    {
+        dest.ticks = ticks.load();
+        dest.totalTickUs = totalTickUs.load();
+        dest.maxTickUs = maxTickUs.load();
+        dest.lastTickUs = lastTickUs.load();
+        dest.readBudgetHits = readBudgetHits.load();
+    }
+};
+
+// What a connection last wrote for a pid of the producer lane, which is paced on its own.
+struct ProducerSent {
+    explicit ProducerSent(const DiscordInitOptions& options)
+      : tokens(options.presenceUpdates, (int64_t)options.presencePeriodMs * 1000)
+    {
+    }
+
+    // the ProducerPresence::generation written
+    uint64_t generation{0};
+    // whether that showed an activity, which would have to be cleared
+    bool shown{false};
+    TokenBucket tokens;
+};
+
 struct PerConnectionState {
+    PerConnectionState(DiscordContext* owner, const DiscordInitOptions& options)
+      : context(owner)
+      , presenceTokens(options.presenceUpdates, (int64_t)options.presencePeriodMs * 1000)
+#ifndef DISCORD_PRESENCE_ONLY
+      , joinReplies(options.joinQueueSize)
+      , joinRequests(options.joinQueueSize)
+#endif
+      , reconnectTimeMs(options.reconnectMinMs, options.reconnectMaxMs)
+    {
+    }
+
     ~PerConnectionState()
     {
         if (rpc) {
@@ -62,7 +333,9 @@ struct PerConnectionState {
         }
     }
 
-    std::string path;
+    // the context this belongs to, which outlives it
+    DiscordContext* context;
+    HookString path;
     RpcConnection* rpc{nullptr};
     User connectedUser{};
     std::atomic_bool wasJustConnected{false};
@@ -72,86 +345,445 @@ struct PerConnectionState {
     char lastErrorMessage[256]{};
     int lastDisconnectErrorCode{0};
     char lastDisconnectErrorMessage[256]{};
+    // presence lane: latest wins, a presence that wasn't sent yet gets replaced
     std::atomic_bool updatePresence{false};
-    QueuedMessage queuedPresence{};
+    QueuedMessage queuedPresence;
+    // DiscordContext::presenceGeneration that queuedPresence is a copy of
+    uint64_t presenceGeneration{0};
     std::mutex presenceMutex;
-    Backoff reconnectTimeMs{500, 10000};
+    // what's being written from queuedPresence, IO thread only
+    QueuedMessage sendingPresence;
+    LaneStats presenceStats;
+    // paces the presence lane, taken from by the IO thread only
+    TokenBucket presenceTokens;
+    // responses to the SET_ACTIVITY writes of both, see DiscordInitOptions::presenceAckTimeoutMs
+    AckStats presenceAcks;
+#ifndef DISCORD_PRESENCE_ONLY
+    // join reply lane: bounded, replies that don't fit are dropped
+    MsgQueue<QueuedCommand> joinReplies;
+    std::mutex joinRepliesMutex;
+    LaneStats joinReplyStats;
+    PendingJoinRequests joinRequests;
+    // control lane: SubscribableEvents bits this client is subscribed to, only written by the IO
+    // thread. What's missing is derived from WantedSubscriptions, so nothing is ever dropped.
+    std::atomic_uint subscriptions{0};
+    LaneStats controlStats;
+#endif
+    // when the READY came in, which is also when this client started missing subscriptions as far
+    // as the connection is concerned
+    int64_t connectedAtUs{0};
+    Backoff reconnectTimeMs;
     std::chrono::system_clock::time_point nextConnect{};
+    // when the last handshake went out, IO thread only
+    int64_t handshakeSentAtUs{0};
+    // producer lane: the DiscordContext::producersGeneration this connection caught up with, and
+    // what was last written here per pid. IO thread only.
+    uint64_t producersGeneration{0};
+    HookMap<int, ProducerSent> producersSent;
+};
+
+// Presence shown under a pid other than ours: what a producer process published through the
+// broker, or what was set with Discord_UpdatePresenceForPid. An empty activity clears it.
+struct ProducerPresence {
+    HookString activity;
+    uint64_t generation{0};
+    int64_t queuedAtUs{0};
+    // a producer's, which is cleared once its process is gone
+    bool fromBroker{false};
+};
+
+struct DiscordPresenceHandle : public HookAllocated {
+    // held while presence is patched or serialized, which can happen on several threads at once
+    std::mutex mutex;
+    PresenceTemplate presence;
+    // One for the caller until Discord_FreePresence, one for each call working with it and one
+    // for each context it's the activePresence of. The last to let go deletes it.
+    std::atomic<int> references{1};
+};
+
+static DiscordPresenceHandle* RetainPresence(DiscordPresenceHandle* handle)
+{
+    if (handle) {
+        handle->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    return handle;
+}
+
+static void ReleasePresence(DiscordPresenceHandle* handle)
+{
+    if (handle && handle->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete handle;
+    }
+}
+
+// Everything that belongs to one application id. The global API works on DefaultContext; all
+// contexts share the IO thread and the path scan.
+struct DiscordContext : public HookAllocated {
+    char appId[64]{};
+    // Discord_CreateContext options with the defaults filled in
+    DiscordInitOptions options{};
+    HookVector<std::shared_ptr<PerConnectionState>> connections;
+    // Connections under the previous application id, each is closed as soon as the client it is on
+    // is served under the current one. See Discord_ContextSwitchApplication.
+    HookVector<std::shared_ptr<PerConnectionState>> retiringConnections;
+    std::chrono::steady_clock::time_point retireDeadline{};
+    std::mutex connectionsMutex;
+    // What the IO thread works on, so it doesn't need connectionsMutex the whole time. Kept
+    // around so its capacity is.
+    HookVector<std::shared_ptr<PerConnectionState>> ioSnapshot;
+    // where in ioSnapshot the IO thread starts, moved along every tick so no connection is
+    // always served last
+    size_t ioNextFirst{0};
+
+    // The last presence set for all connections, which is also what new ones start out with.
+    QueuedMessage presence;
+    uint64_t presenceGeneration{0};
+    // Where a presence is serialized before it replaces one, so one that's too large for
+    // options.maxMessageSize leaves the previous one as it was.
+    QueuedMessage stagedPresence;
+    std::mutex presenceMutex;
+    // Discord_SubmitPresence's, and where the IO thread takes them to serialize them
+    PresenceSubmissions submissions;
+    SubmittedPresence submittedPresence;
+
+    DiscordEventHandlers handlers{};
+    std::mutex handlerMutex;
+#ifndef DISCORD_PRESENCE_ONLY
+    // SubscribableEvents bits there are handlers for, every open connection gets subscribed to
+    // these
+    std::atomic_uint wantedSubscriptions{0};
+    std::atomic<int64_t> wantedSubscriptionsChangedAtUs{0};
+    // The last join/spectate from any connection, with that connection's path for the event. A
+    // second one before the next RunCallbacks/PollEvent replaces the first.
+    std::atomic_bool wasJoinGame{false};
+    std::atomic_bool wasSpectateGame{false};
+    char joinGameSecret[256]{};
+    char joinGameIpcPath[256]{};
+    char spectateGameSecret[256]{};
+    char spectateGameIpcPath[256]{};
+    MsgQueue<JoinRequest> joinAskQueue;
+#endif
+    std::atomic_bool gotAnyErrorMessage{false};
+    std::mutex errorMutex;
+    int lastErrorCode{0};
+    char lastErrorIpcPath[256]{};
+    char lastErrorMessage[256]{};
+    MsgQueue<CommandAck> ackQueue;
+    // Whether the app calls Discord_PollEvent, the only place acks show up. Until it does they're
+    // neither queued nor wake anyone up.
+    std::atomic_bool pollsEvents{false};
+
+    // Events collected for PollEvent/RunCallbacks, but not yet handed out.
+    std::mutex eventMutex;
+    HookVector<DiscordEvent> pendingEvents;
+    size_t nextPendingEvent{0};
+    // CollectEvents' view of the connections, guarded by eventMutex as well
+    struct CollectedConnection {
+        std::shared_ptr<PerConnectionState> cs;
+        bool wasDisconnected;
+        bool isConnected;
+    };
+    HookVector<CollectedConnection> collected;
+
+    // Set whenever something is signalled for CollectEvents, for WaitForEvents, and destroyed once
+    // the context is on its way out, which sends any waiter home empty-handed.
+    std::mutex eventsReadyMutex;
+    std::condition_variable eventsReadyCondition;
+    bool eventsReady{false};
+    bool destroyed{false};
+
+    // The compiled presence that was last made current, if any; patching it resends it. Holds a
+    // reference to it, see SetActivePresence.
+    std::atomic<DiscordPresenceHandle*> activePresence{nullptr};
+
+    // Presence under other pids, see ProducerPresence.
+    std::mutex producersMutex;
+    HookMap<int, ProducerPresence> producers;
+    std::atomic<uint64_t> producersGeneration{0};
+    // how far cleared producers were forgotten, see ForgetClearedProducers. IO thread only.
+    uint64_t producersForgottenAt{0};
+
+    ~DiscordContext() { ReleasePresence(activePresence.load()); }
 };
 
-static char StoredAppId[64]{};
-static std::vector<std::shared_ptr<PerConnectionState>> Connections;
-static std::mutex ConnectionsMutex;
+// Makes handle, which may be null, the context's activePresence, trading the reference to the one
+// before for one to it.
+static void SetActivePresence(DiscordContext& context, DiscordPresenceHandle* handle)
+{
+    ReleasePresence(context.activePresence.exchange(RetainPresence(handle)));
+}
 
-constexpr auto PathScanInterval = std::chrono::seconds(10);
+static HookVector<std::shared_ptr<DiscordContext>> Contexts;
+static std::mutex ContextsMutex;
+// The contexts the current connection update works on, only touched by whoever drives those
+static HookVector<std::shared_ptr<DiscordContext>> UpdatingContexts;
+// Held while contexts come and go, which is also when the IO thread starts and stops.
+static std::mutex ContextLifetimeMutex;
+// The context behind the global API, from Discord_Initialize until Discord_Shutdown.
+static DiscordContext* DefaultContext{nullptr};
+
+// The shortest of what the contexts asked for
+static std::atomic_uint PathScanIntervalMs{0};
+static std::atomic_uint IoWaitMs{0};
+// Whether the IO thread should check back after HandshakePollMs
+static std::atomic_bool AwaitingReady{false};
+// NowUs() when the IO thread has to look at presence again: one held back for a token or an
+// ack can go, or a response may be in. 0 if there is nothing to look at.
+static std::atomic<int64_t> NextPresenceUs{0};
+// Whether a connection had more to read than its readBudget, in which case the IO thread comes
+// right back for the rest
+static std::atomic_bool MoreToRead{false};
+static TickStats IoTickStats;
 
 static std::chrono::steady_clock::time_point LastPathScan{};
-static std::unordered_set<std::string> CachedPathSet;
-
-static DiscordEventHandlers QueuedHandlers{};
-static DiscordEventHandlers Handlers{};
-// TODO: these are still global — the errored/joinGame/spectateGame callbacks
-// fire once for whichever connection saw the event, with no way for the
-// consumer to know which user/connection it belongs to. Should become
-// per-connection state when those callbacks gain a user parameter.
-static std::atomic_bool WasJoinGame{false};
-static std::atomic_bool WasSpectateGame{false};
-static char JoinGameSecret[256];
-static char SpectateGameSecret[256];
-static std::atomic_bool GotAnyErrorMessage{false};
-static int LastErrorCode{0};
-static char LastErrorIpcPath[256];
-static char LastErrorMessage[256];
-static std::mutex HandlerMutex;
-static MsgQueue<QueuedMessage, MessageQueueSize> SendQueue;
-static MsgQueue<User, JoinQueueSize> JoinAskQueue;
+static PathList CachedPaths;
+// what the scan before found, for the flight recorder
+static PathList PreviousPaths;
 
 static int Pid{0};
-static int Nonce{1};
+
+// The broker this process runs for producer processes, see Discord_ContextStartBroker. Started
+// and stopped with ContextLifetimeMutex held.
+static BrokerRing* Broker{nullptr};
+static DiscordContext* BrokerContext{nullptr};
+static std::thread BrokerThread;
+static std::atomic_bool BrokerStopping{false};
+
+// Held for a connection update, so the connections of a context that's being destroyed can be
+// flushed without one going on at the same time.
+static std::timed_mutex UpdateMutex;
+
+#ifdef DISCORD_DISABLE_IO_THREAD
+// WaitForEvents calls blocked on the poll fd. Closing it under them would lose the wakeup that
+// tells them their context is gone, so the last context's destruction waits for them first.
+static std::atomic<int> PollWaiters{0};
+#endif
+
+// What autoRegister does runs here, it writes files and may take a while. Started with
+// ContextLifetimeMutex held; each one waits for the one before, so joining it joins them all.
+static std::thread RegisterThread;
+// How many of them haven't finished yet, for a shutdown that can't wait long for them.
+static std::mutex RegistrationMutex;
+static std::condition_variable RegistrationDone;
+static unsigned RegistrationsRunning{0};
+
+// The broker this process publishes its presence through, see Discord_BrokerConnect.
+static std::mutex ProducerMutex;
+static BrokerRing* ProducerRing{nullptr};
+static char ProducerBrokerName[64]{};
 
 #ifndef DISCORD_DISABLE_IO_THREAD
 static void Discord_UpdateConnection(void);
-class IoThreadHolder {
+
+// How long the IO work can wait for its next tick if nothing comes up meanwhile.
+static unsigned NextTickInMs()
+{
+    auto waitMs = AwaitingReady.load() ? HandshakePollMs : IoWaitMs.load();
+    if (MoreToRead.load()) {
+        waitMs = 0;
+    }
+    if (int64_t nextPresenceUs = NextPresenceUs.load()) {
+        auto untilMs = std::max<int64_t>((nextPresenceUs - NowUs() + 999) / 1000, 0);
+        waitMs = (unsigned)std::min<int64_t>(waitMs, untilMs);
+    }
+    return waitMs;
+}
+
+// With DiscordInitOptions::ioSubmit the ticks run as tasks on the caller's scheduler instead of
+// the IO thread. This stays around for good, as a task may still run after the last context is
+// gone.
+struct IoTaskState {
+    // held while a task ticks, so ticks never overlap, and while stopping
+    std::timed_mutex runMutex;
+    // guards the rest
+    std::mutex submitMutex;
+    bool active{false};
+    DiscordIoSubmitFn submit{nullptr};
+    void* submitData{nullptr};
+    // The last task handed over, which is the one due soonest, and when (0 for none). The ones
+    // before it do nothing when they run.
+    uintptr_t lastTask{0};
+    int64_t dueUs{0};
+    // tasks being handed over right now, which happens without the mutex, and signalled when
+    // that's down to none so stopping can wait for them
+    unsigned submitting{0};
+    std::condition_variable submitted;
+};
+static IoTaskState IoTasks;
+
+static void RunIoTask(void* task);
+
+// Hands a tick to the caller's scheduler, delayMs from now, unless one is due by then anyway.
+static void SubmitIoTask(unsigned delayMs)
+{
+    DiscordIoSubmitFn submit;
+    void* submitData;
+    uintptr_t task;
+    {
+        std::lock_guard<std::mutex> lock(IoTasks.submitMutex);
+        int64_t dueUs = NowUs() + (int64_t)delayMs * 1000;
+        if (!IoTasks.active || (IoTasks.dueUs && IoTasks.dueUs <= dueUs)) {
+            return;
+        }
+        IoTasks.dueUs = dueUs;
+        submit = IoTasks.submit;
+        submitData = IoTasks.submitData;
+        task = ++IoTasks.lastTask;
+        ++IoTasks.submitting;
+    }
+    // The caller's scheduler may take its own locks, or run the task right away on another
+    // thread, so it's called without ours. Should a newer task get there first, this one just
+    // does nothing.
+    submit(RunIoTask, (void*)task, delayMs, submitData);
+    std::lock_guard<std::mutex> lock(IoTasks.submitMutex);
+    if (--IoTasks.submitting == 0) {
+        IoTasks.submitted.notify_all();
+    }
+}
+
+static void RunIoTask(void* task)
+{
+    std::lock_guard<std::timed_mutex> running(IoTasks.runMutex);
+    {
+        std::lock_guard<std::mutex> lock(IoTasks.submitMutex);
+        if (!IoTasks.active || (uintptr_t)task != IoTasks.lastTask) {
+            return;
+        }
+        IoTasks.dueUs = 0;
+    }
+    Discord_UpdateConnection();
+    SubmitIoTask(NextTickInMs());
+}
+
+class IoThreadHolder : public HookAllocated {
 private:
     std::atomic_bool keepRunning{true};
     std::mutex waitForIOMutex;
     std::condition_variable waitForIOActivity;
-    std::thread ioThread;
+    NativeThread* ioThread{nullptr};
+    bool useTasks{false};
+    // Both guarded by waitForIOMutex. Once abandoned by Stop, the thread deletes this itself when
+    // it's finished.
+    bool finished{false};
+    bool abandoned{false};
+
+    static void Run(void* data)
+    {
+        auto self = static_cast<IoThreadHolder*>(data);
+        Discord_UpdateConnection();
+        std::unique_lock<std::mutex> lock(self->waitForIOMutex);
+        // Stop clears it with the mutex held, so it can't slip in between this and the wait
+        while (self->keepRunning.load()) {
+            self->waitForIOActivity.wait_for(lock, std::chrono::milliseconds(NextTickInMs()));
+            if (!self->keepRunning.load()) {
+                break;
+            }
+            lock.unlock();
+            Discord_UpdateConnection();
+            lock.lock();
+        }
+        self->finished = true;
+        // notified with the mutex held, as Stop deletes this as soon as it sees finished
+        self->waitForIOActivity.notify_all();
+        if (self->abandoned) {
+            lock.unlock();
+            delete self;
+        }
+    }
 
 public:
-    void Start()
+    // Starts the IO thread as options ask for, or with options.ioSubmit hands the first tick to
+    // the caller's scheduler. False if the thread couldn't be started.
+    bool Start(const DiscordInitOptions& options)
     {
-        keepRunning.store(true);
-        ioThread = std::thread([&]() {
-            const std::chrono::duration<int64_t, std::milli> maxWait{500LL};
-            Discord_UpdateConnection();
-            while (keepRunning.load()) {
-                std::unique_lock<std::mutex> lock(waitForIOMutex);
-                waitForIOActivity.wait_for(lock, maxWait);
-                Discord_UpdateConnection();
+        if (options.ioSubmit) {
+            useTasks = true;
+            {
+                std::lock_guard<std::mutex> lock(IoTasks.submitMutex);
+                IoTasks.active = true;
+                IoTasks.submit = options.ioSubmit;
+                IoTasks.submitData = options.ioSubmitData;
+                IoTasks.dueUs = 0;
             }
-        });
+            SubmitIoTask(0);
+            return true;
+        }
+        keepRunning.store(true);
+        ThreadOptions threadOptions{options.ioThreadName,
+                                    options.ioThreadStackSize,
+                                    options.ioThreadPriority,
+                                    options.ioThreadAffinity};
+        ioThread = NativeThread::Start(threadOptions, Run, this);
+        return ioThread != nullptr;
     }
 
-    void Notify() { waitForIOActivity.notify_all(); }
+    void Notify()
+    {
+        if (useTasks) {
+            SubmitIoTask(0);
+        }
+        else {
+            waitForIOActivity.notify_all();
+        }
+    }
 
-    void Stop()
+    // Stops ticking. A tick that's running right now gets until deadline to finish; one that
+    // takes longer is left to finish on its own. Returns false if the IO thread was left that way,
+    // in which case it deletes this itself once it's done, otherwise the caller does.
+    bool Stop(std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max())
     {
-        keepRunning.exchange(false);
-        Notify();
-        if (ioThread.joinable()) {
-            ioThread.join();
+        if (useTasks) {
+            // the ones still to come do nothing, whether or not the one running finishes in time
+            std::unique_lock<std::timed_mutex> running(IoTasks.runMutex, std::defer_lock);
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                running.lock();
+            }
+            else {
+                running.try_lock_until(deadline);
+            }
+            std::unique_lock<std::mutex> lock(IoTasks.submitMutex);
+            IoTasks.active = false;
+            IoTasks.submit = nullptr;
+            IoTasks.dueUs = 0;
+            // nothing reaches the caller's scheduler once stopped
+            auto handedOver = [] { return IoTasks.submitting == 0; };
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                IoTasks.submitted.wait(lock, handedOver);
+            }
+            else {
+                IoTasks.submitted.wait_until(lock, deadline, handedOver);
+            }
+            return true;
         }
+        if (!ioThread) {
+            return true;
+        }
+        {
+            std::unique_lock<std::mutex> lock(waitForIOMutex);
+            keepRunning.store(false);
+            waitForIOActivity.notify_all();
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                waitForIOActivity.wait(lock, [this] { return finished; });
+            }
+            else if (!waitForIOActivity.wait_until(lock, deadline, [this] { return finished; })) {
+                abandoned = true;
+                NativeThread::Detach(ioThread);
+                return false;
+            }
+        }
+        NativeThread::Join(ioThread);
+        return true;
     }
 
     ~IoThreadHolder() { Stop(); }
 };
 #else
-class IoThreadHolder {
+class IoThreadHolder : public HookAllocated {
 public:
-    void Start() {}
-    void Stop() {}
-    void Notify() {}
+    bool Start(const DiscordInitOptions&) { return true; }
+    bool Stop(std::chrono::steady_clock::time_point = {}) { return true; }
+    void Notify() { Poller::Wake(); }
 };
 #endif // DISCORD_DISABLE_IO_THREAD
 static IoThreadHolder* IoThread{nullptr};
@@ -163,199 +795,628 @@ static void SignalIOActivity()
     }
 }
 
-static bool RegisterForEvent(const char* evtName)
+// Called whenever something was queued up for RunCallbacks/PollEvent on context.
+static void SignalEventsReady(DiscordContext& context)
 {
-    auto qmessage = SendQueue.GetNextAddMessage();
-    if (qmessage) {
-        qmessage->length =
-          JsonWriteSubscribeCommand(qmessage->buffer, sizeof(qmessage->buffer), Nonce++, evtName);
-        SendQueue.CommitAdd();
-        SignalIOActivity();
-        return true;
+    {
+        std::lock_guard<std::mutex> lock(context.eventsReadyMutex);
+        context.eventsReady = true;
     }
-    return false;
+    context.eventsReadyCondition.notify_all();
+    Poller::Wake();
 }
 
-static bool DeregisterForEvent(const char* evtName)
+#ifndef DISCORD_PRESENCE_ONLY
+// Queues a join reply for the IO thread to write to the given connection.
+static bool QueueJoinReply(PerConnectionState& cs, const char* userId, int reply)
 {
-    auto qmessage = SendQueue.GetNextAddMessage();
-    if (qmessage) {
-        qmessage->length =
-          JsonWriteUnsubscribeCommand(qmessage->buffer, sizeof(qmessage->buffer), Nonce++, evtName);
-        SendQueue.CommitAdd();
-        SignalIOActivity();
+    std::lock_guard<std::mutex> lock(cs.joinRepliesMutex);
+    auto qmessage = cs.joinReplies.GetNextAddMessage();
+    if (!qmessage) {
+        ++cs.joinReplyStats.dropped;
+        return false;
+    }
+    qmessage->length =
+      JsonWriteJoinReply(qmessage->buffer, sizeof(qmessage->buffer), userId, reply, Nonce++);
+    if (qmessage->length > sizeof(qmessage->buffer)) {
+        // no real user id comes anywhere near that
+        ++cs.joinReplyStats.dropped;
+        return false;
+    }
+    qmessage->queuedAtUs = NowUs();
+    cs.joinReplies.CommitAdd();
+    return true;
+}
+#endif
+
+// Reports an error of our own through the errored handler/event.
+static void ReportError(DiscordContext& context,
+                        const char* ipcPath,
+                        int errorCode,
+                        const char* message)
+{
+    {
+        std::lock_guard<std::mutex> lock(context.errorMutex);
+        context.lastErrorCode = errorCode;
+        StringCopy(context.lastErrorIpcPath, ipcPath);
+        StringCopy(context.lastErrorMessage, message);
+    }
+    context.gotAnyErrorMessage.store(true);
+    SignalEventsReady(context);
+}
+
+static void ReportPresenceTooLarge(DiscordContext& context, const char* ipcPath, size_t needed)
+{
+    char message[256];
+    snprintf(message,
+             sizeof(message),
+             "Presence takes %u bytes, more than the maxMessageSize of %u",
+             (unsigned)needed,
+             (unsigned)context.options.maxMessageSize);
+    ReportError(context, ipcPath, DISCORD_ERROR_PRESENCE_TOO_LARGE, message);
+}
+
+// Serializes a presence into context.stagedPresence with writePresence(buffer, maxLen, nonce),
+// which returns the length it needs. One larger than options.maxMessageSize is reported as an error
+// instead, for ipcPath, and false returned. Must be called with context.presenceMutex held.
+template <typename WritePresence>
+static bool StagePresence(DiscordContext& context,
+                          const char* ipcPath,
+                          WritePresence&& writePresence)
+{
+    auto& staged = context.stagedPresence;
+    size_t needed = staged.Serialize(context.options.maxMessageSize, writePresence);
+    if (needed > context.options.maxMessageSize) {
+        ReportPresenceTooLarge(context, ipcPath, needed);
+        return false;
+    }
+    staged.queuedAtUs = NowUs();
+    return true;
+}
+
+// Reports what Discord_ValidatePresence finds wrong with the DISCORD_PRESENCE_FIELD_* in mask of
+// presence, if anything, so it's never sent for Discord to turn down a round trip later.
+static bool CheckPresence(DiscordContext& context,
+                          const DiscordRichPresence* presence,
+                          uint32_t mask = ~0u)
+{
+    const char* field = nullptr;
+    int result = presence ? ValidatePresence(presence, mask, &field) : DISCORD_PRESENCE_VALID;
+    if (result == DISCORD_PRESENCE_VALID) {
         return true;
     }
+    static const char* const Problems[] = {
+      "", "invalid UTF-8", "too long", "too short", "button without a url"};
+    char message[256];
+    snprintf(message, sizeof(message), "Presence %s: %s", field, Problems[result]);
+    ReportError(context, "", DISCORD_ERROR_PRESENCE_INVALID, message);
     return false;
 }
 
-// Create a new PerConnectionState for the given path and append it to Connections.
-// Must be called with ConnectionsMutex held.
-static void AddConnection(const char* path)
+// Replaces whatever presence is waiting to be written to the given connection.
+// writePresence(buffer, maxLen, nonce) serializes it, see StagePresence.
+template <typename WritePresence>
+static void QueuePresence(PerConnectionState& cs, WritePresence&& writePresence)
 {
-    auto cs = std::make_shared<PerConnectionState>();
-    cs->path = path;
-    cs->rpc = RpcConnection::Create(StoredAppId, path);
+    auto& context = *cs.context;
+    std::lock_guard<std::mutex> staging(context.presenceMutex);
+    if (!StagePresence(context, cs.rpc->Path(), writePresence)) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(cs.presenceMutex);
+    cs.queuedPresence.Copy(context.stagedPresence);
+    if (cs.updatePresence.exchange(true)) {
+        ++cs.presenceStats.replaced;
+    }
+}
 
-    std::weak_ptr<PerConnectionState> wcs = cs;
+// Hands the context's presence to cs, unless it has that one already.
+// Must be called with context.presenceMutex held.
+static void ShareContextPresence(DiscordContext& context, PerConnectionState& cs)
+{
+    std::lock_guard<std::mutex> guard(cs.presenceMutex);
+    if (cs.presenceGeneration >= context.presenceGeneration) {
+        return;
+    }
+    cs.queuedPresence.Copy(context.presence);
+    cs.presenceGeneration = context.presenceGeneration;
+    if (cs.updatePresence.exchange(true)) {
+        ++cs.presenceStats.replaced;
+    }
+}
 
-    cs->rpc->onConnect = [wcs](JsonDocument& readyMessage) {
-        auto cs = wcs.lock();
-        if (!cs) {
+// Makes what writePresence(buffer, maxLen, nonce) serializes the presence of every connection of
+// the context, including the ones that aren't there yet.
+template <typename WritePresence>
+static void SetContextPresence(DiscordContext& context, WritePresence&& writePresence)
+{
+    {
+        std::lock_guard<std::mutex> guard(context.presenceMutex);
+        if (!StagePresence(context, "", writePresence)) {
+            // whatever was set before stays
             return;
         }
-        Discord_UpdateHandlers(&QueuedHandlers);
-        if (cs->queuedPresence.length > 0) {
-            cs->updatePresence.store(true);
-            SignalIOActivity();
-        }
-        auto data = GetObjMember(&readyMessage, "data");
-        auto user = GetObjMember(data, "user");
-        auto userId = GetStrMember(user, "id");
-        auto username = GetStrMember(user, "username");
-        auto avatar = GetStrMember(user, "avatar");
-        if (userId && username) {
-            StringCopy(cs->connectedUser.userId, userId);
-            StringCopy(cs->connectedUser.username, username);
-            auto discriminator = GetStrMember(user, "discriminator");
-            if (discriminator) {
-                StringCopy(cs->connectedUser.discriminator, discriminator);
-            }
-            if (avatar) {
-                StringCopy(cs->connectedUser.avatar, avatar);
-            }
-            else {
-                cs->connectedUser.avatar[0] = 0;
-            }
+        std::swap(context.presence, context.stagedPresence);
+        ++context.presenceGeneration;
+        // the next one is staged in the buffer this one replaced, which gets as big right away
+        auto& next = context.stagedPresence.buffer;
+        if (next.size() < context.presence.buffer.size()) {
+            next.resize(context.presence.buffer.size());
         }
-        cs->wasJustConnected.store(true);
-        cs->reconnectTimeMs.reset();
-    };
-
-    cs->rpc->onDisconnect = [wcs](int err, const char* message) {
-        auto cs = wcs.lock();
-        if (!cs) {
-            return;
+    }
+    {
+        // connections that come along after this pick it up in onConnect
+        std::lock_guard<std::mutex> lock(context.connectionsMutex);
+        for (auto& cs : context.connections) {
+            std::lock_guard<std::mutex> guard(context.presenceMutex);
+            ShareContextPresence(context, *cs);
         }
-        cs->lastDisconnectErrorCode = err;
-        StringCopy(cs->lastDisconnectErrorMessage, message);
-        cs->wasJustDisconnected.store(true);
-    };
-
-    Connections.push_back(std::move(cs));
+    }
+    SignalIOActivity();
 }
 
-#ifdef DISCORD_DISABLE_IO_THREAD
-extern "C" DISCORD_EXPORT void Discord_UpdateConnection(void)
-#else
-static void Discord_UpdateConnection(void)
-#endif
+// Serializes what Discord_SubmitPresence left for the context, if there's anything new, the way
+// Discord_UpdatePresence would have on the caller's thread.
+static void TakeSubmittedPresence(DiscordContext& context)
 {
-    if (StoredAppId[0] == 0) {
+    auto& submitted = context.submittedPresence;
+    if (!context.submissions.Take(submitted)) {
         return;
     }
-
-    auto now = std::chrono::steady_clock::now();
-    if (now - LastPathScan >= PathScanInterval) {
-        CachedPathSet.clear();
-        for (auto& p : BaseConnection::ScanAvailablePaths()) {
-            CachedPathSet.insert(std::move(p));
-        }
-        LastPathScan = now;
+    const DiscordRichPresence* presence = submitted.clear ? nullptr : &submitted.presence;
+    if (!CheckPresence(context, presence)) {
+        return;
     }
-    const auto& availableSet = CachedPathSet;
-
-    // Take snapshot for processing (also add/remove under the same lock).
-    std::vector<std::shared_ptr<PerConnectionState>> snapshot;
-    {
-        std::lock_guard<std::mutex> lock(ConnectionsMutex);
+    SetActivePresence(context, nullptr);
+    SetContextPresence(context, [&](char* buffer, size_t maxLen, int nonce) {
+        return JsonWriteRichPresenceObj(buffer, maxLen, nonce, Pid, presence);
+    });
+}
 
-        // Add a connection for each newly discovered path.
-        for (const auto& p : availableSet) {
-            bool found = false;
-            for (const auto& cs : Connections) {
-                if (cs->path == p) {
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                AddConnection(p.c_str());
-            }
-        }
+#ifndef DISCORD_PRESENCE_ONLY
+// Events we subscribe to while there is a handler for them, one bit each.
+static const struct {
+    uint32_t bit;
+    const char* evtName;
+} SubscribableEvents[] = {
+  {1 << 0, "ACTIVITY_JOIN"},
+  {1 << 1, "ACTIVITY_SPECTATE"},
+  {1 << 2, "ACTIVITY_JOIN_REQUEST"},
+};
 
-        // Remove connections that are disconnected and whose path is no longer present.
-        Connections.erase(std::remove_if(Connections.begin(),
-                                         Connections.end(),
-                                         [&](const std::shared_ptr<PerConnectionState>& cs) {
-                                             return availableSet.find(cs->path) ==
-                                               availableSet.end() &&
-                                               !cs->rpc->IsOpen();
-                                         }),
-                          Connections.end());
+static uint32_t GetWantedSubscriptions(const DiscordEventHandlers& handlers)
+{
+    return (handlers.joinGame ? SubscribableEvents[0].bit : 0) |
+      (handlers.spectateGame ? SubscribableEvents[1].bit : 0) |
+      (handlers.joinRequest ? SubscribableEvents[2].bit : 0);
+}
 
-        snapshot = Connections;
+// Sends an open connection whatever SUBSCRIBE/UNSUBSCRIBE it is missing to match
+// wantedSubscriptions. IO thread only.
+static void UpdateSubscriptions(DiscordContext& context, PerConnectionState& cs)
+{
+    uint32_t wanted = context.wantedSubscriptions.load();
+    int64_t queuedAtUs = std::max(cs.connectedAtUs, context.wantedSubscriptionsChangedAtUs.load());
+    char buffer[MaxCommandSize];
+    for (const auto& event : SubscribableEvents) {
+        bool want = (wanted & event.bit) != 0;
+        if (want == ((cs.subscriptions & event.bit) != 0)) {
+            continue;
+        }
+        size_t length = want
+          ? JsonWriteSubscribeCommand(buffer, sizeof(buffer), Nonce++, event.evtName)
+          : JsonWriteUnsubscribeCommand(buffer, sizeof(buffer), Nonce++, event.evtName);
+        if (!cs.rpc->Write(buffer, length)) {
+            return;
+        }
+        cs.subscriptions ^= event.bit;
+        cs.controlStats.RecordSend(queuedAtUs);
     }
+}
+#endif
 
-    // Process each connection: reconnect or read/write, without holding ConnectionsMutex.
-    // Every entry has rpc != nullptr by construction (AddConnection always assigns it).
-    for (auto& cs : snapshot) {
-        if (!cs->rpc->IsOpen()) {
-            // Connections matching both !IsOpen() and "path gone" are erased
+static void OnConnect(void* callbackData, JsonDocument& readyMessage)
+{
+    // the connection's rpc is what calls this, so cs is still there
+    auto cs = static_cast<PerConnectionState*>(callbackData);
+    auto ctx = cs->context;
+#ifndef DISCORD_PRESENCE_ONLY
+    // a fresh session, whatever we were subscribed to before is gone
+    cs->subscriptions = 0;
+#endif
+    cs->producersGeneration = 0;
+    cs->producersSent.clear();
+    cs->connectedAtUs = NowUs();
+    {
+        std::lock_guard<std::mutex> contextGuard(ctx->presenceMutex);
+        ShareContextPresence(*ctx, *cs);
+        std::lock_guard<std::mutex> guard(cs->presenceMutex);
+        if (cs->queuedPresence.length > 0) {
+            cs->queuedPresence.queuedAtUs = cs->connectedAtUs;
+            cs->updatePresence.store(true);
+        }
+    }
+    auto data = GetObjMember(&readyMessage, "data");
+    auto user = GetObjMember(data, "user");
+    auto userId = GetStrMember(user, "id");
+    auto username = GetStrMember(user, "username");
+    auto avatar = GetStrMember(user, "avatar");
+    if (userId && username) {
+        StringCopy(cs->connectedUser.userId, userId);
+        StringCopy(cs->connectedUser.username, username);
+        auto discriminator = GetStrMember(user, "discriminator");
+        if (discriminator) {
+            StringCopy(cs->connectedUser.discriminator, discriminator);
+        }
+        if (avatar) {
+            StringCopy(cs->connectedUser.avatar, avatar);
+        }
+        else {
+            cs->connectedUser.avatar[0] = 0;
+        }
+    }
+    cs->wasJustConnected.store(true);
+    cs->reconnectTimeMs.reset();
+    SignalEventsReady(*ctx);
+}
+
+static void OnDisconnect(void* callbackData, int err, const char* message)
+{
+    auto cs = static_cast<PerConnectionState*>(callbackData);
+    cs->lastDisconnectErrorCode = err;
+    StringCopy(cs->lastDisconnectErrorMessage, message);
+    // whatever was in flight isn't coming back
+    cs->presenceAcks.awaitedNonce.store(0);
+    cs->wasJustDisconnected.store(true);
+    SignalEventsReady(*cs->context);
+}
+
+// Create a new PerConnectionState for the given path and append it to context.connections.
+// Must be called with context.connectionsMutex held.
+static void AddConnection(DiscordContext& context, const char* path)
+{
+    auto cs = std::allocate_shared<PerConnectionState>(
+      HookAllocator<PerConnectionState>(), &context, context.options);
+    cs->path = path;
+    cs->rpc = RpcConnection::Create(context.appId, path, context.options.maxFrameSize);
+    cs->rpc->callbackData = cs.get();
+    cs->rpc->onConnect = OnConnect;
+    cs->rpc->onDisconnect = OnDisconnect;
+    context.connections.push_back(std::move(cs));
+}
+
+// Makes nextPresenceUs, 0 for none yet, no later than atUs.
+static void HoldPresenceUntil(int64_t& nextPresenceUs, int64_t atUs)
+{
+    nextPresenceUs = nextPresenceUs ? std::min(nextPresenceUs, atUs) : atUs;
+}
+
+// Whether there's a presence token to take, or else makes nextPresenceUs no later than when one
+// is back. IO thread only.
+static bool PresenceTokenReady(const TokenBucket& tokens, int64_t& nextPresenceUs)
+{
+    if (tokens.ready(NowUs())) {
+        return true;
+    }
+    HoldPresenceUntil(nextPresenceUs, tokens.nextTokenUs());
+    return false;
+}
+
+// With options.presenceAckTimeoutMs set, whether the last SET_ACTIVITY written to cs still waits
+// for its response, which holds back the next one until then or the timeout. In that case
+// nextPresenceUs is made no later than the timeout. IO thread only.
+static bool AwaitingPresenceAck(DiscordContext& context,
+                                PerConnectionState& cs,
+                                int64_t& nextPresenceUs)
+{
+    uint32_t timeoutMs = context.options.presenceAckTimeoutMs;
+    if (!timeoutMs || !cs.presenceAcks.awaitedNonce.load()) {
+        return false;
+    }
+    int64_t deadlineUs = cs.presenceAcks.writtenAtUs.load() + (int64_t)timeoutMs * 1000;
+    if (NowUs() >= deadlineUs) {
+        cs.presenceAcks.RecordTimeout();
+        return false;
+    }
+    HoldPresenceUntil(nextPresenceUs, deadlineUs);
+    return true;
+}
+
+// Writes out what changed under other pids since cs last caught up, each pid as far as its own
+// tokens go and all of them as far as acks and the connection's tokens go, which it shares with
+// the presence under our pid. When flushing on shutdown none of that holds anything back.
+static void SendProducerPresence(DiscordContext& context,
+                                 PerConnectionState& cs,
+                                 int64_t& nextPresenceUs,
+                                 bool flushing = false)
+{
+    std::lock_guard<std::mutex> lock(context.producersMutex);
+    uint64_t generation = context.producersGeneration.load();
+    bool caughtUp = true;
+    auto& sending = cs.sendingPresence;
+    for (const auto& producer : context.producers) {
+        auto sent = cs.producersSent.find(producer.first);
+        if (sent == cs.producersSent.end()) {
+            if (producer.second.activity.empty()) {
+                // nothing to clear on this session
+                continue;
+            }
+            sent = cs.producersSent
+                     .emplace(std::piecewise_construct,
+                              std::forward_as_tuple(producer.first),
+                              std::forward_as_tuple(context.options))
+                     .first;
+        }
+        if (sent->second.generation >= producer.second.generation) {
+            continue;
+        }
+        if (!flushing && AwaitingPresenceAck(context, cs, nextPresenceUs)) {
+            // the rest goes out one response at a time
+            return;
+        }
+        if (!flushing && !PresenceTokenReady(cs.presenceTokens, nextPresenceUs)) {
+            // nothing else goes out on this connection until then
+            return;
+        }
+        if (!flushing && !PresenceTokenReady(sent->second.tokens, nextPresenceUs)) {
+            // goes out once this pid has tokens again, the others needn't wait for that
+            caughtUp = false;
+            continue;
+        }
+        size_t needed = sending.Serialize(
+          context.options.maxMessageSize, [&](char* buffer, size_t maxLen, int nonce) {
+              return JsonWriteActivityCommand(buffer,
+                                              maxLen,
+                                              nonce,
+                                              producer.first,
+                                              producer.second.activity.data(),
+                                              producer.second.activity.size());
+          });
+        if (needed > context.options.maxMessageSize) {
+            // never sent, so it costs no tokens; what was shown before stays
+            ReportPresenceTooLarge(context, cs.rpc->Path(), needed);
+            sent->second.generation = producer.second.generation;
+            continue;
+        }
+        if (!flushing) {
+            int64_t nowUs = NowUs();
+            cs.presenceTokens.take(nowUs);
+            sent->second.tokens.take(nowUs);
+        }
+        if (!cs.rpc->Write(sending.buffer.data(), sending.length)) {
+            // the rest goes out after the reconnect, with the tokens this didn't use
+            if (!flushing) {
+                cs.presenceTokens.refund();
+                sent->second.tokens.refund();
+            }
+            return;
+        }
+        cs.presenceStats.RecordSend(producer.second.queuedAtUs);
+        cs.presenceAcks.RecordWrite(sending.nonce);
+        if (producer.second.activity.empty()) {
+            // cleared, so there's nothing left to remember about this pid here
+            cs.producersSent.erase(sent);
+            continue;
+        }
+        sent->second.shown = true;
+        sent->second.generation = producer.second.generation;
+    }
+    if (caughtUp) {
+        cs.producersGeneration = generation;
+    }
+}
+
+// Erases the cleared pids that every open connection has caught up with: each of them sent the
+// clear or never showed the pid, and one that opens later starts over without them. Otherwise
+// every pid that ever had a presence would stay in context.producers.
+static void ForgetClearedProducers(DiscordContext& context)
+{
+    uint64_t caughtUp = context.producersGeneration.load();
+    for (auto& cs : context.ioSnapshot) {
+        if (cs->rpc->IsOpen()) {
+            caughtUp = std::min(caughtUp, cs->producersGeneration);
+        }
+    }
+    if (caughtUp <= context.producersForgottenAt) {
+        return;
+    }
+    context.producersForgottenAt = caughtUp;
+    std::lock_guard<std::mutex> lock(context.producersMutex);
+    for (auto producer = context.producers.begin(); producer != context.producers.end();) {
+        if (producer->second.activity.empty() && producer->second.generation <= caughtUp) {
+            producer = context.producers.erase(producer);
+        }
+        else {
+            ++producer;
+        }
+    }
+}
+
+// Closes the connections left over from a previous application id once the client they're on has
+// been sent presence under the current one.
+static void RetireReplacedConnections(DiscordContext& context)
+{
+    std::lock_guard<std::mutex> lock(context.connectionsMutex);
+    if (context.retiringConnections.empty()) {
+        return;
+    }
+    bool expired = std::chrono::steady_clock::now() >= context.retireDeadline;
+    auto isReplaced = [&](const std::shared_ptr<PerConnectionState>& old) {
+        if (expired || !old->rpc->IsOpen()) {
+            return true;
+        }
+        for (const auto& cs : context.connections) {
+            if (cs->path == old->path && cs->rpc->IsOpen() && !cs->updatePresence.load()) {
+                return true;
+            }
+        }
+        return false;
+    };
+    // destroying them drops their callbacks first, so none of this shows up as a disconnect
+    context.retiringConnections.erase(std::remove_if(context.retiringConnections.begin(),
+                                                     context.retiringConnections.end(),
+                                                     isReplaced),
+                                      context.retiringConnections.end());
+
+    // keep up with pings on the ones that stay for now, nothing else they say matters anymore
+    for (auto& old : context.retiringConnections) {
+        for (uint32_t budget = context.options.readBudget; budget && old->rpc->Read(); --budget) {
+        }
+    }
+}
+
+// Returns whether a handshake on one of the connections is still waiting for its READY.
+// nextPresenceUs is made no later than when there is presence to look at again, see
+// NextPresenceUs, and moreToRead set if a connection had more to read than its budget.
+static bool UpdateContextConnections(DiscordContext& context,
+                                     const PathList& availablePaths,
+                                     int64_t& nextPresenceUs,
+                                     bool& moreToRead)
+{
+    auto isAvailable = [&](const HookString& path) {
+        return std::find(availablePaths.begin(), availablePaths.end(), path) !=
+          availablePaths.end();
+    };
+
+    // Take snapshot for processing (also add/remove under the same lock).
+    auto& snapshot = context.ioSnapshot;
+    {
+        std::lock_guard<std::mutex> lock(context.connectionsMutex);
+
+        // Add a connection for each newly discovered path.
+        for (const auto& p : availablePaths) {
+            bool found = false;
+            for (const auto& cs : context.connections) {
+                if (cs->path == p) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                AddConnection(context, p.c_str());
+            }
+        }
+
+        // Remove connections that are disconnected and whose path is no longer present.
+        context.connections.erase(
+          std::remove_if(context.connections.begin(),
+                         context.connections.end(),
+                         [&](const std::shared_ptr<PerConnectionState>& cs) {
+                             return !isAvailable(cs->path) && !cs->rpc->IsOpen();
+                         }),
+          context.connections.end());
+
+        snapshot.assign(context.connections.begin(), context.connections.end());
+    }
+
+    // Process each connection: reconnect or read/write, without holding connectionsMutex.
+    // Every entry has rpc != nullptr by construction (AddConnection always assigns it).
+    bool awaitingReady = false;
+    size_t first = snapshot.empty() ? 0 : context.ioNextFirst++ % snapshot.size();
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        auto& cs = snapshot[(first + i) % snapshot.size()];
+        if (!cs->rpc->IsOpen()) {
+            // Connections matching both !IsOpen() and "path gone" are erased
             // above, so reaching this branch indicates a broken invariant.
-            if (availableSet.find(cs->path) == availableSet.end()) {
+            if (!isAvailable(cs->path)) {
                 assert(false);
                 continue;
             }
-            if (std::chrono::system_clock::now() >= cs->nextConnect) {
-                cs->nextConnect = std::chrono::system_clock::now() +
-                  std::chrono::duration<int64_t, std::milli>{cs->reconnectTimeMs.nextDelay()};
+            // a connection waiting for its READY is read from right away, there's no need to
+            // hold that off until the next reconnect attempt would be due
+            if (cs->rpc->state == RpcConnection::State::SentHandshake ||
+                std::chrono::system_clock::now() >= cs->nextConnect) {
+                // only a new attempt moves the backoff along, not every look for its READY;
+                // the READY resets it
+                bool wasDisconnected = cs->rpc->state == RpcConnection::State::Disconnected;
+                if (wasDisconnected) {
+                    int64_t delayMs = cs->reconnectTimeMs.nextDelay();
+                    cs->nextConnect = std::chrono::system_clock::now() +
+                      std::chrono::duration<int64_t, std::milli>{delayMs};
+                    FlightRecorder::RecordBackoff(cs->rpc->id, delayMs);
+                }
                 cs->rpc->Open();
+                if (wasDisconnected && cs->rpc->state == RpcConnection::State::SentHandshake) {
+                    cs->handshakeSentAtUs = NowUs();
+                }
+            }
+            if (!cs->rpc->IsOpen()) {
+                awaitingReady = awaitingReady ||
+                  (cs->rpc->state == RpcConnection::State::SentHandshake &&
+                   NowUs() - cs->handshakeSentAtUs < HandshakePollUs);
+                continue;
             }
         }
-        else {
-            // reads
-            for (;;) {
-                JsonDocument message;
 
-                if (!cs->rpc->Read(message)) {
+        {
+            // reads, as many as the budget allows so a chatty client can't hold up the writes to
+            // it and everything on the other connections; the rest waits for the next tick
+            uint32_t budget = context.options.readBudget;
+            for (;;) {
+                if (budget == 0) {
+                    // only a hit if the client actually sent more than that
+                    if (cs->rpc->Readable()) {
+                        moreToRead = true;
+                        ++IoTickStats.readBudgetHits;
+                    }
+                    break;
+                }
+                --budget;
+                auto message = cs->rpc->Read();
+                if (!message) {
                     break;
                 }
 
-                const char* evtName = GetStrMember(&message, "evt");
-                const char* nonce = GetStrMember(&message, "nonce");
+                const char* evtName = GetStrMember(message, "evt");
+                const char* nonce = GetStrMember(message, "nonce");
 
                 if (nonce) {
                     // in responses only -- should use to match up response when needed.
+                    cs->presenceAcks.RecordResponse(atoi(nonce));
 
                     if (evtName && strcmp(evtName, "ERROR") == 0) {
-                        auto data = GetObjMember(&message, "data");
-                        LastErrorCode = GetIntMember(data, "code");
-                        StringCopy(LastErrorIpcPath, cs->rpc->Path());
-                        StringCopy(LastErrorMessage, GetStrMember(data, "message", ""));
-                        GotAnyErrorMessage.store(true);
+                        auto data = GetObjMember(message, "data");
+                        ReportError(context,
+                                    cs->rpc->Path(),
+                                    GetIntMember(data, "code"),
+                                    GetStrMember(data, "message", ""));
+                    }
+                    else if (context.pollsEvents.load(std::memory_order_relaxed)) {
+                        auto ack = context.ackQueue.GetNextAddMessage();
+                        if (ack) {
+                            ack->nonce = atoi(nonce);
+                            StringCopy(ack->command, GetStrMember(message, "cmd", ""));
+                            StringCopy(ack->ipcPath, cs->rpc->Path());
+                            context.ackQueue.CommitAdd();
+                            SignalEventsReady(context);
+                        }
                     }
                 }
+#ifndef DISCORD_PRESENCE_ONLY
                 else {
                     // should have evt == name of event, optional data
                     if (evtName == nullptr) {
                         continue;
                     }
 
-                    auto data = GetObjMember(&message, "data");
+                    auto data = GetObjMember(message, "data");
 
                     if (strcmp(evtName, "ACTIVITY_JOIN") == 0) {
                         auto secret = GetStrMember(data, "secret");
                         if (secret) {
-                            StringCopy(JoinGameSecret, secret);
-                            WasJoinGame.store(true);
+                            StringCopy(context.joinGameSecret, secret);
+                            StringCopy(context.joinGameIpcPath, cs->rpc->Path());
+                            context.wasJoinGame.store(true);
+                            SignalEventsReady(context);
                         }
                     }
                     else if (strcmp(evtName, "ACTIVITY_SPECTATE") == 0) {
                         auto secret = GetStrMember(data, "secret");
                         if (secret) {
-                            StringCopy(SpectateGameSecret, secret);
-                            WasSpectateGame.store(true);
+                            StringCopy(context.spectateGameSecret, secret);
+                            StringCopy(context.spectateGameIpcPath, cs->rpc->Path());
+                            context.wasSpectateGame.store(true);
+                            SignalEventsReady(context);
                         }
                     }
                     else if (strcmp(evtName, "ACTIVITY_JOIN_REQUEST") == 0) {
@@ -363,339 +1424,1552 @@ static void Discord_UpdateConnection(void)
                         auto userId = GetStrMember(user, "id");
                         auto username = GetStrMember(user, "username");
                         auto avatar = GetStrMember(user, "avatar");
-                        auto joinReq = JoinAskQueue.GetNextAddMessage();
+                        auto joinReq = context.joinAskQueue.GetNextAddMessage();
                         if (userId && username && joinReq) {
-                            StringCopy(joinReq->userId, userId);
-                            StringCopy(joinReq->username, username);
+                            StringCopy(joinReq->user.userId, userId);
+                            StringCopy(joinReq->user.username, username);
                             auto discriminator = GetStrMember(user, "discriminator");
                             if (discriminator) {
-                                StringCopy(joinReq->discriminator, discriminator);
+                                StringCopy(joinReq->user.discriminator, discriminator);
+                            }
+                            else {
+                                joinReq->user.discriminator[0] = 0;
                             }
                             if (avatar) {
-                                StringCopy(joinReq->avatar, avatar);
+                                StringCopy(joinReq->user.avatar, avatar);
                             }
                             else {
-                                joinReq->avatar[0] = 0;
+                                joinReq->user.avatar[0] = 0;
                             }
-                            JoinAskQueue.CommitAdd();
+                            StringCopy(joinReq->ipcPath, cs->rpc->Path());
+                            cs->joinRequests.Add(userId);
+                            context.joinAskQueue.CommitAdd();
+                            SignalEventsReady(context);
                         }
                     }
                 }
+#endif
+            }
+
+            // writes, most time sensitive lane first
+#ifndef DISCORD_PRESENCE_ONLY
+            if (cs->subscriptions != context.wantedSubscriptions.load()) {
+                UpdateSubscriptions(context, *cs);
+            }
+
+            while (cs->rpc->IsOpen() && cs->joinReplies.HavePendingSends()) {
+                auto qmessage = cs->joinReplies.GetNextSendMessage();
+                if (cs->rpc->Write(qmessage->buffer, qmessage->length)) {
+                    cs->joinReplyStats.RecordSend(qmessage->queuedAtUs);
+                }
+                cs->joinReplies.CommitSend();
             }
+#endif
 
-            // write presence to this connection if needed
-            if (cs->updatePresence.exchange(false) && cs->queuedPresence.length) {
-                QueuedMessage local;
+            // an update that has to wait for an ack or a token stays queued, and whatever
+            // replaces it meanwhile goes out as soon as it can; only a write takes a token
+            if (cs->rpc->IsOpen() && cs->updatePresence.load() &&
+                !AwaitingPresenceAck(context, *cs, nextPresenceUs) &&
+                PresenceTokenReady(cs->presenceTokens, nextPresenceUs)) {
+                auto& sending = cs->sendingPresence;
+                bool queued;
                 {
                     std::lock_guard<std::mutex> guard(cs->presenceMutex);
-                    local.Copy(cs->queuedPresence);
+                    queued = cs->updatePresence.exchange(false) && cs->queuedPresence.length;
+                    if (queued) {
+                        sending.Copy(cs->queuedPresence);
+                    }
                 }
-                if (!cs->rpc->Write(local.buffer, local.length)) {
-                    // requeue for retry on next cycle
-                    cs->updatePresence.store(true);
+                if (queued) {
+                    cs->presenceTokens.take(NowUs());
+                    if (cs->rpc->Write(sending.buffer.data(), sending.length)) {
+                        cs->presenceStats.RecordSend(sending.queuedAtUs);
+                        cs->presenceAcks.RecordWrite(sending.nonce);
+                    }
+                    else {
+                        // requeue for retry on next cycle, with the token it didn't use
+                        cs->presenceTokens.refund();
+                        cs->updatePresence.store(true);
+                    }
                 }
             }
-        }
-    }
 
-    // Drain the send queue and broadcast each message to all open connections.
-    while (SendQueue.HavePendingSends()) {
-        auto qmessage = SendQueue.GetNextSendMessage();
-        QueuedMessage local;
-        local.Copy(*qmessage);
-        SendQueue.CommitSend();
-        for (auto& cs : snapshot) {
-            if (cs->rpc->IsOpen()) {
-                cs->rpc->Write(local.buffer, local.length);
+            if (cs->rpc->IsOpen() &&
+                cs->producersGeneration != context.producersGeneration.load()) {
+                SendProducerPresence(context, *cs, nextPresenceUs);
+            }
+
+            // a response is only seen once it's read, so until it comes the IO thread checks back
+            // as it does for a READY; that keeps the ack times what the client took
+            if (cs->presenceAcks.awaitedNonce.load() &&
+                NowUs() - cs->presenceAcks.writtenAtUs.load() < HandshakePollUs) {
+                HoldPresenceUntil(nextPresenceUs, NowUs() + HandshakePollMs * 1000);
             }
         }
     }
+
+    ForgetClearedProducers(context);
+    // don't keep connections that were removed meanwhile around until the next tick
+    snapshot.clear();
+    RetireReplacedConnections(context);
+    return awaitingReady;
 }
 
-extern "C" DISCORD_EXPORT void Discord_Initialize(const char* applicationId,
-                                                  DiscordEventHandlers* handlers,
-                                                  int autoRegister,
-                                                  const char* optionalSteamId)
+static void RecordPathChanges(const PathList& before, const PathList& after)
 {
-    if (IoThread != nullptr) {
-        return;
-    }
-
-    IoThread = new (std::nothrow) IoThreadHolder();
-    if (IoThread == nullptr) {
-        return;
-    }
-
-    if (autoRegister) {
-        if (optionalSteamId && optionalSteamId[0]) {
-            Discord_RegisterSteamGame(applicationId, optionalSteamId);
+    for (const auto& path : after) {
+        if (std::find(before.begin(), before.end(), path) == before.end()) {
+            FlightRecorder::RecordPath(FlightEvent::PathAdded, path.c_str());
         }
-        else {
-            Discord_Register(applicationId, nullptr);
+    }
+    for (const auto& path : before) {
+        if (std::find(after.begin(), after.end(), path) == after.end()) {
+            FlightRecorder::RecordPath(FlightEvent::PathRemoved, path.c_str());
         }
     }
+}
 
-    Pid = GetProcessId();
-
+#ifdef DISCORD_DISABLE_IO_THREAD
+extern "C" DISCORD_EXPORT void Discord_UpdateConnection(void)
+#else
+static void Discord_UpdateConnection(void)
+#endif
+{
+    std::lock_guard<std::timed_mutex> updating(UpdateMutex);
+    auto& contexts = UpdatingContexts;
     {
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-
-        if (handlers) {
-            QueuedHandlers = *handlers;
-        }
-        else {
-            QueuedHandlers = {};
+        std::lock_guard<std::mutex> lock(ContextsMutex);
+        if (Contexts.empty()) {
+            return;
         }
-
-        Handlers = {};
+        contexts.assign(Contexts.begin(), Contexts.end());
     }
 
-    StringCopy(StoredAppId, applicationId);
+#ifdef DISCORD_DISABLE_IO_THREAD
+    Poller::ClearWake();
+#endif
+    int64_t startedAtUs = NowUs();
 
-    // Force a path scan on the IO thread's first tick.
-    LastPathScan = std::chrono::steady_clock::time_point{};
-    CachedPathSet.clear();
+    // one scan serves every context
+    auto now = std::chrono::steady_clock::now();
+    if (now - LastPathScan >= std::chrono::milliseconds(PathScanIntervalMs.load())) {
+        std::swap(PreviousPaths, CachedPaths);
+        BaseConnection::ScanAvailablePaths(CachedPaths);
+        RecordPathChanges(PreviousPaths, CachedPaths);
+        LastPathScan = now;
+    }
 
-    IoThread->Start();
+    bool awaitingReady = false;
+    int64_t nextPresenceUs = 0;
+    bool moreToRead = false;
+    for (auto& context : contexts) {
+        TakeSubmittedPresence(*context);
+        awaitingReady =
+          UpdateContextConnections(*context, CachedPaths, nextPresenceUs, moreToRead) ||
+          awaitingReady;
+    }
+    AwaitingReady.store(awaitingReady);
+    NextPresenceUs.store(nextPresenceUs);
+    MoreToRead.store(moreToRead);
+    IoTickStats.RecordTick(startedAtUs);
+    // a context destroyed meanwhile goes away right here
+    contexts.clear();
 }
 
-extern "C" DISCORD_EXPORT bool Discord_Connected(void)
+// Fills in the defaults for the options left 0, false if what's left makes no sense.
+static bool ResolveInitOptions(const DiscordInitOptions* options, DiscordInitOptions& resolved)
 {
-    std::lock_guard<std::mutex> lock(ConnectionsMutex);
-    for (auto& cs : Connections) {
-        if (cs->rpc->IsOpen()) {
-            return true;
-        }
+    resolved = DefaultInitOptions;
+    if (!options) {
+        return true;
+    }
+    if (options->version == 0 || options->version > DISCORD_INIT_OPTIONS_VERSION) {
+        return false;
     }
-    return false;
-}
 
-extern "C" DISCORD_EXPORT void Discord_Shutdown(void)
-{
-    if (IoThread == nullptr) {
-        return;
+    auto pick = [](uint32_t value, uint32_t fallback) { return value ? value : fallback; };
+    resolved.maxFrameSize = pick(options->maxFrameSize, resolved.maxFrameSize);
+    resolved.joinQueueSize = pick(options->joinQueueSize, resolved.joinQueueSize);
+    resolved.ackQueueSize = pick(options->ackQueueSize, resolved.ackQueueSize);
+    resolved.pathScanIntervalMs = pick(options->pathScanIntervalMs, resolved.pathScanIntervalMs);
+    resolved.ioWaitMs = pick(options->ioWaitMs, resolved.ioWaitMs);
+    resolved.reconnectMinMs = pick(options->reconnectMinMs, resolved.reconnectMinMs);
+    resolved.reconnectMaxMs = pick(options->reconnectMaxMs, resolved.reconnectMaxMs);
+    // version 1 callers have a shorter struct, with none of what follows
+    if (options->version >= 2) {
+        resolved.presenceUpdates = pick(options->presenceUpdates, resolved.presenceUpdates);
+        resolved.presencePeriodMs = pick(options->presencePeriodMs, resolved.presencePeriodMs);
     }
-    Handlers = {};
-    IoThread->Stop();
-    delete IoThread;
-    IoThread = nullptr;
-    {
-        std::lock_guard<std::mutex> lock(ConnectionsMutex);
-        Connections.clear();
+    if (options->version >= 3) {
+        resolved.presenceAckTimeoutMs = options->presenceAckTimeoutMs;
+    }
+    if (options->version >= 4) {
+        resolved.readBudget = pick(options->readBudget, resolved.readBudget);
+    }
+    if (options->version >= 5) {
+        if (options->ioThreadName) {
+            resolved.ioThreadName = options->ioThreadName;
+        }
+        resolved.ioThreadStackSize = options->ioThreadStackSize;
+        resolved.ioThreadPriority = options->ioThreadPriority;
+        resolved.ioThreadAffinity = options->ioThreadAffinity;
+        resolved.ioSubmit = options->ioSubmit;
+        resolved.ioSubmitData = options->ioSubmitData;
+        if (resolved.ioThreadPriority < -2 || resolved.ioThreadPriority > 2) {
+            return false;
+        }
+    }
+    if (resolved.maxFrameSize < MinFrameSize) {
+        return false;
     }
-    StoredAppId[0] = 0;
-    LastPathScan = std::chrono::steady_clock::time_point{};
-    CachedPathSet.clear();
-}
 
-extern "C" DISCORD_EXPORT void Discord_UpdatePresence(const DiscordRichPresence* presence)
-{
-    std::vector<std::shared_ptr<PerConnectionState>> snapshot;
-    {
-        std::lock_guard<std::mutex> lock(ConnectionsMutex);
-        snapshot = Connections;
+    // a presence goes out in a single frame
+    uint32_t maxFrameMessage =
+      resolved.maxFrameSize - (uint32_t)sizeof(RpcConnection::MessageFrameHeader);
+    if (options->maxMessageSize) {
+        resolved.maxMessageSize = options->maxMessageSize;
     }
-    for (auto& cs : snapshot) {
-        std::lock_guard<std::mutex> guard(cs->presenceMutex);
-        cs->queuedPresence.length = JsonWriteRichPresenceObj(
-          cs->queuedPresence.buffer, sizeof(cs->queuedPresence.buffer), Nonce++, Pid, presence);
-        cs->updatePresence.store(true);
+    else {
+        resolved.maxMessageSize = std::min(resolved.maxMessageSize, maxFrameMessage);
     }
-    SignalIOActivity();
+    return resolved.maxMessageSize >= MaxCommandSize &&
+      resolved.maxMessageSize <= maxFrameMessage &&
+      resolved.reconnectMinMs <= resolved.reconnectMaxMs;
 }
 
-extern "C" DISCORD_EXPORT void Discord_ClearPresence(void)
+// The IO thread and path scan go by the most demanding context.
+// Must be called with ContextsMutex held.
+static void UpdateSharedSchedule()
 {
-    Discord_UpdatePresence(nullptr);
+    uint32_t pathScanIntervalMs = DefaultInitOptions.pathScanIntervalMs;
+    uint32_t ioWaitMs = DefaultInitOptions.ioWaitMs;
+    for (size_t i = 0; i < Contexts.size(); ++i) {
+        const auto& options = Contexts[i]->options;
+        pathScanIntervalMs =
+          i ? std::min(pathScanIntervalMs, options.pathScanIntervalMs) : options.pathScanIntervalMs;
+        ioWaitMs = i ? std::min(ioWaitMs, options.ioWaitMs) : options.ioWaitMs;
+    }
+    PathScanIntervalMs.store(pathScanIntervalMs);
+    IoWaitMs.store(ioWaitMs);
 }
 
-extern "C" DISCORD_EXPORT void Discord_UpdatePresenceForUser(const char* userId,
-                                                             const DiscordRichPresence* presence)
+// Registers the application on RegisterThread, after whatever registration is still running there.
+// Must be called with ContextLifetimeMutex held, which is why the new thread waits for the previous
+// one rather than the caller.
+static void StartRegistration(const char* applicationId, const char* optionalSteamId)
 {
-    if (!userId) {
-        return;
-    }
-    std::vector<std::shared_ptr<PerConnectionState>> snapshot;
+    struct Registration {
+        char appId[64];
+        char steamId[64];
+    } registration{};
+    StringCopy(registration.appId, applicationId);
+    StringCopy(registration.steamId, optionalSteamId);
     {
-        std::lock_guard<std::mutex> lock(ConnectionsMutex);
-        snapshot = Connections;
+        std::lock_guard<std::mutex> lock(RegistrationMutex);
+        ++RegistrationsRunning;
     }
-    bool anyMatched = false;
-    for (auto& cs : snapshot) {
-        if (strcmp(cs->connectedUser.userId, userId) == 0) {
-            std::lock_guard<std::mutex> guard(cs->presenceMutex);
-            cs->queuedPresence.length = JsonWriteRichPresenceObj(
-              cs->queuedPresence.buffer, sizeof(cs->queuedPresence.buffer), Nonce++, Pid, presence);
-            cs->updatePresence.store(true);
-            anyMatched = true;
+    std::thread previous = std::move(RegisterThread);
+    RegisterThread = std::thread([registration, previous = std::move(previous)]() mutable {
+        if (previous.joinable()) {
+            previous.join();
         }
-    }
-    if (anyMatched) {
-        SignalIOActivity();
-    }
-}
-
-extern "C" DISCORD_EXPORT void Discord_ClearPresenceForUser(const char* userId)
-{
-    Discord_UpdatePresenceForUser(userId, nullptr);
+        if (registration.steamId[0]) {
+            Discord_RegisterSteamGame(registration.appId, registration.steamId);
+        }
+        else {
+            Discord_Register(registration.appId, nullptr);
+        }
+        std::lock_guard<std::mutex> lock(RegistrationMutex);
+        --RegistrationsRunning;
+        RegistrationDone.notify_all();
+    });
 }
 
-extern "C" DISCORD_EXPORT void Discord_Respond(const char* userId, /* DISCORD_REPLY_ */ int reply)
+// Joins RegisterThread, unless bounded and it's still registering by deadline, in which case
+// it's left to finish on its own.
+static void StopRegistration(bool bounded, std::chrono::steady_clock::time_point deadline)
 {
-    // TODO: should route to the connection that originated the join request
-    // instead of broadcasting through SendQueue to every open connection.
-    // Not needed for Music Presence's use case, left for follow-up.
-    // if no connections are open, let's not batch up stale messages for later
-    if (!Discord_Connected()) {
+    if (!RegisterThread.joinable()) {
         return;
     }
-    auto qmessage = SendQueue.GetNextAddMessage();
-    if (qmessage) {
-        qmessage->length =
-          JsonWriteJoinReply(qmessage->buffer, sizeof(qmessage->buffer), userId, reply, Nonce++);
-        SendQueue.CommitAdd();
-        SignalIOActivity();
+    if (bounded) {
+        std::unique_lock<std::mutex> lock(RegistrationMutex);
+        auto done = [] { return RegistrationsRunning == 0; };
+        if (!RegistrationDone.wait_until(lock, deadline, done)) {
+            RegisterThread.detach();
+            return;
+        }
     }
+    RegisterThread.join();
 }
 
-extern "C" DISCORD_EXPORT void Discord_RunCallbacks(void)
+extern "C" DISCORD_EXPORT DiscordContext* Discord_CreateContext(const char* applicationId,
+                                                                DiscordEventHandlers* handlers,
+                                                                int autoRegister,
+                                                                const char* optionalSteamId,
+                                                                const DiscordInitOptions* options)
 {
-    // Note on some weirdness: internally we might connect, get other signals, disconnect any number
-    // of times inbetween calls here. Externally, we want the sequence to seem sane, so any other
-    // signals are book-ended by calls to ready and disconnect.
-
-    if (StoredAppId[0] == 0) {
-        return;
+    if (!applicationId || !applicationId[0]) {
+        return nullptr;
     }
 
-    // Snapshot the connection list so we don't hold ConnectionsMutex while firing callbacks
-    // (which might call back into the library and deadlock).
-    std::vector<std::shared_ptr<PerConnectionState>> snapshot;
-    {
-        std::lock_guard<std::mutex> lock(ConnectionsMutex);
-        if (Connections.empty()) {
-            return;
-        }
-        snapshot = Connections;
+    DiscordInitOptions resolved;
+    if (!ResolveInitOptions(options, resolved)) {
+        return nullptr;
     }
 
-    std::vector<bool> wasDisconnected(snapshot.size());
-    std::vector<bool> isConnected(snapshot.size());
-    for (size_t i = 0; i < snapshot.size(); ++i) {
-        wasDisconnected[i] = snapshot[i]->wasJustDisconnected.exchange(false);
-        isConnected[i] = snapshot[i]->rpc->IsOpen();
+    DiscordContext* created = new (std::nothrow) DiscordContext();
+    if (!created) {
+        return nullptr;
+    }
+    std::shared_ptr<DiscordContext> context(
+      created, std::default_delete<DiscordContext>(), HookAllocator<DiscordContext>());
+    StringCopy(context->appId, applicationId);
+    context->options = resolved;
+#ifndef DISCORD_PRESENCE_ONLY
+    context->joinAskQueue.Reset(resolved.joinQueueSize);
+#endif
+    context->ackQueue.Reset(resolved.ackQueueSize);
+    if (handlers) {
+        context->handlers = *handlers;
     }
+#ifndef DISCORD_PRESENCE_ONLY
+    context->wantedSubscriptions.store(GetWantedSubscriptions(context->handlers));
+#endif
 
-    // If a connection is currently open, fire its disconnect cb first (before other signals).
-    for (size_t i = 0; i < snapshot.size(); ++i) {
-        if (isConnected[i] && wasDisconnected[i]) {
-            std::lock_guard<std::mutex> guard(HandlerMutex);
-            if (Handlers.disconnected) {
-                DiscordUser du{snapshot[i]->connectedUser.userId,
-                               snapshot[i]->connectedUser.username,
-                               snapshot[i]->connectedUser.discriminator,
-                               snapshot[i]->connectedUser.avatar};
-                Handlers.disconnected(snapshot[i]->rpc->Path(),
-                                      snapshot[i]->connectedUser.userId[0] ? &du : nullptr,
-                                      snapshot[i]->lastDisconnectErrorCode,
-                                      snapshot[i]->lastDisconnectErrorMessage);
-            }
+    std::lock_guard<std::mutex> lifetime(ContextLifetimeMutex);
+    bool startIoThread = IoThread == nullptr;
+    if (startIoThread) {
+        IoThread = new (std::nothrow) IoThreadHolder();
+        if (IoThread == nullptr) {
+            return nullptr;
         }
+        Pid = GetProcessId();
+        Poller::Open();
+
+        // Force a path scan on the IO thread's first tick. A tick a shutdown didn't wait for may
+        // still be running.
+        std::lock_guard<std::timed_mutex> updating(UpdateMutex);
+        LastPathScan = std::chrono::steady_clock::time_point{};
+        CachedPaths.clear();
+        PreviousPaths.clear();
     }
 
-    // Fire ready for each newly connected user.
-    for (size_t i = 0; i < snapshot.size(); ++i) {
-        if (snapshot[i]->wasJustConnected.exchange(false)) {
-            std::lock_guard<std::mutex> guard(HandlerMutex);
-            if (Handlers.ready) {
-                DiscordUser du{snapshot[i]->connectedUser.userId,
-                               snapshot[i]->connectedUser.username,
-                               snapshot[i]->connectedUser.discriminator,
-                               snapshot[i]->connectedUser.avatar};
-                Handlers.ready(snapshot[i]->rpc->Path(), &du);
-            }
-        }
+    {
+        std::lock_guard<std::mutex> lock(ContextsMutex);
+        Contexts.push_back(context);
+        UpdateSharedSchedule();
     }
 
-    if (GotAnyErrorMessage.exchange(false)) {
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-        if (Handlers.errored) {
-            Handlers.errored(LastErrorIpcPath, LastErrorCode, LastErrorMessage);
+    if (startIoThread) {
+        // the IO thread goes by the options of whichever context starts it
+        if (!IoThread->Start(resolved)) {
+            {
+                std::lock_guard<std::mutex> lock(ContextsMutex);
+                Contexts.clear();
+                UpdateSharedSchedule();
+            }
+            delete IoThread;
+            IoThread = nullptr;
+            Poller::Close();
+            return nullptr;
         }
     }
+    else {
+        // picks up the paths that are already known on the next tick
+        SignalIOActivity();
+    }
+    if (autoRegister) {
+        StartRegistration(applicationId, optionalSteamId);
+    }
+    return context.get();
+}
 
-    if (WasJoinGame.exchange(false)) {
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-        if (Handlers.joinGame) {
-            Handlers.joinGame(JoinGameSecret);
-        }
+// Must be called with ContextLifetimeMutex held.
+static void StopBroker()
+{
+    if (Broker == nullptr) {
+        return;
     }
+    BrokerStopping.store(true);
+    Broker->Wake();
+    BrokerThread.join();
+    BrokerRing::Destroy(Broker);
+    BrokerContext = nullptr;
+}
 
-    if (WasSpectateGame.exchange(false)) {
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-        if (Handlers.spectateGame) {
-            Handlers.spectateGame(SpectateGameSecret);
-        }
+// Writes what flags (DISCORD_SHUTDOWN_*) ask for to every open connection of a context that's
+// being destroyed, then reads until each has answered the last presence written or deadlineUs
+// passes. Must be called with no connection update going on. Returns whether they all answered.
+static bool FlushConnections(DiscordContext& context, uint32_t flags, int64_t deadlineUs)
+{
+    auto& snapshot = context.ioSnapshot;
+    {
+        std::lock_guard<std::mutex> lock(context.connectionsMutex);
+        snapshot.assign(context.connections.begin(), context.connections.end());
     }
 
-    // Right now this batches up any requests and sends them all in a burst; I could imagine a world
-    // where the implementer would rather sequentially accept/reject each one before the next invite
-    // is sent. I left it this way because I could also imagine wanting to process these all and
-    // maybe show them in one common dialog and/or start fetching the avatars in parallel, and if
-    // not it should be trivial for the implementer to make a queue themselves.
-    while (JoinAskQueue.HavePendingSends()) {
-        auto req = JoinAskQueue.GetNextSendMessage();
+    // not paced, these are the last writes there will be
+    bool flushed = true;
+    size_t open = 0;
+    for (auto& cs : snapshot) {
+        if (!cs->rpc->IsOpen()) {
+            continue;
+        }
+        auto& sending = cs->sendingPresence;
+        cs->presenceAcks.awaitedNonce.store(0);
+        if (flags & DISCORD_SHUTDOWN_FLUSH) {
+#ifndef DISCORD_PRESENCE_ONLY
+            while (cs->rpc->IsOpen() && cs->joinReplies.HavePendingSends()) {
+                auto qmessage = cs->joinReplies.GetNextSendMessage();
+                if (cs->rpc->Write(qmessage->buffer, qmessage->length)) {
+                    cs->joinReplyStats.RecordSend(qmessage->queuedAtUs);
+                }
+                cs->joinReplies.CommitSend();
+            }
+#endif
+            // a presence about to be cleared doesn't need to go out first
+            if (!(flags & DISCORD_SHUTDOWN_CLEAR_PRESENCE) && cs->updatePresence.exchange(false) &&
+                cs->queuedPresence.length) {
+                {
+                    std::lock_guard<std::mutex> guard(cs->presenceMutex);
+                    sending.Copy(cs->queuedPresence);
+                }
+                if (cs->rpc->Write(sending.buffer.data(), sending.length)) {
+                    cs->presenceStats.RecordSend(sending.queuedAtUs);
+                    cs->presenceAcks.RecordWrite(sending.nonce);
+                }
+            }
+            if (!(flags & DISCORD_SHUTDOWN_CLEAR_PRESENCE) && cs->rpc->IsOpen()) {
+                int64_t nextPresenceUs = 0;
+                SendProducerPresence(context, *cs, nextPresenceUs, true);
+            }
+        }
+        if (flags & DISCORD_SHUTDOWN_CLEAR_PRESENCE) {
+            sending.Serialize(context.options.maxMessageSize,
+                              [](char* buffer, size_t maxLen, int nonce) {
+                                  return JsonWriteRichPresenceObj(
+                                    buffer, maxLen, nonce, Pid, nullptr);
+                              });
+            if (cs->rpc->Write(sending.buffer.data(), sending.length)) {
+                cs->presenceAcks.RecordWrite(sending.nonce);
+            }
+            // and whatever is shown under other pids
+            for (auto sent = cs->producersSent.begin(); sent != cs->producersSent.end();) {
+                if (!sent->second.shown || !cs->rpc->IsOpen()) {
+                    ++sent;
+                    continue;
+                }
+                int pid = sent->first;
+                sending.Serialize(context.options.maxMessageSize,
+                                  [&](char* buffer, size_t maxLen, int nonce) {
+                                      return JsonWriteActivityCommand(
+                                        buffer, maxLen, nonce, pid, nullptr, 0);
+                                  });
+                if (cs->rpc->Write(sending.buffer.data(), sending.length)) {
+                    cs->presenceAcks.RecordWrite(sending.nonce);
+                    sent = cs->producersSent.erase(sent);
+                }
+                else {
+                    ++sent;
+                }
+            }
+        }
+        // a failed write closes the connection
+        if (cs->rpc->IsOpen()) {
+            ++open;
+        }
+        else {
+            flushed = false;
+        }
+    }
+
+    // Responses come in order, so the one to the last write means the client has seen them all.
+    // Nothing opens meanwhile, and one that closes stops waiting for its response.
+    bool answered;
+    size_t stillOpen;
+    for (;;) {
+        answered = true;
+        stillOpen = 0;
+        for (auto& cs : snapshot) {
+            while (auto message = cs->rpc->Read()) {
+                if (auto nonce = GetStrMember(message, "nonce")) {
+                    cs->presenceAcks.RecordResponse(atoi(nonce));
+                }
+            }
+            if (cs->rpc->IsOpen()) {
+                ++stillOpen;
+                answered = answered && !cs->presenceAcks.awaitedNonce.load();
+            }
+        }
+        int64_t leftUs = deadlineUs - NowUs();
+        if (answered || leftUs <= 0) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min<int64_t>(leftUs, 1000)));
+    }
+    snapshot.clear();
+    return flushed && answered && stillOpen == open;
+}
+
+extern "C" DISCORD_EXPORT void Discord_DestroyContext(DiscordContext* context)
+{
+    Discord_DestroyContextEx(context, 0, 0);
+}
+
+extern "C" DISCORD_EXPORT int Discord_DestroyContextEx(DiscordContext* context,
+                                                      int timeoutMs,
+                                                      uint32_t flags)
+{
+    if (!context) {
+        return 0;
+    }
+    auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeoutMs, 0));
+    // with a timeout nothing below waits past it, without one the IO thread and registration
+    // are waited for as long as they take
+    bool bounded = timeoutMs > 0;
+    auto stopBy = bounded ? deadline : std::chrono::steady_clock::time_point::max();
+
+    std::lock_guard<std::mutex> lifetime(ContextLifetimeMutex);
+    std::shared_ptr<DiscordContext> owned;
+    bool wasLast;
+    {
+        std::lock_guard<std::mutex> lock(ContextsMutex);
+        auto it = std::find_if(Contexts.begin(),
+                               Contexts.end(),
+                               [&](const std::shared_ptr<DiscordContext>& c) {
+                                   return c.get() == context;
+                               });
+        if (it == Contexts.end()) {
+            return 0;
+        }
+        owned = std::move(*it);
+        Contexts.erase(it);
+        UpdateSharedSchedule();
+        wasLast = Contexts.empty();
+        if (wasLast) {
+            // nothing of the library's is left allocated once the last context is gone
+            HookVector<std::shared_ptr<DiscordContext>>().swap(Contexts);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(owned->handlerMutex);
+        owned->handlers = {};
+    }
+    if (BrokerContext == owned.get()) {
+        StopBroker();
+    }
+    bool flushed = true;
+    if (wasLast) {
+        if (IoThread->Stop(stopBy)) {
+            delete IoThread;
+        }
+        else {
+            flushed = false;
+        }
+        IoThread = nullptr;
+    }
+    if (flags) {
+        // with other contexts left the IO thread keeps going, but at most finishes its current
+        // tick with this one
+        std::unique_lock<std::timed_mutex> updating(UpdateMutex, std::defer_lock);
+        if (!bounded) {
+            // a deadline of right now would skip the writes whenever a tick is under way
+            updating.lock();
+        }
+        flushed = flushed && (updating.owns_lock() || updating.try_lock_until(deadline)) &&
+          FlushConnections(*owned,
+                           flags,
+                           std::chrono::duration_cast<std::chrono::microseconds>(
+                             deadline.time_since_epoch())
+                             .count());
+    }
+    if (wasLast) {
+        StopRegistration(bounded, deadline);
+    }
+    // let anyone blocked in WaitForEvents see that it's gone, they hold on to it until they do
+    {
+        std::lock_guard<std::mutex> lock(owned->eventsReadyMutex);
+        owned->destroyed = true;
+    }
+    owned->eventsReadyCondition.notify_all();
+    Poller::Wake();
+    {
+        // the IO thread may still be on its last tick with this context, in which case the
+        // connections go away when that's done
+        std::lock_guard<std::mutex> lock(owned->connectionsMutex);
+        owned->connections.clear();
+    }
+    // Without an IO thread a waiter may be in the middle of a tick, and with one it may be a tick
+    // that wasn't waited for. Past the deadline the poll fd and caches stay as they are, for the
+    // next context to pick up.
+    std::unique_lock<std::timed_mutex> updating(UpdateMutex, std::defer_lock);
+    if (wasLast && bounded) {
+        updating.try_lock_until(deadline);
+    }
+    else if (wasLast) {
+        updating.lock();
+    }
+    if (updating.owns_lock()) {
+#ifdef DISCORD_DISABLE_IO_THREAD
+        while (PollWaiters.load() > 0) {
+            std::this_thread::yield();
+        }
+#endif
+        Poller::Close();
+        LastPathScan = std::chrono::steady_clock::time_point{};
+        PathList().swap(CachedPaths);
+        PathList().swap(PreviousPaths);
+        HookVector<std::shared_ptr<DiscordContext>>().swap(UpdatingContexts);
+        BaseConnection::ForgetScannedPaths();
+    }
+    return flushed ? 1 : 0;
+}
+
+extern "C" DISCORD_EXPORT void Discord_Initialize(const char* applicationId,
+                                                  DiscordEventHandlers* handlers,
+                                                  int autoRegister,
+                                                  const char* optionalSteamId)
+{
+    Discord_InitializeEx(applicationId, handlers, autoRegister, optionalSteamId, nullptr);
+}
+
+extern "C" DISCORD_EXPORT int Discord_InitializeEx(const char* applicationId,
+                                                   DiscordEventHandlers* handlers,
+                                                   int autoRegister,
+                                                   const char* optionalSteamId,
+                                                   const DiscordInitOptions* options)
+{
+    if (DefaultContext != nullptr) {
+        return 0;
+    }
+    DefaultContext =
+      Discord_CreateContext(applicationId, handlers, autoRegister, optionalSteamId, options);
+    return DefaultContext ? 1 : 0;
+}
+
+extern "C" DISCORD_EXPORT int Discord_ContextSwitchApplication(DiscordContext* context,
+                                                              const char* applicationId,
+                                                              const DiscordRichPresence* presence)
+{
+    if (!context || !applicationId || !applicationId[0] || !CheckPresence(*context, presence)) {
+        return 0;
+    }
+    {
+        // the next tick connects to every known client under the new id, see
+        // RetireReplacedConnections for what happens to the old connections
+        std::lock_guard<std::mutex> lock(context->connectionsMutex);
+        StringCopy(context->appId, applicationId);
+        for (auto& cs : context->connections) {
+            context->retiringConnections.push_back(std::move(cs));
+        }
+        context->connections.clear();
+        context->retireDeadline = std::chrono::steady_clock::now() + SwitchApplicationTimeout;
+    }
+    // a submission for the old application would replace this one
+    context->submissions.PassOver();
+    SetActivePresence(*context, nullptr);
+    SetContextPresence(*context, [&](char* buffer, size_t maxLen, int nonce) {
+        return JsonWriteRichPresenceObj(buffer, maxLen, nonce, Pid, presence);
+    });
+    return 1;
+}
+
+extern "C" DISCORD_EXPORT int Discord_SwitchApplication(const char* applicationId,
+                                                       const DiscordRichPresence* presence)
+{
+    return Discord_ContextSwitchApplication(DefaultContext, applicationId, presence);
+}
+
+extern "C" DISCORD_EXPORT bool Discord_ContextConnected(DiscordContext* context)
+{
+    if (!context) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(context->connectionsMutex);
+    for (auto& cs : context->connections) {
+        if (cs->rpc->IsOpen()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+extern "C" DISCORD_EXPORT bool Discord_Connected(void)
+{
+    return Discord_ContextConnected(DefaultContext);
+}
+
+extern "C" DISCORD_EXPORT void Discord_Shutdown(void)
+{
+    Discord_ShutdownEx(0, 0);
+}
+
+extern "C" DISCORD_EXPORT int Discord_ShutdownEx(int timeoutMs, uint32_t flags)
+{
+    auto context = DefaultContext;
+    DefaultContext = nullptr;
+    return Discord_DestroyContextEx(context, timeoutMs, flags);
+}
+
+extern "C" DISCORD_EXPORT int Discord_GetPollFd(void)
+{
+    return Poller::Fd();
+}
+
+extern "C" DISCORD_EXPORT int Discord_GetNextTimeoutMs(void)
+{
+#ifndef DISCORD_DISABLE_IO_THREAD
+    // the IO thread keeps its own schedule, the poll fd is all there is to wait on
+    return -1;
+#else
+    std::lock_guard<std::mutex> contextsLock(ContextsMutex);
+    if (Contexts.empty()) {
+        return -1;
+    }
+    if (MoreToRead.load()) {
+        return 0;
+    }
+    auto untilScan = LastPathScan + std::chrono::milliseconds(PathScanIntervalMs.load()) -
+      std::chrono::steady_clock::now();
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(untilScan);
+    auto systemNow = std::chrono::system_clock::now();
+    for (auto& context : Contexts) {
+        std::lock_guard<std::mutex> lock(context->connectionsMutex);
+        if (!context->retiringConnections.empty()) {
+            timeout = std::min(timeout,
+                               std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 context->retireDeadline - std::chrono::steady_clock::now()));
+        }
+        for (auto& cs : context->connections) {
+            if (cs->rpc->IsOpen()) {
+#ifndef DISCORD_PRESENCE_ONLY
+                if (cs->joinReplies.HavePendingSends() ||
+                    cs->subscriptions != context->wantedSubscriptions.load()) {
+                    return 0;
+                }
+#endif
+                if (cs->updatePresence.load()) {
+                    // presence waits for a token, and maybe for the previous one's response
+                    int64_t readyUs = cs->presenceTokens.nextTokenUs();
+                    if (context->options.presenceAckTimeoutMs &&
+                        cs->presenceAcks.awaitedNonce.load()) {
+                        readyUs = std::max(readyUs,
+                                           cs->presenceAcks.writtenAtUs.load() +
+                                             (int64_t)context->options.presenceAckTimeoutMs * 1000);
+                    }
+                    timeout = std::min(timeout,
+                                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::microseconds(readyUs - NowUs())));
+                }
+            }
+            else if (cs->rpc->state == RpcConnection::State::Disconnected) {
+                timeout =
+                  std::min(timeout,
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(cs->nextConnect -
+                                                                                systemNow));
+            }
+        }
+    }
+    // other pids' presence waiting on their tokens
+    if (int64_t nextPresenceUs = NextPresenceUs.load()) {
+        timeout = std::min(timeout,
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::microseconds(nextPresenceUs - NowUs())));
+    }
+    if (timeout.count() <= 0) {
+        return 0;
+    }
+    // round up, waking up early would only have the host spin until the deadline passed
+    return (int)((timeout.count() + 999999) / 1000000);
+#endif
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextUpdatePresence(DiscordContext* context,
+                                                             const DiscordRichPresence* presence)
+{
+    if (!context || !CheckPresence(*context, presence)) {
+        return;
+    }
+    // a submission the IO thread hasn't got to yet would undo this
+    context->submissions.PassOver();
+    SetActivePresence(*context, nullptr);
+    SetContextPresence(*context, [&](char* buffer, size_t maxLen, int nonce) {
+        return JsonWriteRichPresenceObj(buffer, maxLen, nonce, Pid, presence);
+    });
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdatePresence(const DiscordRichPresence* presence)
+{
+    Discord_ContextUpdatePresence(DefaultContext, presence);
+}
+
+extern "C" DISCORD_EXPORT int Discord_ContextSubmitPresence(DiscordContext* context,
+                                                           const DiscordRichPresence* presence)
+{
+    if (!context || !context->submissions.Submit(presence)) {
+        return 0;
+    }
+    SignalIOActivity();
+    return 1;
+}
+
+extern "C" DISCORD_EXPORT int Discord_SubmitPresence(const DiscordRichPresence* presence)
+{
+    return Discord_ContextSubmitPresence(DefaultContext, presence);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextClearPresence(DiscordContext* context)
+{
+    Discord_ContextUpdatePresence(context, nullptr);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ClearPresence(void)
+{
+    Discord_ContextClearPresence(DefaultContext);
+}
+
+extern "C" DISCORD_EXPORT int Discord_ValidatePresence(const DiscordRichPresence* presence,
+                                                       const char** field)
+{
+    return presence ? ValidatePresence(presence, ~0u, field) : DISCORD_PRESENCE_VALID;
+}
+
+extern "C" DISCORD_EXPORT DiscordPresenceHandle* Discord_CompilePresence(
+  const DiscordRichPresence* presence)
+{
+    if (!presence || ValidatePresence(presence, ~0u, nullptr) != DISCORD_PRESENCE_VALID) {
+        return nullptr;
+    }
+    auto handle = new (std::nothrow) DiscordPresenceHandle();
+    if (handle) {
+        PresenceTemplateCompile(handle->presence, presence);
+    }
+    return handle;
+}
+
+static void SendPresenceHandle(DiscordContext& context, DiscordPresenceHandle* handle)
+{
+    SetContextPresence(context, [&](char* buffer, size_t maxLen, int nonce) {
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        return JsonWritePresenceTemplate(buffer, maxLen, nonce, Pid, handle->presence);
+    });
+}
+
+static HookVector<std::shared_ptr<DiscordContext>> SnapshotContexts()
+{
+    std::lock_guard<std::mutex> lock(ContextsMutex);
+    return Contexts;
+}
+
+// The context's reference, or none once it's being destroyed.
+static std::shared_ptr<DiscordContext> FindContext(DiscordContext* context)
+{
+    std::lock_guard<std::mutex> lock(ContextsMutex);
+    for (auto& c : Contexts) {
+        if (c.get() == context) {
+            return c;
+        }
+    }
+    return nullptr;
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdatePresenceFields(DiscordPresenceHandle* handle,
+                                                            uint32_t mask,
+                                                            const DiscordRichPresence* fields)
+{
+    if (!handle || !fields) {
+        return;
+    }
+    // kept until this is done with it, whether or not it's freed meanwhile
+    RetainPresence(handle);
+    auto contexts = SnapshotContexts();
+    if (ValidatePresence(fields, mask, nullptr) != DISCORD_PRESENCE_VALID) {
+        // each context sending the handle hears about it
+        for (auto& context : contexts) {
+            if (context->activePresence.load() == handle) {
+                CheckPresence(*context, fields, mask);
+            }
+        }
+    }
+    else {
         {
-            std::lock_guard<std::mutex> guard(HandlerMutex);
-            if (Handlers.joinRequest) {
-                DiscordUser du{req->userId, req->username, req->discriminator, req->avatar};
-                Handlers.joinRequest(&du);
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            PresenceTemplatePatch(handle->presence, mask, fields);
+        }
+        for (auto& context : contexts) {
+            if (context->activePresence.load() == handle) {
+                SendPresenceHandle(*context, handle);
             }
         }
-        JoinAskQueue.CommitSend();
     }
+    ReleasePresence(handle);
+}
 
-    // If a connection is not open, fire its disconnect cb last.
-    for (size_t i = 0; i < snapshot.size(); ++i) {
-        if (!isConnected[i] && wasDisconnected[i]) {
-            std::lock_guard<std::mutex> guard(HandlerMutex);
-            if (Handlers.disconnected) {
-                DiscordUser du{snapshot[i]->connectedUser.userId,
-                               snapshot[i]->connectedUser.username,
-                               snapshot[i]->connectedUser.discriminator,
-                               snapshot[i]->connectedUser.avatar};
-                Handlers.disconnected(snapshot[i]->rpc->Path(),
-                                      snapshot[i]->connectedUser.userId[0] ? &du : nullptr,
-                                      snapshot[i]->lastDisconnectErrorCode,
-                                      snapshot[i]->lastDisconnectErrorMessage);
+extern "C" DISCORD_EXPORT void Discord_ContextUpdatePresenceHandle(DiscordContext* context,
+                                                                   DiscordPresenceHandle* handle)
+{
+    if (!context || !handle) {
+        return;
+    }
+    RetainPresence(handle);
+    // like Discord_ContextUpdatePresence, what was submitted before this is dropped
+    context->submissions.PassOver();
+    SetActivePresence(*context, handle);
+    SendPresenceHandle(*context, handle);
+    ReleasePresence(handle);
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdatePresenceHandle(DiscordPresenceHandle* handle)
+{
+    Discord_ContextUpdatePresenceHandle(DefaultContext, handle);
+}
+
+extern "C" DISCORD_EXPORT void Discord_FreePresence(DiscordPresenceHandle* handle)
+{
+    if (!handle) {
+        return;
+    }
+    // whatever was sent stays, it just can't be patched anymore
+    for (auto& context : SnapshotContexts()) {
+        DiscordPresenceHandle* expected = handle;
+        if (context->activePresence.compare_exchange_strong(expected, nullptr)) {
+            ReleasePresence(handle);
+        }
+    }
+    // a patch or send on another thread that got to the handle first deletes it when it's done
+    ReleasePresence(handle);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextUpdatePresenceForUser(
+  DiscordContext* context,
+  const char* userId,
+  const DiscordRichPresence* presence)
+{
+    if (!context || !userId || !CheckPresence(*context, presence)) {
+        return;
+    }
+    bool anyMatched = false;
+    std::lock_guard<std::mutex> lock(context->connectionsMutex);
+    for (auto& cs : context->connections) {
+        if (strcmp(cs->connectedUser.userId, userId) == 0) {
+            QueuePresence(*cs, [&](char* buffer, size_t maxLen, int nonce) {
+                return JsonWriteRichPresenceObj(buffer, maxLen, nonce, Pid, presence);
+            });
+            anyMatched = true;
+        }
+    }
+    if (anyMatched) {
+        SignalIOActivity();
+    }
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdatePresenceForUser(const char* userId,
+                                                             const DiscordRichPresence* presence)
+{
+    Discord_ContextUpdatePresenceForUser(DefaultContext, userId, presence);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextClearPresenceForUser(DiscordContext* context,
+                                                                   const char* userId)
+{
+    Discord_ContextUpdatePresenceForUser(context, userId, nullptr);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ClearPresenceForUser(const char* userId)
+{
+    Discord_ContextClearPresenceForUser(DefaultContext, userId);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextUpdatePresenceForPid(
+  DiscordContext* context,
+  int pid,
+  const DiscordRichPresence* presence)
+{
+    if (!context || pid <= 0 || pid == Pid || !CheckPresence(*context, presence)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> presenceLock(context->presenceMutex);
+        bool staged = StagePresence(*context, "", [&](char* buffer, size_t maxLen, int) {
+            return JsonWriteActivity(buffer, maxLen, presence);
+        });
+        if (!staged) {
+            return;
+        }
+        // it goes out the same way a producer's would, just without the broker in between
+        std::lock_guard<std::mutex> lock(context->producersMutex);
+        auto& producer = context->producers[pid];
+        producer.activity.assign(context->stagedPresence.buffer.data(),
+                                 context->stagedPresence.length);
+        producer.generation = ++context->producersGeneration;
+        producer.queuedAtUs = NowUs();
+        producer.fromBroker = false;
+    }
+    SignalIOActivity();
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdatePresenceForPid(int pid,
+                                                            const DiscordRichPresence* presence)
+{
+    Discord_ContextUpdatePresenceForPid(DefaultContext, pid, presence);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextClearPresenceForPid(DiscordContext* context, int pid)
+{
+    Discord_ContextUpdatePresenceForPid(context, pid, nullptr);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ClearPresenceForPid(int pid)
+{
+    Discord_ContextClearPresenceForPid(DefaultContext, pid);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextRespond(DiscordContext* context,
+                                                      const char* userId,
+                                                      /* DISCORD_REPLY_ */ int reply)
+{
+#ifdef DISCORD_PRESENCE_ONLY
+    // no join requests come in, so there is never one to respond to
+    (void)context;
+    (void)userId;
+    (void)reply;
+#else
+    if (!context || !userId) {
+        return;
+    }
+    // The reply only goes to the connection the request came in on. If that one closed in the
+    // meantime, so did the request, and there is nothing to send.
+    bool queued = false;
+    std::lock_guard<std::mutex> lock(context->connectionsMutex);
+    for (auto& cs : context->connections) {
+        if (cs->rpc->IsOpen() && cs->joinRequests.Remove(userId)) {
+            queued = QueueJoinReply(*cs, userId, reply) || queued;
+        }
+    }
+    if (queued) {
+        SignalIOActivity();
+    }
+#endif
+}
+
+extern "C" DISCORD_EXPORT void Discord_Respond(const char* userId, /* DISCORD_REPLY_ */ int reply)
+{
+    Discord_ContextRespond(DefaultContext, userId, reply);
+}
+
+extern "C" DISCORD_EXPORT int Discord_ContextGetConnectionStats(DiscordContext* context,
+                                                                const char* ipcPath,
+                                                                DiscordConnectionStats* stats)
+{
+    if (!context || !ipcPath || !stats || stats->version == 0 ||
+        stats->version > DISCORD_CONNECTION_STATS_VERSION) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(context->connectionsMutex);
+    for (auto& cs : context->connections) {
+        if (cs->path != ipcPath) {
+            continue;
+        }
+        cs->presenceStats.CopyTo(stats->presence);
+        // version 1 callers have a shorter struct, without the acks
+        if (stats->version >= 2) {
+            cs->presenceAcks.CopyTo(stats->presenceAcks);
+        }
+        stats->presence.pending = cs->updatePresence.load() ? 1 : 0;
+#ifdef DISCORD_PRESENCE_ONLY
+        stats->control = {};
+        stats->joinReply = {};
+#else
+        cs->controlStats.CopyTo(stats->control);
+        cs->joinReplyStats.CopyTo(stats->joinReply);
+
+        uint32_t missing = cs->subscriptions.load() ^ context->wantedSubscriptions.load();
+        stats->control.pending = 0;
+        for (const auto& event : SubscribableEvents) {
+            stats->control.pending += (missing & event.bit) ? 1 : 0;
+        }
+        stats->joinReply.pending = cs->joinReplies.PendingSends();
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+extern "C" DISCORD_EXPORT int Discord_GetConnectionStats(const char* ipcPath,
+                                                         DiscordConnectionStats* stats)
+{
+    return Discord_ContextGetConnectionStats(DefaultContext, ipcPath, stats);
+}
+
+extern "C" DISCORD_EXPORT void Discord_GetIoStats(DiscordIoStats* stats)
+{
+    if (stats) {
+        IoTickStats.CopyTo(*stats);
+    }
+}
+
+extern "C" DISCORD_EXPORT int Discord_DumpFlightRecorder(const char* path)
+{
+    return FlightRecorder::Dump(path) ? 1 : 0;
+}
+
+// Moves what producers push onto the ring over to the context, until StopBroker.
+static void RunBroker(std::shared_ptr<DiscordContext> context, BrokerRing* ring)
+{
+    char activity[BrokerActivitySize];
+    auto nextProducerCheck = std::chrono::steady_clock::now();
+    while (!BrokerStopping.load()) {
+        uint32_t wakeCount = ring->WakeCount();
+        bool changed = false;
+        int pid;
+        size_t length;
+        while (ring->Pop(pid, activity, length)) {
+            if (length && !IsJsonObject(activity, length)) {
+                // it goes into SET_ACTIVITY as is, where anything else would break the message
+                char message[256];
+                snprintf(message,
+                         sizeof(message),
+                         "Producer %d published an activity that isn't a JSON object",
+                         pid);
+                ReportError(*context, "", DISCORD_ERROR_PRESENCE_INVALID, message);
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(context->producersMutex);
+            auto& producer = context->producers[pid];
+            producer.activity.assign(activity, length);
+            producer.generation = ++context->producersGeneration;
+            producer.queuedAtUs = NowUs();
+            producer.fromBroker = true;
+            changed = true;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextProducerCheck) {
+            // Discord keeps an activity until the connection that set it closes, which for a
+            // producer that's gone is ours
+            std::lock_guard<std::mutex> lock(context->producersMutex);
+            for (auto& producer : context->producers) {
+                if (producer.second.fromBroker && !producer.second.activity.empty() &&
+                    !BrokerRing::ProcessAlive(producer.first)) {
+                    producer.second.activity.clear();
+                    producer.second.generation = ++context->producersGeneration;
+                    producer.second.queuedAtUs = NowUs();
+                    changed = true;
+                }
             }
+            nextProducerCheck = now + std::chrono::milliseconds(ProducerCheckIntervalMs);
         }
+
+        if (changed) {
+            SignalIOActivity();
+        }
+        ring->Wait(wakeCount, ProducerCheckIntervalMs);
     }
 }
 
-extern "C" DISCORD_EXPORT void Discord_UpdateHandlers(DiscordEventHandlers* newHandlers)
+extern "C" DISCORD_EXPORT int Discord_ContextStartBroker(DiscordContext* context,
+                                                         const char* name)
 {
-    if (newHandlers) {
-#define HANDLE_EVENT_REGISTRATION(handler_name, event)              \
-    if (!Handlers.handler_name && newHandlers->handler_name) {      \
-        RegisterForEvent(event);                                    \
-    }                                                               \
-    else if (Handlers.handler_name && !newHandlers->handler_name) { \
-        DeregisterForEvent(event);                                  \
+    if (!context) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lifetime(ContextLifetimeMutex);
+    std::shared_ptr<DiscordContext> owned;
+    for (auto& c : SnapshotContexts()) {
+        if (c.get() == context) {
+            owned = c;
+        }
+    }
+    if (!owned || Broker != nullptr) {
+        return 0;
     }
+    Broker = BrokerRing::Create(name ? name : DefaultBrokerName);
+    if (Broker == nullptr) {
+        return 0;
+    }
+    BrokerContext = context;
+    BrokerStopping.store(false);
+    BrokerThread = std::thread(RunBroker, std::move(owned), Broker);
+    return 1;
+}
 
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-        HANDLE_EVENT_REGISTRATION(joinGame, "ACTIVITY_JOIN")
-        HANDLE_EVENT_REGISTRATION(spectateGame, "ACTIVITY_SPECTATE")
-        HANDLE_EVENT_REGISTRATION(joinRequest, "ACTIVITY_JOIN_REQUEST")
+extern "C" DISCORD_EXPORT int Discord_StartBroker(const char* name)
+{
+    return Discord_ContextStartBroker(DefaultContext, name);
+}
 
-#undef HANDLE_EVENT_REGISTRATION
+extern "C" DISCORD_EXPORT void Discord_StopBroker(void)
+{
+    std::lock_guard<std::mutex> lifetime(ContextLifetimeMutex);
+    StopBroker();
+}
+
+extern "C" DISCORD_EXPORT int Discord_BrokerConnect(const char* name)
+{
+    std::lock_guard<std::mutex> lock(ProducerMutex);
+    if (ProducerRing != nullptr) {
+        return 1;
+    }
+    StringCopy(ProducerBrokerName, name ? name : DefaultBrokerName);
+    ProducerRing = BrokerRing::Attach(ProducerBrokerName);
+    return ProducerRing ? 1 : 0;
+}
+
+extern "C" DISCORD_EXPORT int Discord_BrokerUpdatePresence(const DiscordRichPresence* presence)
+{
+    if (presence && ValidatePresence(presence, ~0u, nullptr) != DISCORD_PRESENCE_VALID) {
+        return 0;
+    }
+    char activity[BrokerActivitySize];
+    size_t length = JsonWriteActivity(activity, sizeof(activity), presence);
+    if (length > sizeof(activity)) {
+        return 0;
+    }
 
-        Handlers = *newHandlers;
+    std::lock_guard<std::mutex> lock(ProducerMutex);
+    if (ProducerRing == nullptr) {
+        return 0;
+    }
+    if (ProducerRing->Push(GetProcessId(), activity, length)) {
+        return 1;
+    }
+    // the broker may have been restarted since, in which case there is a new ring
+    BrokerRing::Destroy(ProducerRing);
+    ProducerRing = BrokerRing::Attach(ProducerBrokerName);
+    return ProducerRing && ProducerRing->Push(GetProcessId(), activity, length) ? 1 : 0;
+}
+
+extern "C" DISCORD_EXPORT int Discord_BrokerClearPresence(void)
+{
+    return Discord_BrokerUpdatePresence(nullptr);
+}
+
+extern "C" DISCORD_EXPORT void Discord_BrokerDisconnect(void)
+{
+    std::lock_guard<std::mutex> lock(ProducerMutex);
+    if (ProducerRing != nullptr) {
+        ProducerRing->Push(GetProcessId(), nullptr, 0);
+        BrokerRing::Destroy(ProducerRing);
+    }
+}
+
+static void CopyEventUser(DiscordEventUser& dest, const User& src)
+{
+    StringCopy(dest.userId, src.userId);
+    StringCopy(dest.username, src.username);
+    StringCopy(dest.discriminator, src.discriminator);
+    StringCopy(dest.avatar, src.avatar);
+}
+
+static DiscordEvent& AddPendingEvent(DiscordContext& context,
+                                     DiscordEventType type,
+                                     const char* ipcPath)
+{
+    context.pendingEvents.emplace_back();
+    auto& event = context.pendingEvents.back();
+    event.type = type;
+    StringCopy(event.ipcPath, ipcPath);
+    return event;
+}
+
+static void AddDisconnectedEvent(DiscordContext& context, const PerConnectionState& cs)
+{
+    auto& event = AddPendingEvent(context, DiscordEventType_Disconnected, cs.rpc->Path());
+    event.data.disconnected.hasUser = cs.connectedUser.userId[0] ? 1 : 0;
+    CopyEventUser(event.data.disconnected.user, cs.connectedUser);
+    event.data.disconnected.errorCode = cs.lastDisconnectErrorCode;
+    StringCopy(event.data.disconnected.message, cs.lastDisconnectErrorMessage);
+}
+
+// Turns everything the IO thread signalled since the last call into context.pendingEvents.
+// Must be called with context.eventMutex held.
+static void CollectEvents(DiscordContext& context)
+{
+    // Note on some weirdness: internally we might connect, get other signals, disconnect any number
+    // of times inbetween calls here. Externally, we want the sequence to seem sane, so any other
+    // signals are book-ended by calls to ready and disconnect.
+
+    // Clear first, anything signalled from here on is picked up by the next call.
+    {
+        std::lock_guard<std::mutex> lock(context.eventsReadyMutex);
+        context.eventsReady = false;
+    }
+    Poller::ClearWake();
+
+    // Snapshot the connection list so we don't hold connectionsMutex for longer than needed. With
+    // none there may still be errors and acks of the context's own to report.
+    auto& snapshot = context.collected;
+    {
+        std::lock_guard<std::mutex> lock(context.connectionsMutex);
+        snapshot.resize(context.connections.size());
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            snapshot[i].cs = context.connections[i];
+        }
+    }
+
+    for (auto& collected : snapshot) {
+        collected.wasDisconnected = collected.cs->wasJustDisconnected.exchange(false);
+        collected.isConnected = collected.cs->rpc->IsOpen();
+    }
+
+    // If a connection is currently open, its disconnect comes first (before other signals).
+    for (auto& collected : snapshot) {
+        if (collected.isConnected && collected.wasDisconnected) {
+            AddDisconnectedEvent(context, *collected.cs);
+        }
+    }
+
+    // Ready for each newly connected user.
+    for (auto& collected : snapshot) {
+        if (collected.cs->wasJustConnected.exchange(false)) {
+            auto& event =
+              AddPendingEvent(context, DiscordEventType_Ready, collected.cs->rpc->Path());
+            CopyEventUser(event.data.ready.user, collected.cs->connectedUser);
+        }
+    }
+
+    if (context.gotAnyErrorMessage.exchange(false)) {
+        std::lock_guard<std::mutex> lock(context.errorMutex);
+        auto& event = AddPendingEvent(context, DiscordEventType_Errored, context.lastErrorIpcPath);
+        event.data.errored.errorCode = context.lastErrorCode;
+        StringCopy(event.data.errored.message, context.lastErrorMessage);
+    }
+
+#ifndef DISCORD_PRESENCE_ONLY
+    if (context.wasJoinGame.exchange(false)) {
+        auto& event = AddPendingEvent(context, DiscordEventType_JoinGame, context.joinGameIpcPath);
+        StringCopy(event.data.joinGame.secret, context.joinGameSecret);
+    }
+
+    if (context.wasSpectateGame.exchange(false)) {
+        auto& event =
+          AddPendingEvent(context, DiscordEventType_SpectateGame, context.spectateGameIpcPath);
+        StringCopy(event.data.spectateGame.secret, context.spectateGameSecret);
+    }
+
+    // Right now this batches up any requests and sends them all in a burst; I could imagine a world
+    // where the implementer would rather sequentially accept/reject each one before the next invite
+    // is sent. I left it this way because I could also imagine wanting to process these all and
+    // maybe show them in one common dialog and/or start fetching the avatars in parallel, and if
+    // not it should be trivial for the implementer to make a queue themselves.
+    while (context.joinAskQueue.HavePendingSends()) {
+        auto req = context.joinAskQueue.GetNextSendMessage();
+        auto& event = AddPendingEvent(context, DiscordEventType_JoinRequest, req->ipcPath);
+        CopyEventUser(event.data.joinRequest.user, req->user);
+        context.joinAskQueue.CommitSend();
+    }
+#endif
+
+    while (context.ackQueue.HavePendingSends()) {
+        auto ack = context.ackQueue.GetNextSendMessage();
+        auto& event = AddPendingEvent(context, DiscordEventType_CommandAck, ack->ipcPath);
+        event.data.commandAck.nonce = ack->nonce;
+        StringCopy(event.data.commandAck.command, ack->command);
+        context.ackQueue.CommitSend();
+    }
+
+    // If a connection is not open, its disconnect comes last.
+    for (auto& collected : snapshot) {
+        if (!collected.isConnected && collected.wasDisconnected) {
+            AddDisconnectedEvent(context, *collected.cs);
+        }
+        collected.cs.reset();
+    }
+}
+
+static int PollEvent(DiscordContext& context, DiscordEvent* event)
+{
+    std::lock_guard<std::mutex> lock(context.eventMutex);
+    if (context.nextPendingEvent == context.pendingEvents.size()) {
+        context.pendingEvents.clear();
+        context.nextPendingEvent = 0;
+        CollectEvents(context);
+        if (context.pendingEvents.empty()) {
+            return 0;
+        }
+    }
+    *event = context.pendingEvents[context.nextPendingEvent++];
+    return 1;
+}
+
+extern "C" DISCORD_EXPORT int Discord_ContextPollEvent(DiscordContext* context,
+                                                       DiscordEvent* event)
+{
+    if (!context || !event) {
+        return 0;
+    }
+    context->pollsEvents.store(true, std::memory_order_relaxed);
+    return PollEvent(*context, event);
+}
+
+extern "C" DISCORD_EXPORT int Discord_PollEvent(DiscordEvent* event)
+{
+    return Discord_ContextPollEvent(DefaultContext, event);
+}
+
+// 1 if there are events, 0 if the context was destroyed, -1 if neither.
+static int HaveEventsReady(DiscordContext& context)
+{
+    {
+        std::lock_guard<std::mutex> lock(context.eventsReadyMutex);
+        if (context.destroyed) {
+            return 0;
+        }
+        if (context.eventsReady) {
+            return 1;
+        }
+    }
+    std::lock_guard<std::mutex> lock(context.eventMutex);
+    return context.nextPendingEvent < context.pendingEvents.size() ? 1 : -1;
+}
+
+extern "C" DISCORD_EXPORT int Discord_ContextWaitForEvents(DiscordContext* context, int timeoutMs)
+{
+    // Held for the whole wait, so destroying the context meanwhile only wakes us up.
+    auto owned = FindContext(context);
+    if (!owned) {
+        return 0;
+    }
+    int ready;
+#ifdef DISCORD_DISABLE_IO_THREAD
+    // Nobody else is driving the connections, so do that while waiting.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;) {
+        Discord_UpdateConnection();
+        if ((ready = HaveEventsReady(*owned)) >= 0) {
+            return ready;
+        }
+        int waitMs = Discord_GetNextTimeoutMs();
+        if (timeoutMs >= 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                               deadline - std::chrono::steady_clock::now())
+                               .count();
+            if (remaining <= 0) {
+                return 0;
+            }
+            waitMs = waitMs < 0 ? (int)remaining : std::min(waitMs, (int)remaining);
+        }
+        // destroying the context wakes us up only once it sees us here, otherwise we see it
+        ++PollWaiters;
+        if (HaveEventsReady(*owned) < 0) {
+            Poller::Wait(waitMs);
+        }
+        --PollWaiters;
+    }
+#else
+    if ((ready = HaveEventsReady(*owned)) >= 0) {
+        return ready;
+    }
+    std::unique_lock<std::mutex> lock(owned->eventsReadyMutex);
+    auto woken = [&owned] { return owned->eventsReady || owned->destroyed; };
+    if (timeoutMs < 0) {
+        owned->eventsReadyCondition.wait(lock, woken);
     }
     else {
-        std::lock_guard<std::mutex> guard(HandlerMutex);
-        Handlers = {};
+        owned->eventsReadyCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), woken);
+    }
+    return owned->eventsReady && !owned->destroyed ? 1 : 0;
+#endif
+}
+
+extern "C" DISCORD_EXPORT int Discord_WaitForEvents(int timeoutMs)
+{
+    return Discord_ContextWaitForEvents(DefaultContext, timeoutMs);
+}
+
+static void DispatchEvent(DiscordContext& context, const DiscordEvent& event)
+{
+    std::lock_guard<std::mutex> guard(context.handlerMutex);
+    const auto& handlers = context.handlers;
+    switch (event.type) {
+    case DiscordEventType_Ready:
+        if (handlers.ready) {
+            auto& user = event.data.ready.user;
+            DiscordUser du{user.userId, user.username, user.discriminator, user.avatar};
+            handlers.ready(event.ipcPath, &du);
+        }
+        break;
+    case DiscordEventType_Disconnected:
+        if (handlers.disconnected) {
+            auto& user = event.data.disconnected.user;
+            DiscordUser du{user.userId, user.username, user.discriminator, user.avatar};
+            handlers.disconnected(event.ipcPath,
+                                  event.data.disconnected.hasUser ? &du : nullptr,
+                                  event.data.disconnected.errorCode,
+                                  event.data.disconnected.message);
+        }
+        break;
+    case DiscordEventType_Errored:
+        if (handlers.errored) {
+            handlers.errored(
+              event.ipcPath, event.data.errored.errorCode, event.data.errored.message);
+        }
+        break;
+    case DiscordEventType_JoinGame:
+        if (handlers.joinGame) {
+            handlers.joinGame(event.data.joinGame.secret);
+        }
+        break;
+    case DiscordEventType_SpectateGame:
+        if (handlers.spectateGame) {
+            handlers.spectateGame(event.data.spectateGame.secret);
+        }
+        break;
+    case DiscordEventType_JoinRequest:
+        if (handlers.joinRequest) {
+            auto& user = event.data.joinRequest.user;
+            DiscordUser du{user.userId, user.username, user.discriminator, user.avatar};
+            handlers.joinRequest(&du);
+        }
+        break;
+    case DiscordEventType_CommandAck:
+    case DiscordEventType_None:
+    default:
+        break;
+    }
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextRunCallbacks(DiscordContext* context)
+{
+    if (!context) {
+        return;
+    }
+    DiscordEvent event;
+    while (PollEvent(*context, &event)) {
+        DispatchEvent(*context, event);
     }
-    return;
+}
+
+extern "C" DISCORD_EXPORT void Discord_RunCallbacks(void)
+{
+    Discord_ContextRunCallbacks(DefaultContext);
+}
+
+extern "C" DISCORD_EXPORT void Discord_ContextUpdateHandlers(DiscordContext* context,
+                                                             DiscordEventHandlers* newHandlers)
+{
+    if (!context) {
+        return;
+    }
+    DiscordEventHandlers handlers = newHandlers ? *newHandlers : DiscordEventHandlers{};
+    {
+        std::lock_guard<std::mutex> guard(context->handlerMutex);
+        context->handlers = handlers;
+    }
+#ifndef DISCORD_PRESENCE_ONLY
+    // the IO thread sends each open connection only the subscriptions that changed
+    uint32_t wanted = GetWantedSubscriptions(handlers);
+    if (context->wantedSubscriptions.exchange(wanted) != wanted) {
+        context->wantedSubscriptionsChangedAtUs.store(NowUs());
+        SignalIOActivity();
+    }
+#endif
+}
+
+extern "C" DISCORD_EXPORT void Discord_UpdateHandlers(DiscordEventHandlers* newHandlers)
+{
+    Discord_ContextUpdateHandlers(DefaultContext, newHandlers);
 }
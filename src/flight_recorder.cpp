@@ -0,0 +1,262 @@
+#include "flight_recorder.h"
+#include "connection.h"
+#include "serialization.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+static_assert((FlightRecorderSize & (FlightRecorderSize - 1)) == 0,
+              "FlightRecorderSize has to be a power of two");
+
+struct FlightRecord {
+    int64_t timeUs;
+    uint32_t connection;
+    FlightEvent event;
+    // frames: opcode; state changes: from and to
+    uint8_t opcode;
+    uint8_t from;
+    uint8_t to;
+    // frames: the payload's full length
+    uint32_t length;
+    // frames: nonce, 0 if there is none; state changes: error code; backoff: delay in ms
+    int32_t value;
+    // how much of text is in use, which for a payload may hold anything, NULs included
+    uint8_t textLength;
+    char text[103];
+};
+
+// A record is being written while its sequence is odd. Once written it's position * 2 + 2, so a
+// dump can tell it apart from whatever was in the slot one lap before or after. Only one writer
+// has the slot at a time, see Append.
+struct FlightSlot {
+    std::atomic<uint64_t> sequence{0};
+    FlightRecord record;
+};
+
+static FlightSlot Slots[FlightRecorderSize];
+static std::atomic<uint64_t> NextPosition{0};
+// records left out because their slot was taken, see Append
+static std::atomic<uint64_t> Dropped{0};
+
+static int64_t NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Copies as much of text as fits, not splitting a UTF-8 sequence so one that was valid stays so.
+static void CopyText(FlightRecord& record, const char* text, size_t length)
+{
+    if (length > sizeof(record.text)) {
+        length = sizeof(record.text);
+        while (length > 0 && ((unsigned char)text[length] & 0xC0) == 0x80) {
+            --length;
+        }
+    }
+    memcpy(record.text, text, length);
+    record.textLength = (uint8_t)length;
+}
+
+template <typename Fill>
+static void Append(FlightEvent event, uint32_t connection, Fill&& fill)
+{
+    uint64_t position = NextPosition.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = Slots[position % FlightRecorderSize];
+    // A writer that stalled for a whole lap would otherwise share the slot with the next one and
+    // could publish a mix of both. So the slot is only taken while nobody writes it and it holds
+    // something older; otherwise this record is dropped, it's either torn or overwritten anyway.
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    do {
+        if ((sequence & 1) || sequence > position * 2) {
+            Dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!slot.sequence.compare_exchange_strong(
+      sequence, position * 2 + 1, std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_release);
+    auto& record = slot.record;
+    record.timeUs = NowUs();
+    record.connection = connection;
+    record.event = event;
+    record.opcode = record.from = record.to = 0;
+    record.length = 0;
+    record.value = 0;
+    record.textLength = 0;
+    fill(record);
+    slot.sequence.store(position * 2 + 2, std::memory_order_release);
+}
+
+// Every command we write has one, as do responses to them; events don't.
+static int32_t FindNonce(const char* payload, size_t length)
+{
+    static const char Key[] = "\"nonce\"";
+    const size_t keyLength = sizeof(Key) - 1;
+    for (size_t i = 0; i + keyLength < length; ++i) {
+        if (payload[i] != '"' || memcmp(payload + i, Key, keyLength) != 0) {
+            continue;
+        }
+        // past the colon and the opening quote, with whatever space there is around them
+        for (i += keyLength; i < length && payload[i] && strchr(" \t\r\n:\"", payload[i]); ++i) {
+        }
+        uint32_t nonce = 0;
+        for (; i < length && payload[i] >= '0' && payload[i] <= '9'; ++i) {
+            nonce = nonce * 10 + (uint32_t)(payload[i] - '0');
+        }
+        return (int32_t)nonce;
+    }
+    return 0;
+}
+
+/*static*/ void FlightRecorder::RecordFrame(FlightEvent event,
+                                            uint32_t connection,
+                                            uint32_t opcode,
+                                            const void* payload,
+                                            size_t length)
+{
+    auto text = static_cast<const char*>(payload);
+    Append(event, connection, [&](FlightRecord& record) {
+        record.opcode = (uint8_t)opcode;
+        record.length = (uint32_t)length;
+        record.value = FindNonce(text, length);
+        CopyText(record, text, length);
+    });
+}
+
+/*static*/ void FlightRecorder::RecordState(uint32_t connection,
+                                            uint32_t from,
+                                            uint32_t to,
+                                            int errorCode,
+                                            const char* text)
+{
+    Append(FlightEvent::StateChanged, connection, [&](FlightRecord& record) {
+        record.from = (uint8_t)from;
+        record.to = (uint8_t)to;
+        record.value = errorCode;
+        if (text) {
+            CopyText(record, text, strlen(text));
+        }
+    });
+}
+
+/*static*/ void FlightRecorder::RecordBackoff(uint32_t connection, int64_t delayMs)
+{
+    Append(FlightEvent::Backoff, connection, [&](FlightRecord& record) {
+        record.value = (int32_t)delayMs;
+    });
+}
+
+/*static*/ void FlightRecorder::RecordPath(FlightEvent event, const char* path)
+{
+    Append(event, 0, [&](FlightRecord& record) { CopyText(record, path, strlen(path)); });
+}
+
+// Writes text as the member name, escaped, if it's valid UTF-8, and otherwise in hex as nameHex,
+// as a payload can be anything at all.
+static void WriteText(FILE* file, const char* name, const char* text, size_t length)
+{
+    size_t chars;
+    if (!ScanUtf8(text, length, chars)) {
+        fprintf(file, ",\"%sHex\":\"", name);
+        for (size_t i = 0; i < length; ++i) {
+            fprintf(file, "%02x", (unsigned char)text[i]);
+        }
+        fputc('"', file);
+        return;
+    }
+    fprintf(file, ",\"%s\":\"", name);
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if (c < 0x20 || c == 0x7F) {
+            fprintf(file, "\\u%04x", c);
+        }
+        else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/*static*/ bool FlightRecorder::Dump(const char* path)
+{
+    static const char* const Events[] = {
+      "write", "read", "state", "backoff", "pathAdded", "pathRemoved"};
+    // in the order of RpcConnection::State
+    static const char* const States[] = {
+      "disconnected", "sentHandshake", "awaitingResponse", "connected"};
+    auto stateName = [](uint8_t state) { return state < 4 ? States[state] : "?"; };
+
+    FILE* file = path ? fopen(path, "w") : nullptr;
+    if (!file) {
+        return false;
+    }
+    uint64_t end = NextPosition.load(std::memory_order_acquire);
+    uint64_t begin = end > FlightRecorderSize ? end - FlightRecorderSize : 0;
+    fprintf(file,
+            "{\"pid\":%d,\"nowUs\":%lld,\"recorded\":%llu,\"dropped\":%llu,\"records\":[",
+            GetProcessId(),
+            (long long)NowUs(),
+            (unsigned long long)end,
+            (unsigned long long)Dropped.load(std::memory_order_relaxed));
+    bool first = true;
+    for (uint64_t position = begin; position < end; ++position) {
+        auto& slot = Slots[position % FlightRecorderSize];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != position * 2 + 2) {
+            continue;
+        }
+        FlightRecord record;
+        memcpy(&record, &slot.record, sizeof(record));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+        size_t textLength = std::min<size_t>(record.textLength, sizeof(record.text));
+
+        fprintf(file,
+                "%s\n{\"timeUs\":%lld,\"event\":\"%s\"",
+                first ? "" : ",",
+                (long long)record.timeUs,
+                Events[(int)record.event]);
+        first = false;
+        if (record.connection) {
+            fprintf(file, ",\"connection\":%u", record.connection);
+        }
+        switch (record.event) {
+        case FlightEvent::FrameWritten:
+        case FlightEvent::FrameRead:
+            fprintf(file, ",\"opcode\":%u,\"length\":%u", record.opcode, record.length);
+            if (record.value) {
+                fprintf(file, ",\"nonce\":%d", record.value);
+            }
+            WriteText(file, "payload", record.text, textLength);
+            break;
+        case FlightEvent::StateChanged:
+            fprintf(file,
+                    ",\"from\":\"%s\",\"to\":\"%s\",\"code\":%d",
+                    stateName(record.from),
+                    stateName(record.to),
+                    record.value);
+            WriteText(file, "text", record.text, textLength);
+            break;
+        case FlightEvent::Backoff:
+            fprintf(file, ",\"delayMs\":%d", record.value);
+            break;
+        case FlightEvent::PathAdded:
+        case FlightEvent::PathRemoved:
+            WriteText(file, "path", record.text, textLength);
+            break;
+        }
+        fputc('}', file);
+    }
+    fputs("\n]}\n", file);
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// An always-on record of the last FlightRecorderSize things that happened to the connections:
+// frames written and read with the start of their payload, RpcConnection state changes, reconnect
+// backoff and IPC paths coming and going. It's there for working out what happened after the
+// fact, see Discord_DumpFlightRecorder. Recording is wait-free, an increment and a copy of a
+// record's worth, and takes no locks and allocates nothing, so it never has to be turned off.
+// Records are overwritten oldest first; the ring is shared by all contexts. A record whose slot
+// is still being written by someone a whole lap behind is dropped, and counted in the dump.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// power of two, so positions can wrap
+constexpr size_t FlightRecorderSize{512};
+
+enum class FlightEvent : uint8_t {
+    FrameWritten,
+    FrameRead,
+    StateChanged,
+    Backoff,
+    PathAdded,
+    PathRemoved,
+};
+
+struct FlightRecorder {
+    // connection is an RpcConnection::id. The nonce is picked out of the payload, which is only
+    // kept as far as it fits.
+    static void RecordFrame(FlightEvent event,
+                            uint32_t connection,
+                            uint32_t opcode,
+                            const void* payload,
+                            size_t length);
+    // from and to are RpcConnection::State; text is the path when opening, the error when
+    // closing.
+    static void RecordState(uint32_t connection,
+                            uint32_t from,
+                            uint32_t to,
+                            int errorCode,
+                            const char* text);
+    static void RecordBackoff(uint32_t connection, int64_t delayMs);
+    static void RecordPath(FlightEvent event, const char* path);
+
+    // Writes what's in the ring to path as JSON, oldest first, while recording goes on. Records
+    // being written meanwhile are left out. Text that isn't valid UTF-8, which a payload needn't
+    // be, is written in hex instead. False if the file couldn't be written.
+    static bool Dump(const char* path);
+};
@@ -1,35 +1,55 @@
 #pragma once
 
+#include "allocator.h"
+
 #include <atomic>
 
 // A simple queue. No locks, but only works with a single thread as producer and a single thread as
 // a consumer. Mutex up as needed.
 
-template <typename ElementType, size_t QueueSize>
+template <typename ElementType>
 class MsgQueue {
-    ElementType queue_[QueueSize];
+    HookVector<ElementType> queue_;
+    unsigned queueSize_{0};
     std::atomic_uint nextAdd_{0};
     std::atomic_uint nextSend_{0};
     std::atomic_uint pendingSends_{0};
 
 public:
     MsgQueue() {}
+    explicit MsgQueue(size_t queueSize) { Reset(queueSize); }
+
+    // Drops whatever is queued and makes room for queueSize elements, rounded up to a power of two
+    // so the indices stay in step when the counters wrap. Only while nobody else uses the queue.
+    void Reset(size_t queueSize)
+    {
+        unsigned size = 1;
+        while (size < queueSize) {
+            size *= 2;
+        }
+        queue_.assign(size, ElementType{});
+        queueSize_ = size;
+        nextAdd_.store(0);
+        nextSend_.store(0);
+        pendingSends_.store(0);
+    }
 
     ElementType* GetNextAddMessage()
     {
         // if we are falling behind, bail
-        if (pendingSends_.load() >= QueueSize) {
+        if (pendingSends_.load() >= queueSize_) {
             return nullptr;
         }
-        auto index = (nextAdd_++) % QueueSize;
+        auto index = (nextAdd_++) % queueSize_;
         return &queue_[index];
     }
     void CommitAdd() { ++pendingSends_; }
 
     bool HavePendingSends() const { return pendingSends_.load() != 0; }
+    unsigned PendingSends() const { return pendingSends_.load(); }
     ElementType* GetNextSendMessage()
     {
-        auto index = (nextSend_++) % QueueSize;
+        auto index = (nextSend_++) % queueSize_;
         return &queue_[index];
     }
     void CommitSend() { --pendingSends_; }
@@ -0,0 +1,21 @@
+#pragma once
+
+// A single file descriptor a host event loop can wait on instead of polling the library: it
+// becomes readable when there's IPC traffic or queued work for Discord_UpdateConnection (only
+// without the IO thread, which otherwise takes care of that) or when events are ready for
+// Discord_RunCallbacks. Only implemented on Linux, elsewhere Fd() is -1 and the rest does nothing.
+
+struct Poller {
+    static bool Open();
+    static void Close();
+    static int Fd();
+    // Add/remove a socket to/from the set of descriptors that wake the host.
+    static void Watch(int fd);
+    static void Unwatch(int fd);
+    // Make Fd() readable until the next ClearWake().
+    static void Wake();
+    static void ClearWake();
+    // Block until Fd() is readable or the timeout (-1 for none) passes. Where there is no real
+    // fd this just sleeps for a short while, so callers have to loop.
+    static void Wait(int timeoutMs);
+};
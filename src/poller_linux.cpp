@@ -0,0 +1,92 @@
+#include "poller.h"
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static int EpollFd{-1};
+static int WakeFd{-1};
+
+/*static*/ bool Poller::Open()
+{
+    if (EpollFd != -1) {
+        return true;
+    }
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (EpollFd == -1 || WakeFd == -1) {
+        Close();
+        return false;
+    }
+    Watch(WakeFd);
+    return true;
+}
+
+/*static*/ void Poller::Close()
+{
+    if (WakeFd != -1) {
+        close(WakeFd);
+        WakeFd = -1;
+    }
+    if (EpollFd != -1) {
+        close(EpollFd);
+        EpollFd = -1;
+    }
+}
+
+/*static*/ int Poller::Fd()
+{
+    return EpollFd;
+}
+
+/*static*/ void Poller::Watch(int fd)
+{
+    if (EpollFd == -1 || fd == -1) {
+        return;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*static*/ void Poller::Unwatch(int fd)
+{
+    if (EpollFd == -1 || fd == -1) {
+        return;
+    }
+    epoll_event event{};
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, &event);
+}
+
+/*static*/ void Poller::Wake()
+{
+    if (WakeFd == -1) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(WakeFd, &one, sizeof(one)) < 0) {
+        // counter is saturated, which still leaves it readable
+    }
+}
+
+/*static*/ void Poller::Wait(int timeoutMs)
+{
+    if (EpollFd == -1) {
+        return;
+    }
+    epoll_event event;
+    epoll_wait(EpollFd, &event, 1, timeoutMs);
+}
+
+/*static*/ void Poller::ClearWake()
+{
+    if (WakeFd == -1) {
+        return;
+    }
+    uint64_t value;
+    if (read(WakeFd, &value, sizeof(value)) < 0) {
+        // nothing to clear
+    }
+}
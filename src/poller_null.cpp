@@ -0,0 +1,31 @@
+#include "poller.h"
+
+#include <chrono>
+#include <thread>
+
+/*static*/ bool Poller::Open()
+{
+    return false;
+}
+
+/*static*/ void Poller::Close() {}
+
+/*static*/ int Poller::Fd()
+{
+    return -1;
+}
+
+/*static*/ void Poller::Watch(int) {}
+
+/*static*/ void Poller::Unwatch(int) {}
+
+/*static*/ void Poller::Wake() {}
+
+/*static*/ void Poller::ClearWake() {}
+
+/*static*/ void Poller::Wait(int timeoutMs)
+{
+    constexpr int MaxSleepMs = 10;
+    int sleepMs = timeoutMs < 0 || timeoutMs > MaxSleepMs ? MaxSleepMs : timeoutMs;
+    std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+}
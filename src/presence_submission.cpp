@@ -0,0 +1,139 @@
+#include "presence_submission.h"
+
+#include <algorithm>
+#include <string.h>
+
+static_assert(SubmittedTextSize < SubmittedPresence::NoString, "offsets have to fit in 16 bits");
+
+// Calls visit(field, maxBytes) for each string field, in the order of SubmittedPresence::offsets.
+template <typename Visit>
+static void ForEachString(DiscordRichPresence& presence, Visit&& visit)
+{
+    constexpr size_t Text = 4 * DISCORD_PRESENCE_MAX_TEXT_LENGTH;
+    constexpr size_t Label = 4 * DISCORD_PRESENCE_MAX_BUTTON_LABEL_LENGTH;
+    constexpr size_t Key = DISCORD_PRESENCE_MAX_KEY_LENGTH + 4;
+    constexpr size_t Url = DISCORD_PRESENCE_MAX_URL_LENGTH + 4;
+    constexpr size_t Secret = DISCORD_PRESENCE_MAX_SECRET_LENGTH + 4;
+    visit(presence.state, Text);
+    visit(presence.stateUrl, Url);
+    visit(presence.details, Text);
+    visit(presence.detailsUrl, Url);
+    visit(presence.largeImageKey, Key);
+    visit(presence.largeImageText, Text);
+    visit(presence.largeImageUrl, Url);
+    visit(presence.smallImageKey, Key);
+    visit(presence.smallImageText, Text);
+    visit(presence.smallImageUrl, Url);
+    visit(presence.partyId, Secret);
+    visit(presence.matchSecret, Secret);
+    visit(presence.joinSecret, Secret);
+    visit(presence.spectateSecret, Secret);
+    for (auto& button : presence.buttons) {
+        visit(button.label, Label);
+        visit(button.url, Url);
+    }
+}
+
+// Raises value to at least to.
+static void RaiseTo(std::atomic<uint64_t>& value, uint64_t to)
+{
+    uint64_t current = value.load(std::memory_order_relaxed);
+    while (current < to && !value.compare_exchange_weak(current, to)) {
+    }
+}
+
+bool PresenceSubmissions::Submit(const DiscordRichPresence* presence)
+{
+    // the slot the latest submission isn't in, so the IO thread can go on taking that one, unless
+    // another submitter is in it
+    unsigned index = (unsigned)(latest.load(std::memory_order_acquire) & 1) ^ 1;
+    uint32_t sequence = slots[index].sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) ||
+        !slots[index].sequence.compare_exchange_strong(
+          sequence, sequence + 1, std::memory_order_acquire)) {
+        index ^= 1;
+        sequence = slots[index].sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) ||
+            !slots[index].sequence.compare_exchange_strong(
+              sequence, sequence + 1, std::memory_order_acquire)) {
+            return false;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // numbered only now that the slot is ours, so whatever overwrites a published submission is
+    // newer than it
+    uint64_t number = nextNumber.fetch_add(1, std::memory_order_relaxed);
+    auto& submitted = slots[index].submitted;
+    submitted.number = number;
+    submitted.clear = presence == nullptr;
+    size_t length = 0;
+    if (presence) {
+        submitted.presence = *presence;
+        uint16_t* offset = submitted.offsets;
+        ForEachString(submitted.presence, [&](const char*& field, size_t maxBytes) {
+            if (!field) {
+                *offset++ = SubmittedPresence::NoString;
+                return;
+            }
+            size_t fieldLength = strnlen(field, maxBytes + 1);
+            if (fieldLength > maxBytes) {
+                // not splitting a UTF-8 sequence, which would turn it into invalid UTF-8
+                fieldLength = maxBytes;
+                while (fieldLength > 0 && ((unsigned char)field[fieldLength] & 0xC0) == 0x80) {
+                    --fieldLength;
+                }
+            }
+            *offset++ = (uint16_t)length;
+            memcpy(submitted.text + length, field, fieldLength);
+            length += fieldLength;
+            submitted.text[length++] = 0;
+            field = nullptr;
+        });
+    }
+    submitted.textLength = (uint32_t)length;
+    slots[index].sequence.store(sequence + 2, std::memory_order_release);
+    RaiseTo(latest, number * 2 + index);
+    return true;
+}
+
+bool PresenceSubmissions::Take(SubmittedPresence& submitted)
+{
+    uint64_t published = latest.load(std::memory_order_acquire);
+    if ((published >> 1) <= taken.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    // Being written means something newer is on its way, whoever writes it wakes us up again.
+    auto& slot = slots[published & 1];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+        return false;
+    }
+    memcpy(&submitted, &slot.submitted, offsetof(SubmittedPresence, text));
+    memcpy(submitted.text,
+           slot.submitted.text,
+           std::min<size_t>(submitted.textLength, sizeof(submitted.text)));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+        return false;
+    }
+    // It can be newer than published when it was overwritten after that, which is fine.
+    uint64_t current = taken.load(std::memory_order_relaxed);
+    if (submitted.number <= current ||
+        !taken.compare_exchange_strong(current, submitted.number)) {
+        return false;
+    }
+    if (!submitted.clear) {
+        const uint16_t* offset = submitted.offsets;
+        ForEachString(submitted.presence, [&](const char*& field, size_t) {
+            field = *offset == SubmittedPresence::NoString ? nullptr : submitted.text + *offset;
+            ++offset;
+        });
+    }
+    return true;
+}
+
+void PresenceSubmissions::PassOver()
+{
+    RaiseTo(taken, latest.load(std::memory_order_acquire) >> 1);
+}
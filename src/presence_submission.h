@@ -0,0 +1,64 @@
+#pragma once
+
+// Presence handed over by Discord_SubmitPresence for the IO thread to serialize. Submitting takes
+// no locks and allocates nothing: the strings are copied into whichever of two buffers isn't
+// being written, each guarded by a sequence the way a seqlock is, and the latest one is published
+// with its number. The IO thread copies the latest buffer out again and starts over on the next
+// tick if a submitter got in between.
+
+#include "discord_rpc.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Text and labels past their maximum are cut off when they're written anyway, so four bytes a code
+// point of them is all that's kept. Keys, urls and secrets past theirs get turned down, so keeping
+// a code point more than that is enough to tell. Each has its terminator.
+constexpr size_t SubmittedTextSize = 4 * (4 * DISCORD_PRESENCE_MAX_TEXT_LENGTH + 1) +
+  DISCORD_PRESENCE_MAX_BUTTON_COUNT * (4 * DISCORD_PRESENCE_MAX_BUTTON_LABEL_LENGTH + 1) +
+  2 * (DISCORD_PRESENCE_MAX_KEY_LENGTH + 5) +
+  (4 + DISCORD_PRESENCE_MAX_BUTTON_COUNT) * (DISCORD_PRESENCE_MAX_URL_LENGTH + 5) +
+  4 * (DISCORD_PRESENCE_MAX_SECRET_LENGTH + 5);
+// the string fields of a DiscordRichPresence, buttons included
+constexpr size_t SubmittedStringCount = 14 + 2 * DISCORD_PRESENCE_MAX_BUTTON_COUNT;
+
+struct SubmittedPresence {
+    // Once taken, its strings point into text. Submitted with no presence, for clearing it.
+    DiscordRichPresence presence;
+    bool clear;
+    // goes up with every submission to the same PresenceSubmissions
+    uint64_t number;
+    uint32_t textLength;
+    // where each string starts in text, or NoString for a null one
+    uint16_t offsets[SubmittedStringCount];
+    char text[SubmittedTextSize];
+
+    static constexpr uint16_t NoString{0xFFFF};
+};
+
+class PresenceSubmissions {
+public:
+    // Copies presence, null for none, and publishes it. Bounded, with no waiting: false only if
+    // both buffers were being written by other submitters right then, which leaves one of theirs.
+    bool Submit(const DiscordRichPresence* presence);
+    // For the IO thread: copies what was submitted last to submitted and returns true, if it's
+    // newer than anything taken or passed over before and no submitter is writing it right now.
+    bool Take(SubmittedPresence& submitted);
+    // Whatever was submitted so far is passed over, for when a presence is set another way.
+    void PassOver();
+
+private:
+    struct Slot {
+        // odd while a submitter writes it
+        std::atomic<uint32_t> sequence{0};
+        SubmittedPresence submitted;
+    };
+
+    Slot slots[2];
+    std::atomic<uint64_t> nextNumber{1};
+    // the last number published times two, plus the slot it's in
+    std::atomic<uint64_t> latest{0};
+    // the last number taken or passed over
+    std::atomic<uint64_t> taken{0};
+};
@@ -1,12 +1,23 @@
 #include "rpc_connection.h"
+#include "flight_recorder.h"
 #include "serialization.h"
 
+#include <atomic>
+
 static const int RpcVersion = 1;
+static std::atomic_uint NextConnectionId{1};
 
-/*static*/ RpcConnection* RpcConnection::Create(const char* applicationId, const char* path)
+/*static*/ RpcConnection* RpcConnection::Create(const char* applicationId,
+                                                const char* path,
+                                                size_t maxFrameSize)
 {
     auto* c = new RpcConnection();
     c->connection = BaseConnection::Create(path);
+    c->maxFrameSize = maxFrameSize;
+    c->sendFrame.reset(static_cast<char*>(DiscordAlloc(maxFrameSize)));
+    c->readFrame.reset(static_cast<char*>(DiscordAlloc(maxFrameSize)));
+    c->readMessage.reset(new JsonDocument());
+    c->id = NextConnectionId++;
     StringCopy(c->appId, applicationId);
     return c;
 }
@@ -32,25 +43,32 @@ void RpcConnection::Open()
     }
 
     if (state == State::SentHandshake) {
-        JsonDocument message;
-        if (Read(message)) {
-            auto cmd = GetStrMember(&message, "cmd");
-            auto evt = GetStrMember(&message, "evt");
+        if (auto message = Read()) {
+            auto cmd = GetStrMember(message, "cmd");
+            auto evt = GetStrMember(message, "evt");
             if (cmd && evt && !strcmp(cmd, "DISPATCH") && !strcmp(evt, "READY")) {
-                state = State::Connected;
+                SetState(State::Connected);
                 if (onConnect) {
-                    onConnect(message);
+                    onConnect(callbackData, *message);
                 }
             }
         }
     }
     else {
-        sendFrame.opcode = Opcode::Handshake;
-        sendFrame.length = (uint32_t)JsonWriteHandshakeObj(
-          sendFrame.message, sizeof(sendFrame.message), RpcVersion, appId);
+        auto frame = reinterpret_cast<MessageFrameHeader*>(sendFrame.get());
+        frame->opcode = Opcode::Handshake;
+        size_t length = JsonWriteHandshakeObj(
+          sendFrame.get() + sizeof(MessageFrameHeader), MaxMessageSize(), RpcVersion, appId);
+        frame->length = (uint32_t)length;
 
-        if (connection->Write(&sendFrame, sizeof(MessageFrameHeader) + sendFrame.length)) {
-            state = State::SentHandshake;
+        if (length <= MaxMessageSize() &&
+            connection->Write(frame, sizeof(MessageFrameHeader) + frame->length)) {
+            FlightRecorder::RecordFrame(FlightEvent::FrameWritten,
+                                        id,
+                                        (uint32_t)frame->opcode,
+                                        sendFrame.get() + sizeof(MessageFrameHeader),
+                                        length);
+            SetState(State::SentHandshake);
         }
         else {
             Close();
@@ -61,68 +79,92 @@ void RpcConnection::Open()
 void RpcConnection::Close()
 {
     if (onDisconnect && (state == State::Connected || state == State::SentHandshake)) {
-        onDisconnect(lastErrorCode, lastErrorMessage);
+        onDisconnect(callbackData, lastErrorCode, lastErrorMessage);
     }
     connection->Close();
-    state = State::Disconnected;
+    SetState(State::Disconnected);
 }
 
 bool RpcConnection::Write(const void* data, size_t length)
 {
-    sendFrame.opcode = Opcode::Frame;
-    memcpy(sendFrame.message, data, length);
-    sendFrame.length = (uint32_t)length;
-    if (!connection->Write(&sendFrame, sizeof(MessageFrameHeader) + length)) {
+    if (length > MaxMessageSize()) {
+        return false;
+    }
+    auto frame = reinterpret_cast<MessageFrameHeader*>(sendFrame.get());
+    frame->opcode = Opcode::Frame;
+    memcpy(sendFrame.get() + sizeof(MessageFrameHeader), data, length);
+    frame->length = (uint32_t)length;
+    if (!connection->Write(frame, sizeof(MessageFrameHeader) + length)) {
         Close();
         return false;
     }
+    FlightRecorder::RecordFrame(
+      FlightEvent::FrameWritten, id, (uint32_t)frame->opcode, data, length);
     return true;
 }
 
-bool RpcConnection::Read(JsonDocument& message)
+JsonDocument* RpcConnection::Read()
 {
     if (state != State::Connected && state != State::SentHandshake) {
-        return false;
+        return nullptr;
     }
-    MessageFrame readFrame;
+    auto& message = *readMessage;
+    message.Reset();
+    auto frame = reinterpret_cast<MessageFrameHeader*>(readFrame.get());
+    char* frameMessage = readFrame.get() + sizeof(MessageFrameHeader);
     for (;;) {
-        bool didRead = connection->Read(&readFrame, sizeof(MessageFrameHeader));
+        bool didRead = connection->Read(frame, sizeof(MessageFrameHeader));
         if (!didRead) {
             if (!connection->isOpen) {
                 lastErrorCode = (int)ErrorCode::PipeClosed;
                 StringCopy(lastErrorMessage, "Pipe closed");
                 Close();
             }
-            return false;
+            return nullptr;
+        }
+
+        // room for the terminator too
+        if (frame->length >= MaxMessageSize()) {
+            lastErrorCode = (int)ErrorCode::ReadCorrupt;
+            StringCopy(lastErrorMessage, "Frame too large");
+            Close();
+            return nullptr;
         }
 
-        if (readFrame.length > 0) {
-            didRead = connection->Read(readFrame.message, readFrame.length);
+        frameMessage[0] = 0;
+        if (frame->length > 0) {
+            didRead = connection->Read(frameMessage, frame->length);
             if (!didRead) {
                 lastErrorCode = (int)ErrorCode::ReadCorrupt;
                 StringCopy(lastErrorMessage, "Partial data in frame");
                 Close();
-                return false;
+                return nullptr;
             }
-            readFrame.message[readFrame.length] = 0;
+            frameMessage[frame->length] = 0;
         }
+        // before parsing it in place takes it apart
+        FlightRecorder::RecordFrame(
+          FlightEvent::FrameRead, id, (uint32_t)frame->opcode, frameMessage, frame->length);
 
-        switch (readFrame.opcode) {
+        switch (frame->opcode) {
         case Opcode::Close: {
-            message.ParseInsitu(readFrame.message);
+            message.ParseInsitu(frameMessage);
             lastErrorCode = GetIntMember(&message, "code");
             StringCopy(lastErrorMessage, GetStrMember(&message, "message", ""));
             Close();
-            return false;
+            return nullptr;
         }
         case Opcode::Frame:
-            message.ParseInsitu(readFrame.message);
-            return true;
+            message.ParseInsitu(frameMessage);
+            return &message;
         case Opcode::Ping:
-            readFrame.opcode = Opcode::Pong;
-            if (!connection->Write(&readFrame, sizeof(MessageFrameHeader) + readFrame.length)) {
+            frame->opcode = Opcode::Pong;
+            if (!connection->Write(frame, sizeof(MessageFrameHeader) + frame->length)) {
                 Close();
+                break;
             }
+            FlightRecorder::RecordFrame(
+              FlightEvent::FrameWritten, id, (uint32_t)frame->opcode, frameMessage, frame->length);
             break;
         case Opcode::Pong:
             break;
@@ -132,12 +174,27 @@ bool RpcConnection::Read(JsonDocument& message)
             lastErrorCode = (int)ErrorCode::ReadCorrupt;
             StringCopy(lastErrorMessage, "Bad ipc frame");
             Close();
-            return false;
+            return nullptr;
         }
     }
 }
 
+bool RpcConnection::Readable()
+{
+    return (state == State::Connected || state == State::SentHandshake) && connection->Readable();
+}
+
 const char* RpcConnection::Path() const
 {
     return connection->Path();
 }
+
+void RpcConnection::SetState(State next)
+{
+    if (next == state) {
+        return;
+    }
+    const char* text = next == State::Disconnected ? lastErrorMessage : Path();
+    FlightRecorder::RecordState(id, (uint32_t)state, (uint32_t)next, lastErrorCode, text);
+    state = next;
+}
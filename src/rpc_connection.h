@@ -3,13 +3,13 @@
 #include "connection.h"
 #include "serialization.h"
 
-#include <functional>
+#include <memory>
 
 // I took this from the buffer size libuv uses for named pipes; I suspect ours would usually be much
 // smaller.
-constexpr size_t MaxRpcFrameSize = 64 * 1024;
+constexpr size_t DefaultRpcFrameSize = 64 * 1024;
 
-struct RpcConnection {
+struct RpcConnection : public HookAllocated {
     enum class ErrorCode : int {
         Success = 0,
         PipeClosed = 1,
@@ -29,10 +29,6 @@ struct RpcConnection {
         uint32_t length;
     };
 
-    struct MessageFrame : public MessageFrameHeader {
-        char message[MaxRpcFrameSize - sizeof(MessageFrameHeader)];
-    };
-
     enum class State : uint32_t {
         Disconnected,
         SentHandshake,
@@ -42,21 +38,40 @@ struct RpcConnection {
 
     BaseConnection* connection{nullptr};
     State state{State::Disconnected};
-    std::function<void(JsonDocument& message)> onConnect;
-    std::function<void(int errorCode, const char* message)> onDisconnect;
+    // tells this connection's records apart in the flight recorder
+    uint32_t id{0};
+    // both get callbackData, which has to stay around for as long as they are set
+    void (*onConnect)(void* callbackData, JsonDocument& message){nullptr};
+    void (*onDisconnect)(void* callbackData, int errorCode, const char* message){nullptr};
+    void* callbackData{nullptr};
     char appId[64]{};
     int lastErrorCode{0};
     char lastErrorMessage[256]{};
-    RpcConnection::MessageFrame sendFrame;
+    // maxFrameSize bytes each, a MessageFrameHeader followed by the message
+    size_t maxFrameSize{0};
+    HookArray<char> sendFrame;
+    HookArray<char> readFrame;
+    // what Read parses readFrame into
+    std::unique_ptr<JsonDocument> readMessage;
 
-    static RpcConnection* Create(const char* applicationId, const char* path);
+    static RpcConnection* Create(const char* applicationId,
+                                 const char* path,
+                                 size_t maxFrameSize = DefaultRpcFrameSize);
     static void Destroy(RpcConnection*&);
 
     inline bool IsOpen() const { return state == State::Connected; }
+    inline size_t MaxMessageSize() const { return maxFrameSize - sizeof(MessageFrameHeader); }
 
     void Open();
     void Close();
     bool Write(const void* data, size_t length);
-    bool Read(JsonDocument& message);
+    // The next message, or null if there is none. It's parsed in place and stays valid until the
+    // next Read.
+    JsonDocument* Read();
+    // Whether there's more for Read, without reading it.
+    bool Readable();
     const char* Path() const;
+
+private:
+    void SetState(State next);
 };
@@ -2,6 +2,10 @@
 #include "connection.h"
 #include "discord_rpc.h"
 
+#include <algorithm>
+#include <ctype.h>
+#include <initializer_list>
+
 template <typename T>
 void NumberToString(char* dest, T number)
 {
@@ -72,6 +76,262 @@ void WriteOptionalString(JsonWriter& w, T& k, const char* value)
     }
 }
 
+// How many bytes the first maxChars code points of str take, at most length.
+static size_t Utf8Prefix(const char* str, size_t length, size_t maxChars)
+{
+    // every code point takes a byte at least
+    if (length <= maxChars) {
+        return length;
+    }
+    size_t chars = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if ((str[i] & 0xC0) != 0x80 && chars++ == maxChars) {
+            return i;
+        }
+    }
+    return length;
+}
+
+// WriteOptionalString for text Discord takes up to maxChars code points of; the rest is cut off
+// rather than having the whole presence turned down.
+template <typename T>
+void WriteOptionalText(JsonWriter& w, T& k, const char* value, size_t maxChars)
+{
+    if (value && value[0]) {
+        w.Key(k, sizeof(T) - 1);
+        w.String(value, (rapidjson::SizeType)Utf8Prefix(value, strlen(value), maxChars));
+    }
+}
+
+bool ScanUtf8(const char* str, size_t length, size_t& chars)
+{
+    constexpr uint64_t HighBits = 0x8080808080808080ull;
+    auto s = reinterpret_cast<const unsigned char*>(str);
+    size_t i = 0;
+    chars = 0;
+    while (i < length) {
+        // most of it is ASCII, which goes 8 bytes at a time
+        uint64_t word;
+        if (length - i >= sizeof(word)) {
+            memcpy(&word, s + i, sizeof(word));
+            if (!(word & HighBits)) {
+                i += sizeof(word);
+                chars += sizeof(word);
+                continue;
+            }
+        }
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            ++i;
+            ++chars;
+            continue;
+        }
+        size_t n;
+        uint32_t codePoint;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2;
+            codePoint = c & 0x1F;
+        }
+        else if ((c & 0xF0) == 0xE0) {
+            n = 3;
+            codePoint = c & 0x0F;
+        }
+        else if ((c & 0xF8) == 0xF0) {
+            n = 4;
+            codePoint = c & 0x07;
+        }
+        else {
+            return false;
+        }
+        if (length - i < n) {
+            return false;
+        }
+        for (size_t k = 1; k < n; ++k) {
+            if ((s[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (s[i + k] & 0x3F);
+        }
+        static const uint32_t Shortest[] = {0, 0, 0x80, 0x800, 0x10000};
+        if (codePoint < Shortest[n] || codePoint > 0x10FFFF ||
+            (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+            return false;
+        }
+        i += n;
+        ++chars;
+    }
+    return true;
+}
+
+// JSON text from in up to end, checked without keeping anything. Each moves in past what it
+// checked and returns false if that isn't valid.
+static const int MaxCheckedDepth = 32;
+static bool CheckValue(const char*& in, const char* end, int depth);
+
+static void SkipSpace(const char*& in, const char* end)
+{
+    while (in < end && (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')) {
+        ++in;
+    }
+}
+
+static bool CheckString(const char*& in, const char* end)
+{
+    if (in == end || *in++ != '"') {
+        return false;
+    }
+    while (in < end) {
+        char c = *in++;
+        if (c == '"') {
+            return true;
+        }
+        if ((unsigned char)c < 0x20) {
+            return false;
+        }
+        if (c != '\\') {
+            continue;
+        }
+        if (in == end) {
+            return false;
+        }
+        c = *in++;
+        if (c == 'u') {
+            for (int i = 0; i < 4; ++i, ++in) {
+                if (in == end || !isxdigit((unsigned char)*in)) {
+                    return false;
+                }
+            }
+        }
+        else if (!c || !strchr("\"\\/bfnrt", c)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool CheckDigits(const char*& in, const char* end)
+{
+    const char* start = in;
+    while (in < end && *in >= '0' && *in <= '9') {
+        ++in;
+    }
+    return in != start;
+}
+
+static bool CheckNumber(const char*& in, const char* end)
+{
+    if (in < end && *in == '-') {
+        ++in;
+    }
+    if (in < end && *in == '0') {
+        ++in;
+    }
+    else if (!CheckDigits(in, end)) {
+        return false;
+    }
+    if (in < end && *in == '.' && !CheckDigits(++in, end)) {
+        return false;
+    }
+    if (in < end && (*in == 'e' || *in == 'E')) {
+        ++in;
+        if (in < end && (*in == '+' || *in == '-')) {
+            ++in;
+        }
+        return CheckDigits(in, end);
+    }
+    return true;
+}
+
+template <size_t Len>
+static bool CheckLiteral(const char*& in, const char* end, const char (&literal)[Len])
+{
+    if ((size_t)(end - in) < Len - 1 || memcmp(in, literal, Len - 1) != 0) {
+        return false;
+    }
+    in += Len - 1;
+    return true;
+}
+
+// An object or array, whichever opens at in, closing with close.
+static bool CheckContainer(const char*& in, const char* end, char close, int depth)
+{
+    if (depth > MaxCheckedDepth) {
+        return false;
+    }
+    ++in;
+    SkipSpace(in, end);
+    if (in < end && *in == close) {
+        ++in;
+        return true;
+    }
+    for (;;) {
+        if (close == '}') {
+            if (!CheckString(in, end)) {
+                return false;
+            }
+            SkipSpace(in, end);
+            if (in == end || *in++ != ':') {
+                return false;
+            }
+            SkipSpace(in, end);
+        }
+        if (!CheckValue(in, end, depth)) {
+            return false;
+        }
+        SkipSpace(in, end);
+        if (in == end) {
+            return false;
+        }
+        char c = *in++;
+        if (c == close) {
+            return true;
+        }
+        if (c != ',') {
+            return false;
+        }
+        SkipSpace(in, end);
+    }
+}
+
+static bool CheckValue(const char*& in, const char* end, int depth)
+{
+    if (in == end) {
+        return false;
+    }
+    switch (*in) {
+    case '{':
+        return CheckContainer(in, end, '}', depth + 1);
+    case '[':
+        return CheckContainer(in, end, ']', depth + 1);
+    case '"':
+        return CheckString(in, end);
+    case 't':
+        return CheckLiteral(in, end, "true");
+    case 'f':
+        return CheckLiteral(in, end, "false");
+    case 'n':
+        return CheckLiteral(in, end, "null");
+    default:
+        return CheckNumber(in, end);
+    }
+}
+
+bool IsJsonObject(const char* json, size_t length)
+{
+    size_t chars;
+    if (!ScanUtf8(json, length, chars)) {
+        return false;
+    }
+    const char* in = json;
+    const char* end = json + length;
+    SkipSpace(in, end);
+    if (in == end || *in != '{' || !CheckValue(in, end, 0)) {
+        return false;
+    }
+    SkipSpace(in, end);
+    return in == end;
+}
+
 static void JsonWriteNonce(JsonWriter& writer, int nonce)
 {
     WriteKey(writer, "nonce");
@@ -80,6 +340,195 @@ static void JsonWriteNonce(JsonWriter& writer, int nonce)
     writer.String(nonceBuffer);
 }
 
+static void WriteTimestamps(JsonWriter& writer, int64_t startTimestamp, int64_t endTimestamp)
+{
+    if (startTimestamp || endTimestamp) {
+        WriteObject timestamps(writer, "timestamps");
+
+        if (startTimestamp) {
+            WriteKey(writer, "start");
+            writer.Int64(startTimestamp);
+        }
+
+        if (endTimestamp) {
+            WriteKey(writer, "end");
+            writer.Int64(endTimestamp);
+        }
+    }
+}
+
+// Writes the members of the activity object, except for the DISCORD_PRESENCE_FIELD_* in skipFields.
+static void WriteActivityFields(JsonWriter& writer,
+                                const DiscordRichPresence* presence,
+                                uint32_t skipFields)
+{
+    WriteKey(writer, "type");
+    writer.Int(presence->type);
+
+    WriteKey(writer, "status_display_type");
+    writer.Int(presence->status_display_type);
+
+    if (!(skipFields & DISCORD_PRESENCE_FIELD_STATE)) {
+        WriteOptionalText(writer, "state", presence->state, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+    }
+    WriteOptionalString(writer, "state_url", presence->stateUrl);
+
+    if (!(skipFields & DISCORD_PRESENCE_FIELD_DETAILS)) {
+        WriteOptionalText(writer, "details", presence->details, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+    }
+    WriteOptionalString(writer, "details_url", presence->detailsUrl);
+
+    if (!(skipFields &
+          (DISCORD_PRESENCE_FIELD_START_TIMESTAMP | DISCORD_PRESENCE_FIELD_END_TIMESTAMP))) {
+        WriteTimestamps(writer, presence->startTimestamp, presence->endTimestamp);
+    }
+
+    if ((presence->largeImageKey && presence->largeImageKey[0]) ||
+        (presence->largeImageText && presence->largeImageText[0]) ||
+        (presence->smallImageKey && presence->smallImageKey[0]) ||
+        (presence->smallImageText && presence->smallImageText[0])) {
+        WriteObject assets(writer, "assets");
+        WriteOptionalString(writer, "large_image", presence->largeImageKey);
+        WriteOptionalText(
+          writer, "large_text", presence->largeImageText, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+        WriteOptionalString(writer, "large_url", presence->largeImageUrl);
+        WriteOptionalString(writer, "small_image", presence->smallImageKey);
+        WriteOptionalText(
+          writer, "small_text", presence->smallImageText, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+        WriteOptionalString(writer, "small_url", presence->smallImageUrl);
+    }
+
+    if ((presence->partyId && presence->partyId[0]) || presence->partySize ||
+        presence->partyMax || presence->partyPrivacy) {
+        WriteObject party(writer, "party");
+        WriteOptionalString(writer, "id", presence->partyId);
+        if (presence->partySize && presence->partyMax) {
+            WriteArray size(writer, "size");
+            writer.Int(presence->partySize);
+            writer.Int(presence->partyMax);
+        }
+
+        if (presence->partyPrivacy) {
+            WriteKey(writer, "privacy");
+            writer.Int(presence->partyPrivacy);
+        }
+    }
+
+    if (presence->buttons[0].label) {
+        WriteArray buttons(writer, "buttons");
+        for (int i = 0; i < DISCORD_PRESENCE_MAX_BUTTON_COUNT; i++) {
+            const auto button = presence->buttons[i];
+            if (!button.label || !button.label[0]) {
+                continue;
+            }
+            WriteObject object(writer);
+            WriteOptionalText(
+              writer, "label", button.label, DISCORD_PRESENCE_MAX_BUTTON_LABEL_LENGTH);
+            WriteKey(writer, "url");
+            writer.String(button.url);
+        }
+    }
+    else if ((presence->matchSecret && presence->matchSecret[0]) ||
+             (presence->joinSecret && presence->joinSecret[0]) ||
+             (presence->spectateSecret && presence->spectateSecret[0])) {
+        WriteObject secrets(writer, "secrets");
+        WriteOptionalString(writer, "match", presence->matchSecret);
+        WriteOptionalString(writer, "join", presence->joinSecret);
+        WriteOptionalString(writer, "spectate", presence->spectateSecret);
+    }
+
+    writer.Key("instance");
+    writer.Bool(presence->instance != 0);
+}
+
+enum class FieldKind { Text, Label, Key, Url, Secret };
+
+static int ValidateField(const char* value, FieldKind kind)
+{
+    if (!value || !value[0]) {
+        return DISCORD_PRESENCE_VALID;
+    }
+    size_t length = strlen(value);
+    size_t chars;
+    if (!ScanUtf8(value, length, chars)) {
+        return DISCORD_PRESENCE_INVALID_UTF8;
+    }
+    switch (kind) {
+    case FieldKind::Text:
+        return chars < DISCORD_PRESENCE_MIN_TEXT_LENGTH ? DISCORD_PRESENCE_TOO_SHORT
+                                                        : DISCORD_PRESENCE_VALID;
+    case FieldKind::Label:
+        return chars < DISCORD_PRESENCE_MIN_BUTTON_LABEL_LENGTH ? DISCORD_PRESENCE_TOO_SHORT
+                                                                : DISCORD_PRESENCE_VALID;
+    case FieldKind::Key:
+        return length > DISCORD_PRESENCE_MAX_KEY_LENGTH ? DISCORD_PRESENCE_TOO_LONG
+                                                        : DISCORD_PRESENCE_VALID;
+    case FieldKind::Url:
+        return length > DISCORD_PRESENCE_MAX_URL_LENGTH ? DISCORD_PRESENCE_TOO_LONG
+                                                        : DISCORD_PRESENCE_VALID;
+    case FieldKind::Secret:
+        return length > DISCORD_PRESENCE_MAX_SECRET_LENGTH ? DISCORD_PRESENCE_TOO_LONG
+                                                           : DISCORD_PRESENCE_VALID;
+    }
+    return DISCORD_PRESENCE_VALID;
+}
+
+int ValidatePresence(const DiscordRichPresence* presence, uint32_t mask, const char** field)
+{
+    static_assert(DISCORD_PRESENCE_MAX_BUTTON_COUNT == 2, "buttons below");
+    // fields that aren't DISCORD_PRESENCE_FIELD_* get checked whenever all of them do
+    constexpr uint32_t Other = 0x80000000;
+    const struct {
+        const char* name;
+        const char* value;
+        FieldKind kind;
+        uint32_t bit;
+    } fields[] = {
+      {"state", presence->state, FieldKind::Text, DISCORD_PRESENCE_FIELD_STATE},
+      {"state_url", presence->stateUrl, FieldKind::Url, Other},
+      {"details", presence->details, FieldKind::Text, DISCORD_PRESENCE_FIELD_DETAILS},
+      {"details_url", presence->detailsUrl, FieldKind::Url, Other},
+      {"large_image", presence->largeImageKey, FieldKind::Key, Other},
+      {"large_text", presence->largeImageText, FieldKind::Text, Other},
+      {"large_url", presence->largeImageUrl, FieldKind::Url, Other},
+      {"small_image", presence->smallImageKey, FieldKind::Key, Other},
+      {"small_text", presence->smallImageText, FieldKind::Text, Other},
+      {"small_url", presence->smallImageUrl, FieldKind::Url, Other},
+      {"party.id", presence->partyId, FieldKind::Secret, Other},
+      {"secrets.match", presence->matchSecret, FieldKind::Secret, Other},
+      {"secrets.join", presence->joinSecret, FieldKind::Secret, Other},
+      {"secrets.spectate", presence->spectateSecret, FieldKind::Secret, Other},
+      {"buttons[0].label", presence->buttons[0].label, FieldKind::Label, Other},
+      {"buttons[0].url", presence->buttons[0].url, FieldKind::Url, Other},
+      {"buttons[1].label", presence->buttons[1].label, FieldKind::Label, Other},
+      {"buttons[1].url", presence->buttons[1].url, FieldKind::Url, Other},
+    };
+    for (const auto& checked : fields) {
+        if (!(mask & checked.bit)) {
+            continue;
+        }
+        int result = ValidateField(checked.value, checked.kind);
+        if (result != DISCORD_PRESENCE_VALID) {
+            if (field) {
+                *field = checked.name;
+            }
+            return result;
+        }
+    }
+    if (mask & Other) {
+        for (int i = 0; i < DISCORD_PRESENCE_MAX_BUTTON_COUNT; ++i) {
+            const auto& button = presence->buttons[i];
+            if (button.label && button.label[0] && (!button.url || !button.url[0])) {
+                if (field) {
+                    *field = i ? "buttons[1].url" : "buttons[0].url";
+                }
+                return DISCORD_PRESENCE_MISSING_URL;
+            }
+        }
+    }
+    return DISCORD_PRESENCE_VALID;
+}
+
 size_t JsonWriteRichPresenceObj(char* dest,
                                 size_t maxLen,
                                 int nonce,
@@ -104,92 +553,136 @@ size_t JsonWriteRichPresenceObj(char* dest,
 
             if (presence != nullptr) {
                 WriteObject activity(writer, "activity");
+                WriteActivityFields(writer, presence, 0);
+            }
+        }
+    }
 
-                WriteKey(writer, "type");
-                writer.Int(presence->type);
+    return writer.Size();
+}
 
-                WriteKey(writer, "status_display_type");
-                writer.Int(presence->status_display_type);
+constexpr uint32_t TemplateFields = DISCORD_PRESENCE_FIELD_STATE | DISCORD_PRESENCE_FIELD_DETAILS |
+  DISCORD_PRESENCE_FIELD_START_TIMESTAMP | DISCORD_PRESENCE_FIELD_END_TIMESTAMP;
 
-                WriteOptionalString(writer, "state", presence->state);
-                WriteOptionalString(writer, "state_url", presence->stateUrl);
+// Renders the members written by writeFields as they would appear inside an object, without the
+// surrounding braces. Reuses the capacity `out` already has, growing it to fit if needed.
+template <typename WriteFields>
+static void RenderFragment(HookString& out, WriteFields&& writeFields)
+{
+    out.resize(std::max<size_t>(out.capacity(), 256));
+    for (;;) {
+        JsonWriter writer(&out[0], out.size());
+        {
+            WriteObject obj(writer);
+            writeFields(writer);
+        }
+        if (writer.Size() <= out.size()) {
+            out.resize(writer.Size() - 1);
+            out.erase(0, 1);
+            return;
+        }
+        out.resize(writer.Size());
+    }
+}
 
-                WriteOptionalString(writer, "details", presence->details);
-                WriteOptionalString(writer, "details_url", presence->detailsUrl);
+void PresenceTemplateCompile(PresenceTemplate& tmpl, const DiscordRichPresence* presence)
+{
+    RenderFragment(tmpl.staticFields, [&](JsonWriter& writer) {
+        WriteActivityFields(writer, presence, TemplateFields);
+    });
+    PresenceTemplatePatch(tmpl, TemplateFields, presence);
+}
 
-                if (presence->startTimestamp || presence->endTimestamp) {
-                    WriteObject timestamps(writer, "timestamps");
+void PresenceTemplatePatch(PresenceTemplate& tmpl, uint32_t mask, const DiscordRichPresence* fields)
+{
+    if (mask & DISCORD_PRESENCE_FIELD_STATE) {
+        RenderFragment(tmpl.state, [&](JsonWriter& writer) {
+            WriteOptionalText(writer, "state", fields->state, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+        });
+    }
+    if (mask & DISCORD_PRESENCE_FIELD_DETAILS) {
+        RenderFragment(tmpl.details, [&](JsonWriter& writer) {
+            WriteOptionalText(
+              writer, "details", fields->details, DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+        });
+    }
+    if (mask & (DISCORD_PRESENCE_FIELD_START_TIMESTAMP | DISCORD_PRESENCE_FIELD_END_TIMESTAMP)) {
+        if (mask & DISCORD_PRESENCE_FIELD_START_TIMESTAMP) {
+            tmpl.startTimestamp = fields->startTimestamp;
+        }
+        if (mask & DISCORD_PRESENCE_FIELD_END_TIMESTAMP) {
+            tmpl.endTimestamp = fields->endTimestamp;
+        }
+        RenderFragment(tmpl.timestamps, [&](JsonWriter& writer) {
+            WriteTimestamps(writer, tmpl.startTimestamp, tmpl.endTimestamp);
+        });
+    }
+}
 
-                    if (presence->startTimestamp) {
-                        WriteKey(writer, "start");
-                        writer.Int64(presence->startTimestamp);
-                    }
+size_t JsonWritePresenceTemplate(char* dest,
+                                 size_t maxLen,
+                                 int nonce,
+                                 int pid,
+                                 const PresenceTemplate& tmpl)
+{
+    DirectStringBuffer out(dest, maxLen);
+    char number[32];
 
-                    if (presence->endTimestamp) {
-                        WriteKey(writer, "end");
-                        writer.Int64(presence->endTimestamp);
-                    }
-                }
+    out.Put("{\"nonce\":\"");
+    NumberToString(number, nonce);
+    out.Put(number);
+    out.Put("\",\"cmd\":\"SET_ACTIVITY\",\"args\":{\"pid\":");
+    NumberToString(number, pid);
+    out.Put(number);
+    out.Put(",\"activity\":{");
+    out.Put(tmpl.staticFields.data(), tmpl.staticFields.size());
+    for (const HookString* field : {&tmpl.state, &tmpl.details, &tmpl.timestamps}) {
+        if (!field->empty()) {
+            out.Put(',');
+            out.Put(field->data(), field->size());
+        }
+    }
+    out.Put("}}}");
 
-                if ((presence->largeImageKey && presence->largeImageKey[0]) ||
-                    (presence->largeImageText && presence->largeImageText[0]) ||
-                    (presence->smallImageKey && presence->smallImageKey[0]) ||
-                    (presence->smallImageText && presence->smallImageText[0])) {
-                    WriteObject assets(writer, "assets");
-                    WriteOptionalString(writer, "large_image", presence->largeImageKey);
-                    WriteOptionalString(writer, "large_text", presence->largeImageText);
-                    WriteOptionalString(writer, "large_url", presence->largeImageUrl);
-                    WriteOptionalString(writer, "small_image", presence->smallImageKey);
-                    WriteOptionalString(writer, "small_text", presence->smallImageText);
-                    WriteOptionalString(writer, "small_url", presence->smallImageUrl);
-                }
+    return out.GetSize();
+}
 
-                if ((presence->partyId && presence->partyId[0]) || presence->partySize ||
-                    presence->partyMax || presence->partyPrivacy) {
-                    WriteObject party(writer, "party");
-                    WriteOptionalString(writer, "id", presence->partyId);
-                    if (presence->partySize && presence->partyMax) {
-                        WriteArray size(writer, "size");
-                        writer.Int(presence->partySize);
-                        writer.Int(presence->partyMax);
-                    }
-
-                    if (presence->partyPrivacy) {
-                        WriteKey(writer, "privacy");
-                        writer.Int(presence->partyPrivacy);
-                    }
-                }
+size_t JsonWriteActivity(char* dest, size_t maxLen, const DiscordRichPresence* presence)
+{
+    if (presence == nullptr) {
+        return 0;
+    }
+    JsonWriter writer(dest, maxLen);
+    {
+        WriteObject activity(writer);
+        WriteActivityFields(writer, presence, 0);
+    }
+    return writer.Size();
+}
 
-                if (presence->buttons && presence->buttons[0].label) {
-                    WriteArray buttons(writer, "buttons");
-                    for (int i = 0; i < DISCORD_PRESENCE_MAX_BUTTON_COUNT; i++) {
-                        const auto button = presence->buttons[i];
-                        if (!button.label || !button.label[0]) {
-                            continue;
-                        }
-                        WriteObject object(writer);
-                        WriteKey(writer, "label");
-                        writer.String(button.label);
-                        WriteKey(writer, "url");
-                        writer.String(button.url);
-                    }
-                }
-                else if ((presence->matchSecret && presence->matchSecret[0]) ||
-                         (presence->joinSecret && presence->joinSecret[0]) ||
-                         (presence->spectateSecret && presence->spectateSecret[0])) {
-                    WriteObject secrets(writer, "secrets");
-                    WriteOptionalString(writer, "match", presence->matchSecret);
-                    WriteOptionalString(writer, "join", presence->joinSecret);
-                    WriteOptionalString(writer, "spectate", presence->spectateSecret);
-                }
+size_t JsonWriteActivityCommand(char* dest,
+                                size_t maxLen,
+                                int nonce,
+                                int pid,
+                                const char* activity,
+                                size_t activityLength)
+{
+    DirectStringBuffer out(dest, maxLen);
+    char number[32];
 
-                writer.Key("instance");
-                writer.Bool(presence->instance != 0);
-            }
-        }
+    out.Put("{\"nonce\":\"");
+    NumberToString(number, nonce);
+    out.Put(number);
+    out.Put("\",\"cmd\":\"SET_ACTIVITY\",\"args\":{\"pid\":");
+    NumberToString(number, pid);
+    out.Put(number);
+    if (activityLength) {
+        out.Put(",\"activity\":");
+        out.Put(activity, activityLength);
     }
+    out.Put("}}");
 
-    return writer.Size();
+    return out.GetSize();
 }
 
 size_t JsonWriteHandshakeObj(char* dest, size_t maxLen, int version, const char* applicationId)
@@ -207,6 +700,7 @@ size_t JsonWriteHandshakeObj(char* dest, size_t maxLen, int version, const char*
     return writer.Size();
 }
 
+#ifndef DISCORD_PRESENCE_ONLY
 size_t JsonWriteSubscribeCommand(char* dest, size_t maxLen, int nonce, const char* evtName)
 {
     JsonWriter writer(dest, maxLen);
@@ -273,3 +767,312 @@ size_t JsonWriteJoinReply(char* dest, size_t maxLen, const char* userId, int rep
 
     return writer.Size();
 }
+
+#else // DISCORD_PRESENCE_ONLY, where the messages are read with JsonDocument's tiny parser
+
+static void SkipSpace(char*& in)
+{
+    while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') {
+        ++in;
+    }
+}
+
+static int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool ParseHex4(char*& in, uint32_t& codepoint)
+{
+    codepoint = 0;
+    for (int i = 0; i < 4; ++i) {
+        int digit = HexDigit(*in++);
+        if (digit < 0) {
+            return false;
+        }
+        codepoint = codepoint * 16 + (uint32_t)digit;
+    }
+    return true;
+}
+
+// Unescapes the string in is at (its opening quote) and terminates it in place, which
+// always fits: no escape sequence is shorter than what it stands for.
+static const char* ParseString(char*& in)
+{
+    char* out = ++in;
+    const char* string = out;
+    for (;;) {
+        char c = *in++;
+        if (c == '"') {
+            *out = 0;
+            return string;
+        }
+        if ((unsigned char)c < 0x20) {
+            // that includes running into the end of the message
+            return nullptr;
+        }
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+        switch (*in++) {
+        case '"':
+            *out++ = '"';
+            break;
+        case '\\':
+            *out++ = '\\';
+            break;
+        case '/':
+            *out++ = '/';
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u': {
+            uint32_t codepoint;
+            if (!ParseHex4(in, codepoint)) {
+                return nullptr;
+            }
+            if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                // the other half of a surrogate pair has to follow right away
+                if (in[0] != '\\' || in[1] != 'u') {
+                    return nullptr;
+                }
+                in += 2;
+                uint32_t low;
+                if (!ParseHex4(in, low) || low < 0xDC00 || low > 0xDFFF) {
+                    return nullptr;
+                }
+                codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+            }
+            else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+                return nullptr;
+            }
+            if (codepoint < 0x80) {
+                *out++ = (char)codepoint;
+            }
+            else if (codepoint < 0x800) {
+                *out++ = (char)(0xC0 | (codepoint >> 6));
+                *out++ = (char)(0x80 | (codepoint & 0x3F));
+            }
+            else if (codepoint < 0x10000) {
+                *out++ = (char)(0xE0 | (codepoint >> 12));
+                *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+                *out++ = (char)(0x80 | (codepoint & 0x3F));
+            }
+            else {
+                *out++ = (char)(0xF0 | (codepoint >> 18));
+                *out++ = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+                *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+                *out++ = (char)(0x80 | (codepoint & 0x3F));
+            }
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+}
+
+// A number is an Int the way rapidjson's IsInt has it: no fraction or exponent, and it fits.
+static bool ParseNumber(char*& in, JsonValue* value)
+{
+    bool negative = *in == '-';
+    if (negative) {
+        ++in;
+    }
+    if (*in < '0' || *in > '9') {
+        return false;
+    }
+    int64_t number = 0;
+    bool fits = true;
+    for (; *in >= '0' && *in <= '9'; ++in) {
+        number = number * 10 + (*in - '0');
+        if (number > (int64_t)INT32_MAX + 1) {
+            fits = false;
+            number = 0;
+        }
+    }
+    bool integral = *in != '.' && *in != 'e' && *in != 'E';
+    if (*in == '.') {
+        ++in;
+        if (*in < '0' || *in > '9') {
+            return false;
+        }
+        while (*in >= '0' && *in <= '9') {
+            ++in;
+        }
+    }
+    if (*in == 'e' || *in == 'E') {
+        ++in;
+        if (*in == '+' || *in == '-') {
+            ++in;
+        }
+        if (*in < '0' || *in > '9') {
+            return false;
+        }
+        while (*in >= '0' && *in <= '9') {
+            ++in;
+        }
+    }
+    if (negative) {
+        number = -number;
+    }
+    if (value && integral && fits && number >= INT32_MIN && number <= INT32_MAX) {
+        value->type = JsonValue::Type::Int;
+        value->number = (int)number;
+    }
+    return true;
+}
+
+template <size_t Len>
+static bool SkipLiteral(char*& in, const char (&literal)[Len])
+{
+    if (strncmp(in, literal, Len - 1) != 0) {
+        return false;
+    }
+    in += Len - 1;
+    return true;
+}
+
+// A member of parent, which is nested depth deep, or null if it isn't kept.
+JsonValue* JsonDocument::NewValue(JsonValue* parent, JsonValue*& last, const char* name, int depth)
+{
+    if (!parent || depth > MaxKeptDepth ||
+        used_ == (depth == 0 ? MaxValues : MaxValues - TopLevelValues)) {
+        return nullptr;
+    }
+    auto value = &values_[used_++];
+    *value = JsonValue{};
+    value->name = name;
+    (last ? last->next : parent->members) = value;
+    last = value;
+    return value;
+}
+
+// value is where it goes, or null if it's only skipped over
+bool JsonDocument::ParseValue(char*& in, JsonValue* value, int depth)
+{
+    SkipSpace(in);
+    switch (*in) {
+    case '{':
+        if (value) {
+            value->type = JsonValue::Type::Object;
+        }
+        return ParseObject(in, value, depth + 1);
+    case '[':
+        return ParseArray(in, depth + 1);
+    case '"': {
+        auto string = ParseString(in);
+        if (string && value) {
+            value->type = JsonValue::Type::String;
+            value->string = string;
+        }
+        return string != nullptr;
+    }
+    case 't':
+        return SkipLiteral(in, "true");
+    case 'f':
+        return SkipLiteral(in, "false");
+    case 'n':
+        return SkipLiteral(in, "null");
+    default:
+        return ParseNumber(in, value);
+    }
+}
+
+bool JsonDocument::ParseObject(char*& in, JsonValue* object, int depth)
+{
+    if (depth > MaxDepth) {
+        return false;
+    }
+    ++in;
+    SkipSpace(in);
+    if (*in == '}') {
+        ++in;
+        return true;
+    }
+    JsonValue* last = nullptr;
+    for (;;) {
+        SkipSpace(in);
+        const char* name = *in == '"' ? ParseString(in) : nullptr;
+        SkipSpace(in);
+        if (!name || *in++ != ':') {
+            return false;
+        }
+        SkipSpace(in);
+        // only objects, strings and numbers are ever looked up
+        bool keep = *in == '{' || *in == '"' || *in == '-' || (*in >= '0' && *in <= '9');
+        if (!ParseValue(in, keep ? NewValue(object, last, name, depth) : nullptr, depth)) {
+            return false;
+        }
+        SkipSpace(in);
+        char c = *in++;
+        if (c == '}') {
+            return true;
+        }
+        if (c != ',') {
+            return false;
+        }
+    }
+}
+
+bool JsonDocument::ParseArray(char*& in, int depth)
+{
+    if (depth > MaxDepth) {
+        return false;
+    }
+    ++in;
+    SkipSpace(in);
+    if (*in == ']') {
+        ++in;
+        return true;
+    }
+    for (;;) {
+        if (!ParseValue(in, nullptr, depth)) {
+            return false;
+        }
+        SkipSpace(in);
+        char c = *in++;
+        if (c == ']') {
+            return true;
+        }
+        if (c != ',') {
+            return false;
+        }
+    }
+}
+
+JsonDocument& JsonDocument::ParseInsitu(char* message)
+{
+    Reset();
+    SkipSpace(message);
+    if (*message != '{' || !ParseObject(message, this, 0)) {
+        Reset();
+        type = Type::Other;
+    }
+    return *this;
+}
+
+#endif // DISCORD_PRESENCE_ONLY
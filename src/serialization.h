@@ -1,6 +1,11 @@
 #pragma once
 
+#include "allocator.h"
+
+#include <algorithm>
 #include <stdint.h>
+#include <string.h>
+#include <string>
 
 #ifndef __MINGW32__
 #pragma warning(push)
@@ -12,7 +17,9 @@
 #pragma warning(disable : 6313) // Incorrect operator
 #endif                          // __MINGW32__
 
+#ifndef DISCORD_PRESENCE_ONLY
 #include "rapidjson/document.h"
+#endif
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 
@@ -36,6 +43,8 @@ inline size_t StringCopy(char (&dest)[Len], const char* src)
     return copied - 1;
 }
 
+// The JsonWrite* functions return how long what they wrote is. If that's more than maxLen it
+// didn't fit, dest only has the start of it, and a buffer of the returned length would take it all.
 size_t JsonWriteHandshakeObj(char* dest, size_t maxLen, int version, const char* applicationId);
 
 // Commands
@@ -45,11 +54,57 @@ size_t JsonWriteRichPresenceObj(char* dest,
                                 int nonce,
                                 int pid,
                                 const DiscordRichPresence* presence);
+
+// A SET_ACTIVITY command with the fields that change most often (DISCORD_PRESENCE_FIELD_*) kept
+// apart from the rest of the activity, which is only rendered once. Patching a field re-renders
+// just that field, and writing out the whole command is a handful of copies.
+struct PresenceTemplate {
+    HookString staticFields;
+    HookString state;
+    HookString details;
+    HookString timestamps;
+    int64_t startTimestamp{0};
+    int64_t endTimestamp{0};
+};
+void PresenceTemplateCompile(PresenceTemplate& tmpl, const DiscordRichPresence* presence);
+void PresenceTemplatePatch(PresenceTemplate& tmpl,
+                           uint32_t mask,
+                           const DiscordRichPresence* fields);
+size_t JsonWritePresenceTemplate(char* dest,
+                                 size_t maxLen,
+                                 int nonce,
+                                 int pid,
+                                 const PresenceTemplate& tmpl);
+
+// Whether str, length bytes of it, is valid UTF-8: no overlong forms, surrogates or code points
+// past U+10FFFF. chars is set to its length in code points.
+bool ScanUtf8(const char* str, size_t length, size_t& chars);
+// Whether json, length bytes of it, is a single JSON object in UTF-8 and nothing else but white
+// space, so it can be spliced into a message as is.
+bool IsJsonObject(const char* json, size_t length);
+
+// Checks presence the way Discord_ValidatePresence documents, only the DISCORD_PRESENCE_FIELD_*
+// in mask of it for a patch. field may be null.
+int ValidatePresence(const DiscordRichPresence* presence, uint32_t mask, const char** field);
+
+// Just the activity object, for a producer publishing through a broker. Returns 0 for a null
+// presence.
+size_t JsonWriteActivity(char* dest, size_t maxLen, const DiscordRichPresence* presence);
+// SET_ACTIVITY with an activity from JsonWriteActivity, or none if activityLength is 0.
+size_t JsonWriteActivityCommand(char* dest,
+                                size_t maxLen,
+                                int nonce,
+                                int pid,
+                                const char* activity,
+                                size_t activityLength);
+
+#ifndef DISCORD_PRESENCE_ONLY
 size_t JsonWriteSubscribeCommand(char* dest, size_t maxLen, int nonce, const char* evtName);
 
 size_t JsonWriteUnsubscribeCommand(char* dest, size_t maxLen, int nonce, const char* evtName);
 
 size_t JsonWriteJoinReply(char* dest, size_t maxLen, const char* userId, int reply, int nonce);
+#endif
 
 // I want to use as few allocations as I can get away with, and to do that with RapidJson, you need
 // to supply some of your own allocators for stuff rather than use the defaults
@@ -109,32 +164,40 @@ public:
 };
 
 // wonder why this isn't a thing already, maybe I missed it
+// What doesn't fit in maxLen is dropped, but still counted: GetSize() is what it would have taken.
 class DirectStringBuffer {
 public:
     using Ch = char;
     char* buffer_;
-    char* end_;
-    char* current_;
+    size_t maxLen_;
+    size_t size_{0};
 
     DirectStringBuffer(char* buffer, size_t maxLen)
       : buffer_(buffer)
-      , end_(buffer + maxLen)
-      , current_(buffer)
+      , maxLen_(maxLen)
     {
     }
 
     void Put(char c)
     {
-        if (current_ < end_) {
-            *current_++ = c;
+        if (size_ < maxLen_) {
+            buffer_[size_] = c;
+        }
+        ++size_;
+    }
+    void Put(const char* str, size_t length)
+    {
+        if (size_ < maxLen_) {
+            memcpy(buffer_ + size_, str, std::min(length, maxLen_ - size_));
         }
+        size_ += length;
     }
+    void Put(const char* str) { Put(str, strlen(str)); }
     void Flush() {}
-    size_t GetSize() const { return (size_t)(current_ - buffer_); }
+    size_t GetSize() const { return size_; }
+    bool Overflowed() const { return size_ > maxLen_; }
 };
 
-using MallocAllocator = rapidjson::CrtAllocator;
-using PoolAllocator = rapidjson::MemoryPoolAllocator<MallocAllocator>;
 using UTF8 = rapidjson::UTF8<char>;
 // Writer appears to need about 16 bytes per nested object level (with 64bit size_t)
 using StackAllocator = FixedLinearAllocator<2048>;
@@ -156,8 +219,119 @@ public:
     size_t Size() const { return stringBuffer_.GetSize(); }
 };
 
+#ifdef DISCORD_PRESENCE_ONLY
+
+// Without join/spectate all that ever comes back is READY, the responses to our commands and
+// close frames, whose few members are looked up by name. So instead of rapidjson's DOM, messages
+// are read into a fixed table of values: objects, strings and ints, each linked to its parent's
+// members. Only those are kept, and only as deep as anything is looked up (data.user.id at the
+// most); arrays, literals and deeper objects are skipped over without taking up room. What still
+// doesn't fit once the table is full is skipped too, except for the top level's members, which
+// have the last few entries to themselves so a late nonce or evt is never lost.
+struct JsonValue {
+    enum class Type : uint8_t { Other, Object, String, Int };
+
+    const char* name{nullptr};
+    const char* string{nullptr};
+    int number{0};
+    Type type{Type::Other};
+    // the first member of an object, and the next member of the object this is in
+    JsonValue* members{nullptr};
+    JsonValue* next{nullptr};
+};
+
+class JsonDocument : public JsonValue, public HookAllocated {
+public:
+    static constexpr size_t MaxValues = 64;
+    // entries only the top level's members get
+    static constexpr size_t TopLevelValues = 8;
+    // members of objects nested deeper than this aren't kept
+    static constexpr int MaxKeptDepth = 2;
+    // objects nested deeper than this make the message unreadable
+    static constexpr int MaxDepth = 16;
+
+    JsonDocument() { Reset(); }
+
+    void Reset()
+    {
+        type = Type::Object;
+        members = nullptr;
+        used_ = 0;
+    }
+
+    // Strings are unescaped in place, like rapidjson's ParseInsitu. A message that isn't valid
+    // JSON leaves the document without members.
+    JsonDocument& ParseInsitu(char* message);
+
+private:
+    JsonValue* NewValue(JsonValue* parent, JsonValue*& last, const char* name, int depth);
+    bool ParseValue(char*& in, JsonValue* value, int depth);
+    bool ParseObject(char*& in, JsonValue* object, int depth);
+    bool ParseArray(char*& in, int depth);
+
+    JsonValue values_[MaxValues];
+    size_t used_{0};
+};
+
+inline JsonValue* FindMember(JsonValue* obj, const char* name, JsonValue::Type type)
+{
+    if (obj && obj->type == JsonValue::Type::Object) {
+        for (auto member = obj->members; member; member = member->next) {
+            if (member->type == type && strcmp(member->name, name) == 0) {
+                return member;
+            }
+        }
+    }
+    return nullptr;
+}
+
+inline JsonValue* GetObjMember(JsonValue* obj, const char* name)
+{
+    return FindMember(obj, name, JsonValue::Type::Object);
+}
+
+inline int GetIntMember(JsonValue* obj, const char* name, int notFoundDefault = 0)
+{
+    auto member = FindMember(obj, name, JsonValue::Type::Int);
+    return member ? member->number : notFoundDefault;
+}
+
+inline const char* GetStrMember(JsonValue* obj,
+                                const char* name,
+                                const char* notFoundDefault = nullptr)
+{
+    auto member = FindMember(obj, name, JsonValue::Type::String);
+    return member ? member->string : notFoundDefault;
+}
+
+#else
+
+// What the parser falls back to once parseBuffer_ is used up, Discord_SetAllocator's hooks
+class HookJsonAllocator {
+public:
+    static const bool kNeedFree = true;
+    void* Malloc(size_t size) { return size ? DiscordAlloc(size) : nullptr; }
+    void* Realloc(void* originalPtr, size_t originalSize, size_t newSize)
+    {
+        if (newSize == 0) {
+            DiscordFree(originalPtr);
+            return nullptr;
+        }
+        void* ptr = DiscordAlloc(newSize);
+        if (ptr && originalPtr) {
+            memcpy(ptr, originalPtr, std::min(originalSize, newSize));
+            DiscordFree(originalPtr);
+        }
+        return ptr;
+    }
+    static void Free(void* ptr) { DiscordFree(ptr); }
+};
+
+using MallocAllocator = HookJsonAllocator;
+using PoolAllocator = rapidjson::MemoryPoolAllocator<MallocAllocator>;
 using JsonDocumentBase = rapidjson::GenericDocument<UTF8, PoolAllocator, StackAllocator>;
-class JsonDocument : public JsonDocumentBase {
+// Over 34K, so better kept off the stack of the library's threads.
+class JsonDocument : public JsonDocumentBase, public HookAllocated {
 public:
     static const int kDefaultChunkCapacity = 32 * 1024;
     // json parser will use this buffer first, then allocate more if needed; I seriously doubt we
@@ -175,6 +349,14 @@ public:
       , stackAllocator_()
     {
     }
+
+    // Back to an empty object, with whatever the last parse took beyond parseBuffer_ freed, so
+    // the next parse starts out the same as in a new document.
+    void Reset()
+    {
+        SetObject();
+        poolAllocator_.Clear();
+    }
 };
 
 using JsonValue = rapidjson::GenericValue<UTF8, PoolAllocator>;
@@ -213,3 +395,5 @@ inline const char* GetStrMember(JsonValue* obj,
     }
     return notFoundDefault;
 }
+
+#endif // DISCORD_PRESENCE_ONLY
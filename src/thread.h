@@ -0,0 +1,27 @@
+#pragma once
+
+// The library's own threads, started with a name, stack size, priority and CPU affinity, none of
+// which std::thread has a say in. What a platform can't do is left out rather than failing the
+// start: the priority only applies on Linux and Windows (where nice is per thread on the former),
+// and the affinity not on macOS.
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ThreadOptions {
+    const char* name;      // may be null; cut to 15 bytes on Linux
+    size_t stackSize;      // 0 for the platform default, otherwise raised to its minimum
+    int priority;          // -2 (lowest) to 2 (highest), 0 leaves it as it is
+    uint64_t affinityMask; // bit n for CPU n, 0 for any
+};
+
+struct NativeThread : public HookAllocated {
+    // Runs run(arg) on a new thread, null if it couldn't be started.
+    static NativeThread* Start(const ThreadOptions& options, void (*run)(void*), void* arg);
+    // Waits for the thread to finish and frees it.
+    static void Join(NativeThread*&);
+    // Lets the thread finish on its own, and frees what's left of it then.
+    static void Detach(NativeThread*&);
+};
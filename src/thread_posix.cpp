@@ -0,0 +1,147 @@
+#include "thread.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+
+struct NativeThreadPosix : public NativeThread {
+    pthread_t thread{};
+};
+
+// What the new thread needs before it gets to run, freed by it.
+struct ThreadStart : public HookAllocated {
+    void (*run)(void*);
+    void* arg;
+    int priority;
+    char name[16];
+};
+
+static void* ThreadMain(void* data)
+{
+    auto start = static_cast<ThreadStart*>(data);
+#ifdef __APPLE__
+    // only ever for the calling thread there
+    if (start->name[0]) {
+        pthread_setname_np(start->name);
+    }
+#endif
+#ifdef __linux__
+    if (start->priority) {
+        // nice values from 10 (lowest) to -10 (highest); raising it takes CAP_SYS_NICE, without
+        // that it stays as it is
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), -5 * start->priority);
+    }
+#endif
+    auto run = start->run;
+    auto arg = start->arg;
+    delete start;
+    run(arg);
+    return nullptr;
+}
+
+#ifdef __linux__
+// The CPUs in mask that this thread may run on, false if there are none, in which case the new
+// thread runs wherever it likes rather than failing to start.
+static bool AffinityCpus(uint64_t mask, cpu_set_t& cpus)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&cpus);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+    for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu) {
+        if ((mask & ((uint64_t)1 << cpu)) && CPU_ISSET(cpu, &allowed)) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
+#endif
+
+/*static*/ NativeThread* NativeThread::Start(const ThreadOptions& options,
+                                             void (*run)(void*),
+                                             void* arg)
+{
+    auto thread = new (std::nothrow) NativeThreadPosix;
+    auto start = new (std::nothrow) ThreadStart;
+    if (!thread || !start) {
+        delete thread;
+        delete start;
+        return nullptr;
+    }
+    start->run = run;
+    start->arg = arg;
+    start->priority = std::max(-2, std::min(options.priority, 2));
+    start->name[0] = 0;
+    if (options.name) {
+        // Linux takes 15 bytes and the terminator, and fails on anything longer
+        strncat(start->name, options.name, sizeof(start->name) - 1);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (options.stackSize) {
+        pthread_attr_setstacksize(&attr, std::max(options.stackSize, (size_t)PTHREAD_STACK_MIN));
+    }
+#ifdef __linux__
+    cpu_set_t cpus;
+    bool pinned = options.affinityMask && AffinityCpus(options.affinityMask, cpus);
+#ifdef __GLIBC__
+    // set before it starts, so it never runs anywhere else
+    if (pinned) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+#endif
+    int err = pthread_create(&thread->thread, &attr, ThreadMain, start);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        delete thread;
+        delete start;
+        return nullptr;
+    }
+
+#ifdef __linux__
+    if (options.name && options.name[0]) {
+        // start may be gone already
+        char name[16]{};
+        strncat(name, options.name, sizeof(name) - 1);
+        pthread_setname_np(thread->thread, name);
+    }
+#ifndef __GLIBC__
+    // without pthread_attr_setaffinity_np it's moved there right after starting
+    if (pinned) {
+        pthread_setaffinity_np(thread->thread, sizeof(cpus), &cpus);
+    }
+#endif
+#endif
+    return thread;
+}
+
+/*static*/ void NativeThread::Join(NativeThread*& t)
+{
+    auto thread = static_cast<NativeThreadPosix*>(t);
+    if (thread) {
+        pthread_join(thread->thread, nullptr);
+        delete thread;
+    }
+    t = nullptr;
+}
+
+/*static*/ void NativeThread::Detach(NativeThread*& t)
+{
+    auto thread = static_cast<NativeThreadPosix*>(t);
+    if (thread) {
+        pthread_detach(thread->thread);
+        delete thread;
+    }
+    t = nullptr;
+}
@@ -0,0 +1,107 @@
+#include "thread.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMCX
+#define NOSERVICE
+#define NOIME
+#define NOMINMAX
+#include <process.h>
+#include <windows.h>
+
+#include <algorithm>
+
+struct NativeThreadWin : public NativeThread {
+    HANDLE thread{nullptr};
+};
+
+struct ThreadStart : public HookAllocated {
+    void (*run)(void*);
+    void* arg;
+};
+
+static unsigned __stdcall ThreadMain(void* data)
+{
+    auto start = static_cast<ThreadStart*>(data);
+    auto run = start->run;
+    auto arg = start->arg;
+    delete start;
+    run(arg);
+    return 0;
+}
+
+// SetThreadDescription is Windows 10 1607 and up, so it's looked up rather than linked against.
+static void SetThreadName(HANDLE thread, const char* name)
+{
+    using SetThreadDescriptionFn = HRESULT(WINAPI*)(HANDLE, PCWSTR);
+    auto kernel = GetModuleHandleW(L"kernel32.dll");
+    auto setDescription = kernel
+      ? (SetThreadDescriptionFn)GetProcAddress(kernel, "SetThreadDescription")
+      : nullptr;
+    wchar_t wideName[64];
+    if (setDescription &&
+        MultiByteToWideChar(CP_UTF8, 0, name, -1, wideName, (int)(sizeof(wideName) / 2)) > 0) {
+        setDescription(thread, wideName);
+    }
+}
+
+/*static*/ NativeThread* NativeThread::Start(const ThreadOptions& options,
+                                             void (*run)(void*),
+                                             void* arg)
+{
+    auto thread = new (std::nothrow) NativeThreadWin;
+    auto start = new (std::nothrow) ThreadStart;
+    if (!thread || !start) {
+        delete thread;
+        delete start;
+        return nullptr;
+    }
+    start->run = run;
+    start->arg = arg;
+
+    // suspended, so it only runs once it's all set up
+    thread->thread = (HANDLE)_beginthreadex(nullptr,
+                                            (unsigned)options.stackSize,
+                                            ThreadMain,
+                                            start,
+                                            CREATE_SUSPENDED | STACK_SIZE_PARAM_IS_A_RESERVATION,
+                                            nullptr);
+    if (!thread->thread) {
+        delete thread;
+        delete start;
+        return nullptr;
+    }
+    if (options.name && options.name[0]) {
+        SetThreadName(thread->thread, options.name);
+    }
+    if (options.priority) {
+        // THREAD_PRIORITY_LOWEST to THREAD_PRIORITY_HIGHEST are -2 to 2
+        SetThreadPriority(thread->thread, std::max(-2, std::min(options.priority, 2)));
+    }
+    if (options.affinityMask) {
+        SetThreadAffinityMask(thread->thread, (DWORD_PTR)options.affinityMask);
+    }
+    ResumeThread(thread->thread);
+    return thread;
+}
+
+/*static*/ void NativeThread::Join(NativeThread*& t)
+{
+    auto thread = static_cast<NativeThreadWin*>(t);
+    if (thread) {
+        WaitForSingleObject(thread->thread, INFINITE);
+        CloseHandle(thread->thread);
+        delete thread;
+    }
+    t = nullptr;
+}
+
+/*static*/ void NativeThread::Detach(NativeThread*& t)
+{
+    auto thread = static_cast<NativeThreadWin*>(t);
+    if (thread) {
+        // the thread keeps running without its handle
+        CloseHandle(thread->thread);
+        delete thread;
+    }
+    t = nullptr;
+}
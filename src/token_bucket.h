@@ -0,0 +1,37 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+
+// Lets through up to capacity events per period, in bursts of up to capacity, with a token coming
+// back every period / capacity. Kept as the time the bucket is full again, so there is nothing to
+// refill and the time the next token comes back is a subtraction away.
+struct TokenBucket {
+    int64_t intervalUs;
+    int64_t capacityUs;
+    // written by whoever takes tokens, read by anyone asking when the next one comes back
+    std::atomic<int64_t> fullAtUs{0};
+
+    TokenBucket(uint32_t capacity, int64_t periodUs)
+      : intervalUs(std::max<int64_t>(periodUs / std::max<uint32_t>(capacity, 1), 1))
+      , capacityUs(intervalUs * std::max<uint32_t>(capacity, 1))
+    {
+    }
+
+    int64_t nextTokenUs() const { return fullAtUs.load() - capacityUs + intervalUs; }
+
+    bool ready(int64_t nowUs) const { return nextTokenUs() <= nowUs; }
+
+    bool take(int64_t nowUs)
+    {
+        if (!ready(nowUs)) {
+            return false;
+        }
+        fullAtUs.store(std::max(fullAtUs.load(), nowUs) + intervalUs);
+        return true;
+    }
+
+    // Gives back the token just taken, for an event that didn't happen after all.
+    void refund() { fullAtUs.store(fullAtUs.load() - intervalUs); }
+};
@@ -0,0 +1,236 @@
+/*
+    Checks that everything the library allocates goes through the hooks set with
+    Discord_SetAllocator: it runs the library through a connection, a few presence updates and a
+    shutdown against a fake Discord client, and fails if the global operator new was used, if a
+    block taken from the hooks wasn't handed back by the end, or if anything was allocated at all
+    once the connection was up and the first update had gone out.
+*/
+
+#include <atomic>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "discord_rpc.h"
+
+static std::atomic<size_t> GlobalNews{0};
+static std::atomic<size_t> HookAllocs{0};
+static std::atomic<size_t> HookFrees{0};
+
+void* operator new(size_t size)
+{
+    ++GlobalNews;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static void* CountingAlloc(size_t size, void*)
+{
+    ++HookAllocs;
+    return malloc(size);
+}
+
+static void CountingFree(void* ptr, void*)
+{
+    ++HookFrees;
+    free(ptr);
+}
+
+// The fake client: answers the handshake with READY and every command with a response carrying
+// its nonce, until the library closes the connection.
+struct FakeClient {
+    int listenFd;
+    char path[sizeof(sockaddr_un::sun_path)];
+};
+
+static bool ReadAll(int fd, void* data, size_t length)
+{
+    auto bytes = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t got = read(fd, bytes, length);
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        length -= (size_t)got;
+    }
+    return true;
+}
+
+static void SendFrame(int fd, uint32_t opcode, const char* json)
+{
+    uint32_t header[2] = {opcode, (uint32_t)strlen(json)};
+    if (write(fd, header, sizeof(header)) < 0 || write(fd, json, header[1]) < 0) {
+        // the library went away, which the next read notices
+    }
+}
+
+static void* RunFakeClient(void* arg)
+{
+    auto client = static_cast<FakeClient*>(arg);
+    int fd = accept(client->listenFd, nullptr, nullptr);
+    if (fd == -1) {
+        return nullptr;
+    }
+    static char body[64 * 1024];
+    uint32_t header[2];
+    while (ReadAll(fd, header, sizeof(header)) && header[1] < sizeof(body) &&
+           ReadAll(fd, body, header[1])) {
+        body[header[1]] = 0;
+        if (header[0] == 0) {
+            SendFrame(fd,
+                      1,
+                      "{\"cmd\":\"DISPATCH\",\"evt\":\"READY\",\"data\":{\"v\":1,\"user\":"
+                      "{\"id\":\"1\",\"username\":\"test\",\"discriminator\":\"0\"}}}");
+        }
+        else if (header[0] == 1) {
+            char response[128];
+            const char* nonce = strstr(body, "\"nonce\":\"");
+            int number = nonce ? atoi(nonce + 9) : 0;
+            snprintf(response,
+                     sizeof(response),
+                     "{\"cmd\":\"SET_ACTIVITY\",\"evt\":null,\"nonce\":\"%d\",\"data\":{}}",
+                     number);
+            SendFrame(fd, 1, response);
+        }
+        else if (header[0] == 2) {
+            break;
+        }
+    }
+    close(fd);
+    return nullptr;
+}
+
+static std::atomic<int> ReadyCount{0};
+
+static void HandleReady(const char*, const DiscordUser*)
+{
+    ++ReadyCount;
+}
+
+int main()
+{
+    char runtimeDir[] = "/tmp/discord-alloc-test-XXXXXX";
+    if (!mkdtemp(runtimeDir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("XDG_RUNTIME_DIR", runtimeDir, 1);
+
+    FakeClient client{};
+    snprintf(client.path, sizeof(client.path), "%s/discord-ipc-0", runtimeDir);
+    client.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, client.path, sizeof(client.path));
+    if (client.listenFd == -1 ||
+        bind(client.listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(client.listenFd, 1) == -1) {
+        perror("listen");
+        return 1;
+    }
+    pthread_t clientThread;
+    pthread_create(&clientThread, nullptr, RunFakeClient, &client);
+
+    size_t newsBefore = GlobalNews.load();
+    Discord_SetAllocator(CountingAlloc, CountingFree, nullptr);
+
+    DiscordEventHandlers handlers;
+    memset(&handlers, 0, sizeof(handlers));
+    handlers.ready = HandleReady;
+    Discord_Initialize("345229890980937739", &handlers, 0, nullptr);
+    for (int i = 0; i < 50 && ReadyCount.load() == 0; ++i) {
+        Discord_WaitForEvents(100);
+        Discord_RunCallbacks();
+    }
+
+    char state[32];
+    DiscordRichPresence presence;
+    memset(&presence, 0, sizeof(presence));
+    presence.details = "Allocation test";
+    presence.largeImageKey = "canary";
+    presence.state = state;
+    size_t steadyAllocs = 0;
+    for (int i = 0; i <= 20; ++i) {
+        snprintf(state, sizeof(state), "Update %d", i);
+        Discord_UpdatePresence(&presence);
+        Discord_WaitForEvents(20);
+        Discord_RunCallbacks();
+        if (i == 0) {
+            // from here on the buffers are all there, updating takes nothing new
+            steadyAllocs = HookAllocs.load();
+        }
+    }
+    steadyAllocs = HookAllocs.load() - steadyAllocs;
+    Discord_ShutdownEx(1000, DISCORD_SHUTDOWN_CLEAR_PRESENCE);
+
+    size_t news = GlobalNews.load() - newsBefore;
+    size_t allocs = HookAllocs.load();
+    size_t frees = HookFrees.load();
+    Discord_SetAllocator(nullptr, nullptr, nullptr);
+
+    // wakes the fake client up in case the library never connected
+    shutdown(client.listenFd, SHUT_RDWR);
+    pthread_join(clientThread, nullptr);
+    close(client.listenFd);
+    unlink(client.path);
+    rmdir(runtimeDir);
+
+    printf("ready=%d hook allocs=%zu frees=%zu steady allocs=%zu global new=%zu\n",
+           ReadyCount.load(),
+           allocs,
+           frees,
+           steadyAllocs,
+           news);
+    if (ReadyCount.load() == 0) {
+        fprintf(stderr, "never connected to the fake client\n");
+        return 1;
+    }
+    if (allocs == 0 || allocs != frees) {
+        fprintf(stderr, "%zu blocks from the hooks weren't freed\n", allocs - frees);
+        return 1;
+    }
+    if (steadyAllocs != 0) {
+        fprintf(stderr, "%zu blocks were allocated during the later updates\n", steadyAllocs);
+        return 1;
+    }
+    if (news != 0) {
+        fprintf(stderr, "the global operator new was used %zu times\n", news);
+        return 1;
+    }
+    return 0;
+}
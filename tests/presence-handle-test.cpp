@@ -0,0 +1,133 @@
+/*
+    Frees a compiled presence while another thread is in the middle of patching it. The free
+    can't wait for the patch, which has to go on with a handle that's still there and free it once
+    that's done. The patching thread is held up inside Discord_UpdatePresenceFields by the
+    allocator hooks until the handle was freed, and the hooks also tell whether it was freed in
+    the end.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+#include "discord_rpc.h"
+
+static std::atomic<size_t> HookAllocs{0};
+static std::atomic<size_t> HookFrees{0};
+
+// Set on the patching thread while it's in Discord_UpdatePresenceFields. Its state is all quotes,
+// which escaped don't fit the 256 bytes the compiled one got, so the patch has to grow that while
+// it only holds the handle's lock.
+static thread_local bool Patching = false;
+static std::mutex StepMutex;
+static std::condition_variable StepChanged;
+static bool PatchEntered = false;
+static bool HandleFreed = false;
+static bool FreeWaited = false;
+
+static void* CountingAlloc(size_t size, void*)
+{
+    ++HookAllocs;
+    if (Patching && size > 256) {
+        // the patch is under way: let the main thread free the handle, then go on
+        Patching = false;
+        std::unique_lock<std::mutex> lock(StepMutex);
+        PatchEntered = true;
+        StepChanged.notify_all();
+        if (!StepChanged.wait_for(lock, std::chrono::seconds(2), [] { return HandleFreed; })) {
+            FreeWaited = true;
+        }
+    }
+    return malloc(size ? size : 1);
+}
+
+static void CountingFree(void* ptr, void*)
+{
+    if (ptr) {
+        ++HookFrees;
+    }
+    free(ptr);
+}
+
+int main()
+{
+    // no Discord client to be found, presence only goes as far as the context
+    char runtimeDir[] = "/tmp/discord-rpc-handle-test-XXXXXX";
+    if (!mkdtemp(runtimeDir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("XDG_RUNTIME_DIR", runtimeDir, 1);
+    Discord_SetAllocator(CountingAlloc, CountingFree, nullptr);
+
+    DiscordEventHandlers handlers;
+    memset(&handlers, 0, sizeof(handlers));
+    Discord_Initialize("345229890980937739", &handlers, 0, nullptr);
+
+    DiscordRichPresence presence;
+    memset(&presence, 0, sizeof(presence));
+    presence.state = "Compiled";
+    presence.details = "Handle test";
+    int rounds = 0;
+    bool stuck = false;
+    for (; rounds < 50 && !stuck && !FreeWaited; ++rounds) {
+        DiscordPresenceHandle* handle = Discord_CompilePresence(&presence);
+        if (!handle) {
+            fprintf(stderr, "couldn't compile the presence\n");
+            return 1;
+        }
+        Discord_UpdatePresenceHandle(handle);
+        PatchEntered = HandleFreed = false;
+
+        std::thread patcher([handle] {
+            DiscordRichPresence fields;
+            memset(&fields, 0, sizeof(fields));
+            char state[DISCORD_PRESENCE_MAX_TEXT_LENGTH + 1];
+            memset(state, '"', DISCORD_PRESENCE_MAX_TEXT_LENGTH);
+            state[DISCORD_PRESENCE_MAX_TEXT_LENGTH] = 0;
+            fields.state = state;
+            Patching = true;
+            Discord_UpdatePresenceFields(handle, DISCORD_PRESENCE_FIELD_STATE, &fields);
+            Patching = false;
+        });
+        {
+            std::unique_lock<std::mutex> lock(StepMutex);
+            stuck = !StepChanged.wait_for(
+              lock, std::chrono::seconds(5), [] { return PatchEntered; });
+        }
+        Discord_FreePresence(handle);
+        {
+            std::lock_guard<std::mutex> lock(StepMutex);
+            HandleFreed = true;
+        }
+        StepChanged.notify_all();
+        patcher.join();
+    }
+    Discord_Shutdown();
+
+    size_t allocs = HookAllocs.load();
+    size_t frees = HookFrees.load();
+    Discord_SetAllocator(nullptr, nullptr, nullptr);
+    rmdir(runtimeDir);
+
+    printf("rounds=%d hook allocs=%zu frees=%zu\n", rounds, allocs, frees);
+    if (stuck) {
+        fprintf(stderr, "Discord_UpdatePresenceFields never grew the state\n");
+        return 1;
+    }
+    if (FreeWaited) {
+        fprintf(stderr, "Discord_FreePresence waited for the patch\n");
+        return 1;
+    }
+    if (allocs != frees) {
+        fprintf(stderr, "%zu blocks from the hooks weren't freed\n", allocs - frees);
+        return 1;
+    }
+    return 0;
+}